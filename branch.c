@@ -0,0 +1,74 @@
+#include "branch.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static void wait_for_one(Branch *branches, pid_t *pids, int count);
+
+int Branch_fork(Branch *branches, int count, int jobs)
+{
+    assert(branches != NULL && count >= 0);
+    assert(jobs > 0);
+
+    pid_t *pids = calloc(count > 0 ? count : 1, sizeof(pid_t));
+    assert(pids != NULL);
+    fflush(stdout);
+    fflush(stderr);
+
+    int running = 0;
+    for (int i = 0; i < count; i++) {
+        if (running == jobs) {
+            wait_for_one(branches, pids, i);
+            running--;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            free(pids);
+            if (freopen(branches[i].input, "r", stdin) == NULL ||
+                freopen(branches[i].output, "w", stdout) == NULL) {
+                fprintf(stderr, "Could not open the files of branch %s\n",
+                        branches[i].input);
+                _exit(EXIT_FAILURE);
+            }
+            return i;
+        }
+
+        branches[i].status = -1;
+        pids[i] = pid;
+        running += pid > 0;
+    }
+    for (; running > 0; running--)
+        wait_for_one(branches, pids, count);
+
+    free(pids);
+    return -1;
+}
+
+/*
+ * Waits for one of the first count children to exit, and records its
+ * status. Other children of the process are reaped and ignored.
+ */
+static void wait_for_one(Branch *branches, pid_t *pids, int count)
+{
+    for (;;) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0 && errno == EINTR)
+            continue;
+        if (pid < 0)
+            return;
+
+        for (int i = 0; i < count; i++) {
+            if (pids[i] == pid) {
+                branches[i].status = status;
+                pids[i] = 0;
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef BRANCH_INCLUDED
+#define BRANCH_INCLUDED
+
+/*
+ * Continuations of a run on different inputs, each in a child process forked
+ * from the one that brought the VM to the point of branching. The children
+ * share their parent's memory copy-on-write, segments and translations
+ * included, so the state reached is neither copied up front nor rebuilt
+ * for every branch.
+ */
+typedef struct Branch {
+    const char *input;  /* the file the branch reads as standard input */
+    const char *output; /* the file its standard output goes to */
+    int status;         /* its wait status, or -1 if it could not be forked */
+} Branch;
+
+/*
+ * Branch_fork
+ *
+ * Forks a child for every branch, at most jobs at a time, with standard
+ * input and output redirected to the branch's files. Standard output is
+ * flushed first, so that nothing written before is written again. A child
+ * that cannot open its files exits with EXIT_FAILURE. Only the calling
+ * thread is forked, so other threads of the parent must not hold locks the
+ * children need.
+ *
+ * @param  Branch *branches     The branches to run; their statuses are set
+ *                              in the parent
+ * @param  int count            The number of branches
+ * @param  int jobs             The most children to run at once
+ * @return int                  In a child, the index of its branch, to carry
+ *                              on with the run; in the parent, -1 once every
+ *                              child has exited
+ * @expect jobs is positive
+ */
+int Branch_fork(Branch *branches, int count, int jobs);
+
+#endif
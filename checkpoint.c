@@ -0,0 +1,581 @@
+#include "checkpoint.h"
+#include "hugepages.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <mem.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC 0x50434d55u /* "UMCP" */
+#define TRAILER_MAGIC 0x45434d55u    /* "UMCE" */
+#define CHECKPOINT_VERSION 1u
+#define PATH_LEN 4096
+
+#define HASH_SEED 0x9e3779b97f4a7c15ull
+#define HASH_PRIME 0xff51afd7ed558ccdull
+
+typedef enum Kind { KIND_BASE, KIND_DELTA } Kind;
+
+/*
+ * OP_MAP       The segment is mapped afresh, zeroed, with size arg; in a
+ *              delta it may replace one of the same index
+ * OP_UNMAP     The segment is gone
+ * OP_PAGE      Page arg of the segment holds the words that follow
+ * OP_END       The end of the record
+ */
+typedef enum Op { OP_MAP, OP_UNMAP, OP_PAGE, OP_END } Op;
+
+/*
+ * A checkpoint is a record: this header, then entries in increasing order of
+ * segment index, each OP_PAGE followed by its words, then a trailer. Words are
+ * in the machine's byte order, like the translation cache's.
+ */
+typedef struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t kind;
+    uint32_t pc;
+    uint32_t registers[8];
+    uint64_t steps;
+    int64_t input;
+    uint32_t arena;
+    uint32_t unused;
+} Header;
+
+typedef struct Entry {
+    uint32_t op;
+    uint32_t index;
+    uint32_t arg;
+    uint32_t words;
+} Entry;
+
+typedef struct Trailer {
+    uint64_t bytes; /* of the whole record, trailer included */
+    uint32_t magic;
+    uint32_t unused;
+} Trailer;
+
+/*
+ * What the file holds of a page: the hash of its words, and the offset of the
+ * latest copy of them, or 0 if it has never been written because it is zero.
+ */
+typedef struct Saved {
+    uint64_t hash;
+    uint64_t offset;
+} Saved;
+
+/*
+ * What the last checkpoint saved of a segment: its size and its pages, kept
+ * inline for a segment of at most one page.
+ */
+typedef struct Tracked {
+    uint32_t index;
+    uint32_t size;
+    Saved page;
+    Saved *pages;
+} Tracked;
+
+struct Checkpoint {
+    char *path;
+    Tracked *tracked; /* by index */
+    uint32_t count;
+    bool have_base; /* whether the file ends in a chain on top of ours */
+    uint64_t base_bytes;
+    uint64_t delta_bytes; /* since the base */
+};
+
+/*
+ * A record being written. Errors are only checked at the end.
+ */
+typedef struct Writer {
+    FILE *fp;
+    uint64_t start; /* the offset of the record in the file */
+    uint64_t bytes;
+    bool ok;
+} Writer;
+
+/*
+ * A segment of a snapshot.
+ */
+typedef struct Image {
+    uint32_t index;
+    uint32_t size;
+    uint32_t *data; /* allocated with HugePages_alloc */
+} Image;
+
+struct Snapshot {
+    Image *segments; /* by index */
+    uint32_t count;
+};
+
+static Tracked save_segment(Writer *out, uint32_t index, Segment *segment,
+                            const Tracked *prev, int saved_fd);
+static bool same_words(int fd, uint64_t offset, const uint32_t *words,
+                       uint32_t count);
+static void write_entry(Writer *out, Op op, uint32_t index, uint32_t arg,
+                        uint32_t words, const uint32_t *data);
+static void write_bytes(Writer *out, const void *data, size_t bytes);
+static void free_tracked(Tracked *tracked, uint32_t count);
+static bool scan_record(FILE *fp, Header *header);
+static bool apply_record(FILE *fp, Snapshot snapshot);
+static void push_image(Image **images, uint32_t *count, uint32_t *capacity,
+                       Image image);
+static uint64_t hash_words(const uint32_t *words, uint32_t count);
+static bool all_zero(const uint32_t *words, uint32_t count);
+
+static inline uint32_t page_count(uint32_t size)
+{
+    return (uint32_t)(((uint64_t)size + CHECKPOINT_PAGE_WORDS - 1) /
+                      CHECKPOINT_PAGE_WORDS);
+}
+
+static inline uint32_t page_words(uint32_t size, uint32_t page)
+{
+    uint32_t left = size - page * CHECKPOINT_PAGE_WORDS;
+    return left < CHECKPOINT_PAGE_WORDS ? left : CHECKPOINT_PAGE_WORDS;
+}
+
+Checkpoint new_checkpoint(const char *path)
+{
+    assert(path != NULL);
+
+    Checkpoint checkpoint;
+    NEW(checkpoint);
+    checkpoint->path = ALLOC(strlen(path) + 1);
+    strcpy(checkpoint->path, path);
+    checkpoint->tracked = NULL;
+    checkpoint->count = 0;
+    checkpoint->have_base = false;
+    checkpoint->base_bytes = 0;
+    checkpoint->delta_bytes = 0;
+
+    return checkpoint;
+}
+
+void free_checkpoint(Checkpoint *checkpoint)
+{
+    assert(checkpoint != NULL && *checkpoint != NULL);
+
+    free_tracked((*checkpoint)->tracked, (*checkpoint)->count);
+    FREE((*checkpoint)->path);
+    FREE(*checkpoint);
+}
+
+bool Checkpoint_save(Checkpoint checkpoint, Memory mem,
+                     const CheckpointState *state)
+{
+    assert(checkpoint != NULL && mem != NULL && state != NULL);
+
+    // A base goes to a file of its own that replaces the chain once written
+    bool base = !checkpoint->have_base ||
+                checkpoint->delta_bytes > checkpoint->base_bytes;
+    char tmp_path[PATH_LEN + 32];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", checkpoint->path,
+             (long)getpid());
+    Writer out = {fopen(base ? tmp_path : checkpoint->path, base ? "wb" : "ab"),
+                  0, 0, true};
+    if (out.fp == NULL) {
+        checkpoint->have_base = false;
+        return false;
+    }
+    long end = fseek(out.fp, 0, SEEK_END) == 0 ? ftell(out.fp) : -1;
+    out.ok = end >= 0;
+    out.start = end >= 0 ? (uint64_t)end : 0;
+
+    // A delta reads back the pages it compares against from the file
+    int saved_fd = base ? -1 : open(checkpoint->path, O_RDONLY);
+
+    Header header = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION,
+                     base ? KIND_BASE : KIND_DELTA, state->pc, {0},
+                     state->steps, state->input, state->arena, 0};
+    memcpy(header.registers, state->registers, sizeof(header.registers));
+    write_bytes(&out, &header, sizeof(header));
+
+    // Walk the segments alongside those of the last checkpoint, which a base
+    // ignores
+    Tracked *old = checkpoint->tracked;
+    uint32_t old_count = base ? 0 : checkpoint->count;
+    uint32_t capacity = checkpoint->count > 0 ? checkpoint->count : 16;
+    Tracked *tracked = ALLOC(capacity * sizeof(Tracked));
+    uint32_t count = 0;
+    uint32_t i = 0;
+    uint32_t index = 0;
+    do {
+        for (; i < old_count && old[i].index < index; i++)
+            write_entry(&out, OP_UNMAP, old[i].index, 0, 0, NULL);
+
+        // A segment of another size under the same index is a new one
+        Segment *segment = get_segment(mem, index);
+        const Tracked *prev = NULL;
+        if (i < old_count && old[i].index == index) {
+            if (old[i].size == segment->size)
+                prev = &old[i];
+            i++;
+        }
+
+        if (count == capacity) {
+            capacity *= 2;
+            RESIZE(tracked, capacity * sizeof(Tracked));
+        }
+        tracked[count++] = save_segment(&out, index, segment, prev, saved_fd);
+        index = next_segment(mem, index);
+    } while (index != 0);
+    for (; i < old_count; i++)
+        write_entry(&out, OP_UNMAP, old[i].index, 0, 0, NULL);
+    write_entry(&out, OP_END, 0, 0, 0, NULL);
+
+    Trailer trailer = {out.bytes + sizeof(Trailer), TRAILER_MAGIC, 0};
+    write_bytes(&out, &trailer, sizeof(trailer));
+    if (saved_fd >= 0)
+        close(saved_fd);
+    bool ok = out.ok && fflush(out.fp) == 0 && fsync(fileno(out.fp)) == 0;
+    ok = fclose(out.fp) == 0 && ok;
+    if (base && ok)
+        ok = rename(tmp_path, checkpoint->path) == 0;
+    if (base && !ok)
+        remove(tmp_path);
+
+    // The offsets only stand for what is in the file
+    if (!ok) {
+        free_tracked(tracked, count);
+        checkpoint->have_base = false;
+        return false;
+    }
+    free_tracked(checkpoint->tracked, checkpoint->count);
+    checkpoint->tracked = tracked;
+    checkpoint->count = count;
+    checkpoint->have_base = true;
+    if (base) {
+        checkpoint->base_bytes = out.bytes;
+        checkpoint->delta_bytes = 0;
+    } else {
+        checkpoint->delta_bytes += out.bytes;
+    }
+
+    return true;
+}
+
+/*
+ * Writes the entries for one segment: an OP_MAP and its pages that are not
+ * zero if it is new, or else the pages that have changed. A page whose hash
+ * has not changed is compared with its copy in the file before it is
+ * skipped, so a collision cannot lose a change. Returns what was saved of
+ * it.
+ */
+static Tracked save_segment(Writer *out, uint32_t index, Segment *segment,
+                            const Tracked *prev, int saved_fd)
+{
+    uint32_t size = segment->size;
+    uint32_t pages = page_count(size);
+    Tracked tracked = {index, size, {0, 0}, NULL};
+    if (pages > 1)
+        tracked.pages = ALLOC(pages * sizeof(Saved));
+    Saved *saved = pages > 1 ? tracked.pages : &tracked.page;
+    const Saved *old = NULL;
+    if (prev != NULL)
+        old = pages > 1 ? prev->pages : &prev->page;
+
+    if (prev == NULL)
+        write_entry(out, OP_MAP, index, size, 0, NULL);
+    for (uint32_t page = 0; page < pages; page++) {
+        const uint32_t *words =
+            segment->data + (size_t)page * CHECKPOINT_PAGE_WORDS;
+        uint32_t count = page_words(size, page);
+        saved[page].hash = hash_words(words, count);
+        bool changed = old != NULL
+                           ? saved[page].hash != old[page].hash ||
+                                 !same_words(saved_fd, old[page].offset,
+                                             words, count)
+                           : !all_zero(words, count);
+        if (!changed) {
+            saved[page].offset = old != NULL ? old[page].offset : 0;
+            continue;
+        }
+        saved[page].offset = out->start + out->bytes + sizeof(Entry);
+        write_entry(out, OP_PAGE, index, page, count, words);
+    }
+
+    return tracked;
+}
+
+/*
+ * Tells whether the words of a page match the copy of them at the given
+ * offset in the file, or are zero if the offset is 0. A copy that cannot be
+ * read does not match.
+ */
+static bool same_words(int fd, uint64_t offset, const uint32_t *words,
+                       uint32_t count)
+{
+    if (offset == 0)
+        return all_zero(words, count);
+
+    uint32_t copy[CHECKPOINT_PAGE_WORDS];
+    size_t bytes = (size_t)count * sizeof(uint32_t);
+    return fd >= 0 && pread(fd, copy, bytes, (off_t)offset) == (ssize_t)bytes &&
+           memcmp(copy, words, bytes) == 0;
+}
+
+static void write_entry(Writer *out, Op op, uint32_t index, uint32_t arg,
+                        uint32_t words, const uint32_t *data)
+{
+    Entry entry = {op, index, arg, words};
+    write_bytes(out, &entry, sizeof(entry));
+    if (words > 0)
+        write_bytes(out, data, (size_t)words * sizeof(uint32_t));
+}
+
+static void write_bytes(Writer *out, const void *data, size_t bytes)
+{
+    out->ok = fwrite(data, 1, bytes, out->fp) == bytes && out->ok;
+    out->bytes += bytes;
+}
+
+static void free_tracked(Tracked *tracked, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+        if (tracked[i].pages != NULL)
+            FREE(tracked[i].pages);
+    if (tracked != NULL)
+        FREE(tracked);
+}
+
+Snapshot load_checkpoint(const char *path, CheckpointState *state)
+{
+    assert(path != NULL && state != NULL);
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+
+    // Find the complete records first, so that a torn one at the end is
+    // never half applied
+    Header header, last = {0};
+    int records = 0;
+    while (scan_record(fp, &header)) {
+        if (records == 0 && header.kind != KIND_BASE)
+            break;
+        last = header;
+        records++;
+    }
+    if (records == 0) {
+        fclose(fp);
+        return NULL;
+    }
+
+    Snapshot snapshot;
+    NEW(snapshot);
+    snapshot->segments = NULL;
+    snapshot->count = 0;
+    rewind(fp);
+    for (int i = 0; i < records; i++) {
+        if (!apply_record(fp, snapshot)) {
+            fclose(fp);
+            free_snapshot(&snapshot);
+            return NULL;
+        }
+    }
+    fclose(fp);
+
+    memcpy(state->registers, last.registers, sizeof(state->registers));
+    state->pc = last.pc;
+    state->steps = last.steps;
+    state->input = last.input;
+    state->arena = last.arena != 0;
+
+    return snapshot;
+}
+
+/*
+ * Reads a record without applying it. Returns whether it is complete and
+ * well formed, with the header in header.
+ */
+static bool scan_record(FILE *fp, Header *header)
+{
+    long start = ftell(fp);
+    if (fread(header, sizeof(*header), 1, fp) != 1 ||
+        header->magic != CHECKPOINT_MAGIC ||
+        header->version != CHECKPOINT_VERSION || header->kind > KIND_DELTA)
+        return false;
+
+    Entry entry;
+    do {
+        if (fread(&entry, sizeof(entry), 1, fp) != 1 || entry.op > OP_END ||
+            entry.words > CHECKPOINT_PAGE_WORDS)
+            return false;
+        if (entry.words > 0 &&
+            fseek(fp, (long)entry.words * sizeof(uint32_t), SEEK_CUR) != 0)
+            return false;
+    } while (entry.op != OP_END);
+
+    Trailer trailer;
+    return fread(&trailer, sizeof(trailer), 1, fp) == 1 &&
+           trailer.magic == TRAILER_MAGIC &&
+           trailer.bytes == (uint64_t)(ftell(fp) - start);
+}
+
+/*
+ * Applies a record that scan_record has accepted to a snapshot: a base
+ * replaces its segments, and a delta is merged with them in index order.
+ * Returns false if the record does not fit the snapshot.
+ */
+static bool apply_record(FILE *fp, Snapshot snapshot)
+{
+    Header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1)
+        return false;
+
+    Image *old = snapshot->segments;
+    uint32_t old_count = snapshot->count;
+    if (header.kind == KIND_BASE) {
+        for (uint32_t i = 0; i < old_count; i++)
+            HugePages_free(old[i].data,
+                           (size_t)old[i].size * sizeof(uint32_t));
+        old_count = 0;
+    }
+
+    uint32_t capacity = old_count + 16;
+    Image *images = ALLOC(capacity * sizeof(Image));
+    uint32_t count = 0;
+    uint32_t i = 0;
+    bool ok = true;
+    Entry entry;
+    while (ok && fread(&entry, sizeof(entry), 1, fp) == 1 &&
+           entry.op != OP_END) {
+        // Segments the record leaves alone carry over
+        for (; i < old_count && old[i].index < entry.index; i++)
+            push_image(&images, &count, &capacity, old[i]);
+        bool in_old = i < old_count && old[i].index == entry.index;
+
+        if (entry.op == OP_MAP || entry.op == OP_UNMAP) {
+            if (in_old) {
+                HugePages_free(old[i].data,
+                               (size_t)old[i].size * sizeof(uint32_t));
+                i++;
+            }
+            if (entry.op == OP_MAP)
+                push_image(&images, &count, &capacity,
+                           (Image){entry.index, entry.arg,
+                                   HugePages_alloc((size_t)entry.arg *
+                                                   sizeof(uint32_t))});
+            continue;
+        }
+
+        // A page belongs to the segment just mapped, or to an old one
+        if ((count == 0 || images[count - 1].index != entry.index) && in_old)
+            push_image(&images, &count, &capacity, old[i++]);
+        Image *image = count > 0 ? &images[count - 1] : NULL;
+        ok = image != NULL && image->index == entry.index &&
+             entry.arg < page_count(image->size) &&
+             entry.words == page_words(image->size, entry.arg) &&
+             fread(image->data + (size_t)entry.arg * CHECKPOINT_PAGE_WORDS,
+                   sizeof(uint32_t), entry.words, fp) == entry.words;
+    }
+    for (; i < old_count; i++)
+        push_image(&images, &count, &capacity, old[i]);
+
+    Trailer trailer;
+    ok = ok && fread(&trailer, sizeof(trailer), 1, fp) == 1;
+    if (old != NULL)
+        FREE(old);
+    snapshot->segments = images;
+    snapshot->count = count;
+
+    return ok;
+}
+
+static void push_image(Image **images, uint32_t *count, uint32_t *capacity,
+                       Image image)
+{
+    if (*count == *capacity) {
+        *capacity *= 2;
+        RESIZE(*images, *capacity * sizeof(Image));
+    }
+    (*images)[(*count)++] = image;
+}
+
+uint32_t *Snapshot_program(Snapshot snapshot, uint32_t *size)
+{
+    assert(snapshot != NULL && size != NULL);
+    assert(snapshot->count > 0 && snapshot->segments[0].index == 0);
+    assert(snapshot->segments[0].data != NULL);
+
+    uint32_t *program = snapshot->segments[0].data;
+    *size = snapshot->segments[0].size;
+    snapshot->segments[0].data = NULL;
+
+    return program;
+}
+
+bool Snapshot_restore(Snapshot snapshot, Memory mem)
+{
+    assert(snapshot != NULL && mem != NULL);
+
+    for (uint32_t i = 1; i < snapshot->count; i++) {
+        Image *image = &snapshot->segments[i];
+        if (!map_segment_at(mem, image->index, image->size))
+            return false;
+
+        // The segment starts zeroed, so zero pages are left untouched
+        uint32_t *data = segment_data(mem, image->index);
+        for (uint32_t page = 0; page < page_count(image->size); page++) {
+            size_t offset = (size_t)page * CHECKPOINT_PAGE_WORDS;
+            uint32_t count = page_words(image->size, page);
+            if (!all_zero(image->data + offset, count))
+                memcpy(data + offset, image->data + offset,
+                       (size_t)count * sizeof(uint32_t));
+        }
+        HugePages_free(image->data, (size_t)image->size * sizeof(uint32_t));
+        image->data = NULL;
+    }
+
+    return true;
+}
+
+void free_snapshot(Snapshot *snapshot)
+{
+    assert(snapshot != NULL && *snapshot != NULL);
+
+    for (uint32_t i = 0; i < (*snapshot)->count; i++)
+        HugePages_free((*snapshot)->segments[i].data,
+                       (size_t)(*snapshot)->segments[i].size *
+                           sizeof(uint32_t));
+    if ((*snapshot)->segments != NULL)
+        FREE((*snapshot)->segments);
+    FREE(*snapshot);
+}
+
+static inline uint64_t mix(uint64_t x)
+{
+    x *= HASH_PRIME;
+    return x ^ (x >> 32);
+}
+
+/*
+ * Hashes the words of a page. Four independent lanes keep the multiplies
+ * from waiting on each other, so that a checkpoint hashes memory about as
+ * fast as it can read it.
+ */
+static uint64_t hash_words(const uint32_t *words, uint32_t count)
+{
+    uint64_t lanes[4] = {HASH_SEED, HASH_SEED + 1, HASH_SEED + 2,
+                         HASH_SEED + 3};
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4)
+        for (int j = 0; j < 4; j++)
+            lanes[j] = mix(lanes[j] ^ words[i + j]);
+    for (; i < count; i++)
+        lanes[0] = mix(lanes[0] ^ words[i]);
+
+    return mix(lanes[0] ^ (lanes[1] << 16 | lanes[1] >> 48) ^
+               (lanes[2] << 32 | lanes[2] >> 32) ^
+               (lanes[3] << 48 | lanes[3] >> 16) ^ count);
+}
+
+static bool all_zero(const uint32_t *words, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+        if (words[i] != 0)
+            return false;
+    return true;
+}
@@ -0,0 +1,121 @@
+#ifndef CHECKPOINT_INCLUDED
+#define CHECKPOINT_INCLUDED
+
+#include "memory.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Checkpoints of a run, for resuming it after a crash. The file holds a base
+ * snapshot of every segment followed by a chain of deltas, each with only
+ * the segments mapped and unmapped since the checkpoint before, and the
+ * pages of CHECKPOINT_PAGE_WORDS words that have changed in the others. A
+ * segment no larger than a page counts as a single page.
+ *
+ * Changed pages are found by keeping a hash of every page, so a run carries
+ * no cost between checkpoints; taking one reads all of memory, and the file
+ * for the pages whose hash is unchanged, to compare them in full, but writes
+ * only what changed. Once the deltas add up to more than the base, the next
+ * checkpoint writes a new base instead. Bases replace the file in one
+ * rename, and every record ends with a trailer, so a crash while writing
+ * loses at most the checkpoint being taken.
+ */
+#define CHECKPOINT_PAGE_WORDS 1024
+
+typedef struct Checkpoint *Checkpoint;
+typedef struct Snapshot *Snapshot;
+
+/*
+ * The state of the VM besides its segments.
+ */
+typedef struct CheckpointState {
+    uint32_t registers[8];
+    uint32_t pc;
+    uint64_t steps; /* instructions executed so far */
+    int64_t input;  /* the offset in standard input, or -1 if unknown */
+    bool arena;     /* whether memory_uses_arena */
+} CheckpointState;
+
+/*
+ * new_checkpoint
+ *
+ * Sets up checkpoints to a file. The file is not touched until the first
+ * checkpoint, which is a base, so it can be the one a run was restored from.
+ *
+ * @param  char *path           The file to write
+ * @return Checkpoint           The new checkpoints
+ */
+Checkpoint new_checkpoint(const char *path);
+
+/*
+ * free_checkpoint
+ *
+ * @param  Checkpoint *checkpoint   A pointer to the checkpoints to free
+ * @expect The checkpoints are not NULL
+ */
+void free_checkpoint(Checkpoint *checkpoint);
+
+/*
+ * Checkpoint_save
+ *
+ * Takes a checkpoint: a base the first time and whenever the deltas have
+ * outgrown it, a delta otherwise. The file is synced before it returns.
+ *
+ * @param  Checkpoint checkpoint    The checkpoints to add to
+ * @param  Memory mem               The memory module to save
+ * @param  CheckpointState *state   The rest of the VM's state
+ * @return bool                     Whether the checkpoint was written; if
+ *                                  not, the next one is a base
+ */
+bool Checkpoint_save(Checkpoint checkpoint, Memory mem,
+                     const CheckpointState *state);
+
+/*
+ * load_checkpoint
+ *
+ * Reads a checkpoint file and applies its delta chain to the base, up to the
+ * last complete checkpoint.
+ *
+ * @param  char *path               The file to read
+ * @param  CheckpointState *state   Set to the state of the last checkpoint
+ * @return Snapshot                 The segments as of that checkpoint, or
+ *                                  NULL if the file could not be read or
+ *                                  holds no complete base
+ */
+Snapshot load_checkpoint(const char *path, CheckpointState *state);
+
+/*
+ * Snapshot_program
+ *
+ * Hands over segment 0 of a snapshot, to create the memory module with.
+ *
+ * @param  Snapshot snapshot    The snapshot
+ * @param  uint32_t *size       Set to the size of segment 0 in words
+ * @return uint32_t *           Its data, allocated with HugePages_alloc and
+ *                              no longer owned by the snapshot
+ * @expect Segment 0 has not been handed over already
+ */
+uint32_t *Snapshot_program(Snapshot snapshot, uint32_t *size);
+
+/*
+ * Snapshot_restore
+ *
+ * Maps every segment of a snapshot but segment 0, under its saved index, and
+ * fills it in. The snapshot's copy of each is freed as it goes.
+ *
+ * @param  Snapshot snapshot    The snapshot
+ * @param  Memory mem           A memory module with no segment but segment
+ *                              0, set up for an arena if the state says so
+ * @return bool                 Whether every index could be mapped
+ */
+bool Snapshot_restore(Snapshot snapshot, Memory mem);
+
+/*
+ * free_snapshot
+ *
+ * @param  Snapshot *snapshot   A pointer to the snapshot to free
+ * @expect The snapshot is not NULL
+ */
+void free_snapshot(Snapshot *snapshot);
+
+#endif
@@ -0,0 +1,184 @@
+#include "compiler.h"
+#include <assert.h>
+#include <mem.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define QUEUE_SIZE 16 /* must be a power of two */
+
+typedef enum JobState { PENDING, DONE, TAKEN, ABANDONED } JobState;
+
+struct CompileJob {
+    uint32_t *words;
+    uint32_t length;
+    uint64_t hash;
+    Translation result;
+    int state;
+};
+
+struct Compiler {
+    pthread_t thread;
+    sem_t ready;
+    bool stop;
+    TransCache cache;
+
+    /* head is only written by the compiler, tail only by the executor */
+    uint32_t head;
+    uint32_t tail;
+    CompileJob queue[QUEUE_SIZE];
+};
+
+static void *compile_loop(void *arg);
+static void discard_job(CompileJob job);
+
+Compiler new_compiler(TransCache cache)
+{
+    Compiler compiler;
+    NEW(compiler);
+
+    compiler->stop = false;
+    compiler->cache = cache;
+    compiler->head = 0;
+    compiler->tail = 0;
+
+    if (sem_init(&compiler->ready, 0, 0) != 0) {
+        FREE(compiler);
+        return NULL;
+    }
+    if (pthread_create(&compiler->thread, NULL, compile_loop, compiler) != 0) {
+        sem_destroy(&compiler->ready);
+        FREE(compiler);
+        return NULL;
+    }
+
+    return compiler;
+}
+
+void free_compiler(Compiler *compiler)
+{
+    assert(compiler != NULL && *compiler != NULL);
+
+    Compiler dcompiler = *compiler;
+    __atomic_store_n(&dcompiler->stop, true, __ATOMIC_RELEASE);
+    sem_post(&dcompiler->ready);
+    pthread_join(dcompiler->thread, NULL);
+
+    // Drop whatever the thread did not get to
+    while (dcompiler->head != dcompiler->tail)
+        discard_job(dcompiler->queue[dcompiler->head++ % QUEUE_SIZE]);
+
+    sem_destroy(&dcompiler->ready);
+    FREE(*compiler);
+}
+
+CompileJob Compiler_submit(Compiler compiler, const uint32_t *words,
+                           uint32_t length, uint64_t hash)
+{
+    assert(compiler != NULL);
+    assert(words != NULL || length == 0);
+
+    uint32_t tail = compiler->tail;
+    uint32_t head = __atomic_load_n(&compiler->head, __ATOMIC_ACQUIRE);
+    if (tail - head == QUEUE_SIZE)
+        return NULL;
+
+    CompileJob job;
+    NEW(job);
+    job->words = ALLOC((long)(length > 0 ? length : 1) * sizeof(uint32_t));
+    memcpy(job->words, words, (size_t)length * sizeof(uint32_t));
+    job->length = length;
+    job->hash = hash;
+    job->result = NULL;
+    job->state = PENDING;
+
+    compiler->queue[tail % QUEUE_SIZE] = job;
+    __atomic_store_n(&compiler->tail, tail + 1, __ATOMIC_RELEASE);
+    sem_post(&compiler->ready);
+
+    return job;
+}
+
+Translation CompileJob_result(CompileJob job)
+{
+    assert(job != NULL);
+
+    if (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) != DONE)
+        return NULL;
+
+    job->state = TAKEN;
+    return job->result;
+}
+
+const uint32_t *CompileJob_words(CompileJob job)
+{
+    assert(job != NULL);
+    return job->words;
+}
+
+void free_compile_job(CompileJob *job)
+{
+    assert(job != NULL && *job != NULL);
+
+    // A pending job still belongs to the compiler thread
+    int expected = PENDING;
+    if (!__atomic_compare_exchange_n(&(*job)->state, &expected, ABANDONED,
+                                     false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        if (expected == DONE)
+            free_translation(&(*job)->result);
+        FREE((*job)->words);
+        FREE(*job);
+    }
+    *job = NULL;
+}
+
+/*
+ * The body of the compiler thread: translate requests in order until told to
+ * stop.
+ */
+static void *compile_loop(void *arg)
+{
+    Compiler compiler = arg;
+
+    for (;;) {
+        sem_wait(&compiler->ready);
+        if (__atomic_load_n(&compiler->stop, __ATOMIC_ACQUIRE))
+            return NULL;
+
+        uint32_t head = compiler->head;
+        if (head == __atomic_load_n(&compiler->tail, __ATOMIC_ACQUIRE))
+            continue;
+        CompileJob job = compiler->queue[head % QUEUE_SIZE];
+        __atomic_store_n(&compiler->head, head + 1, __ATOMIC_RELEASE);
+
+        if (__atomic_load_n(&job->state, __ATOMIC_ACQUIRE) == ABANDONED) {
+            discard_job(job);
+            continue;
+        }
+
+        Translation trans = new_translation(job->words, job->length,
+                                            job->hash);
+        if (compiler->cache != NULL)
+            TransCache_store(compiler->cache, trans);
+
+        // Publish the result, unless the executor gave up on it meanwhile
+        job->result = trans;
+        int expected = PENDING;
+        if (!__atomic_compare_exchange_n(&job->state, &expected, DONE, false,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            discard_job(job);
+    }
+}
+
+/*
+ * Frees a job that nobody will ask about again.
+ */
+static void discard_job(CompileJob job)
+{
+    if (job->result != NULL)
+        free_translation(&job->result);
+    FREE(job->words);
+    FREE(job);
+}
@@ -0,0 +1,90 @@
+#ifndef COMPILER_INCLUDED
+#define COMPILER_INCLUDED
+
+#include "transcache.h"
+#include "translation.h"
+#include <stdint.h>
+
+/*
+ * A background compiler. Requests are handed to a dedicated thread through a
+ * lock-free single-producer, single-consumer queue, so a compiler must only
+ * be fed by one executor. Each request works on its own copy of the program
+ * words, and its result is published with a release store once it is ready,
+ * so the executor can keep interpreting and pick the result up whenever it
+ * next checks.
+ */
+typedef struct Compiler *Compiler;
+typedef struct CompileJob *CompileJob;
+
+/*
+ * new_compiler
+ *
+ * Starts a compiler thread.
+ *
+ * @param  TransCache cache     An on-disk cache that finished translations
+ *                              are written to by the compiler thread, or NULL
+ * @return Compiler             The new compiler, or NULL if the thread could
+ *                              not be started
+ */
+Compiler new_compiler(TransCache cache);
+
+/*
+ * free_compiler
+ *
+ * Stops the compiler thread once it has finished its current request, and
+ * frees the compiler. Requests still in the queue are dropped.
+ *
+ * @param  Compiler *compiler   A pointer to the compiler to free
+ * @expect The compiler is not NULL
+ * @expect Every job submitted has been released with free_compile_job
+ */
+void free_compiler(Compiler *compiler);
+
+/*
+ * Compiler_submit
+ *
+ * Queues a program segment for translation. The words are copied, so the
+ * segment may change or be freed as soon as this returns.
+ *
+ * @param  Compiler compiler    The compiler to submit to
+ * @param  uint32_t *words      The words of the program segment
+ * @param  uint32_t length      The number of words in the segment
+ * @param  uint64_t hash        Translation_hash of the words
+ * @return CompileJob           A handle on the request, or NULL if the queue
+ *                              is full
+ */
+CompileJob Compiler_submit(Compiler compiler, const uint32_t *words,
+                           uint32_t length, uint64_t hash);
+
+/*
+ * CompileJob_result
+ *
+ * Checks whether a request has finished. Once the translation has been
+ * returned it belongs to the caller, and later calls return NULL.
+ *
+ * @param  CompileJob job       The request to check
+ * @return Translation          The finished translation, or NULL if it is not
+ *                              ready yet
+ */
+Translation CompileJob_result(CompileJob job);
+
+/*
+ * CompileJob_words
+ *
+ * @param  CompileJob job       A request
+ * @return uint32_t *           The copy of the words the request translates
+ */
+const uint32_t *CompileJob_words(CompileJob job);
+
+/*
+ * free_compile_job
+ *
+ * Releases a request. A request that is still being worked on is abandoned
+ * and freed by the compiler thread once it finishes.
+ *
+ * @param  CompileJob *job      A pointer to the request to release
+ * @expect The job is not NULL
+ */
+void free_compile_job(CompileJob *job);
+
+#endif
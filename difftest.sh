@@ -0,0 +1,101 @@
+#!/bin/sh
+#
+# difftest.sh
+#
+# Differential test of the UM engines. Runs every program on each engine
+# and checks that they all produce the same output, the same final registers
+# and the same instruction count (as printed by um --stats). Programs with a
+# reference output (NAME.1 for um-lab tests, NAME.out for umbin) are also
+# checked against it.
+#
+# Each program is then run twice more with --boot-cache, once to write its
+# boot snapshot and once to start from it, and both runs must match the
+# first engine in everything but the segment cache, whose counts cover only
+# the instructions run in that process. A .umz image must leave a snapshot.
+#
+# Input for NAME.um is read from NAME.0 if it exists, and is empty otherwise.
+#
+# Usage: ./difftest.sh [program ...]
+#        (defaults to umbin/* and any tests written into um-lab/)
+#
+# The um binary and the engines can be overridden with UM and ENGINES.
+
+UM=${UM:-./um}
+ENGINES=${ENGINES:-"handlers predecoded specialized"}
+
+if [ $# -eq 0 ]; then
+    set -- umbin/*.um umbin/*.umz
+    for test in um-lab/*.um; do
+        [ -f "$test" ] && set -- "$@" "$test"
+    done
+fi
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+failures=0
+for prog in "$@"; do
+    base=${prog%.*}
+    input=/dev/null
+    [ -f "$base.0" ] && input=$base.0
+
+    reference=
+    [ -f "$base.1" ] && reference=$base.1
+    [ -f "$base.out" ] && reference=$base.out
+
+    failed=$failures
+    first=
+    for engine in $ENGINES; do
+        out=$tmp/$engine.out
+        stats=$tmp/$engine.stats
+        "$UM" --single-threaded --stats --engine="$engine" "$prog" \
+            < "$input" > "$out" 2> "$stats"
+
+        if [ -n "$reference" ] && ! cmp -s "$out" "$reference"; then
+            echo "FAIL $prog ($engine): output differs from $reference"
+            failures=$((failures + 1))
+        fi
+
+        if [ -z "$first" ]; then
+            first=$engine
+        elif ! cmp -s "$out" "$tmp/$first.out"; then
+            echo "FAIL $prog ($engine): output differs from $first"
+            failures=$((failures + 1))
+        elif ! cmp -s "$stats" "$tmp/$first.stats"; then
+            echo "FAIL $prog ($engine): state differs from $first"
+            failures=$((failures + 1))
+        fi
+    done
+
+    boot=$tmp/boot
+    rm -rf "$boot"
+    mkdir "$boot"
+    grep -v '^segment cache:' "$tmp/$first.stats" > "$tmp/expected.stats"
+    for run in cold warm; do
+        out=$tmp/$run.out
+        stats=$tmp/$run.stats
+        "$UM" --single-threaded --stats --boot-cache="$boot" "$prog" \
+            < "$input" > "$out" 2> "$stats"
+
+        if [ "$run" = cold ] && [ "${prog%.umz}" != "$prog" ] &&
+           [ -z "$(ls "$boot")" ]; then
+            echo "FAIL $prog: no boot snapshot written"
+            failures=$((failures + 1))
+        fi
+
+        if ! cmp -s "$out" "$tmp/$first.out"; then
+            echo "FAIL $prog ($run boot cache): output differs from $first"
+            failures=$((failures + 1))
+        elif ! grep -v '^segment cache:' "$stats" |
+             cmp -s - "$tmp/expected.stats"; then
+            echo "FAIL $prog ($run boot cache): state differs from $first"
+            failures=$((failures + 1))
+        fi
+    done
+
+    if [ $failures -eq "$failed" ]; then
+        echo "ok   $prog: $(head -n 1 "$tmp/$first.stats")"
+    fi
+done
+
+[ $failures -eq 0 ]
@@ -1,15 +1,26 @@
+#include "branch.h"
 #include "executor.h"
+#include "hugepages.h"
+#include "spill.h"
 #include "utest.h"
 #include <except.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
+/*
+ * Every test runs once per engine, selected by the test's index.
+ */
 struct Fixture {
     Executor executor;
     Memory mem;
     uint32_t *reg;
     uint32_t *pc;
+    Engine engine;
 };
 
-UTEST_F_SETUP(Fixture)
+UTEST_I_SETUP(Fixture)
 {
     utest_fixture->mem = new_memory_module(NULL, 0);
     utest_fixture->reg = malloc(sizeof(uint32_t) * 8);
@@ -19,9 +30,11 @@ UTEST_F_SETUP(Fixture)
     *utest_fixture->pc = 0;
     utest_fixture->executor =
         new_executor(utest_fixture->mem, utest_fixture->reg, utest_fixture->pc);
+    utest_fixture->engine = (Engine)utest_index;
+    Executor_use_engine(utest_fixture->executor, utest_fixture->engine);
 }
 
-UTEST_F_TEARDOWN(Fixture)
+UTEST_I_TEARDOWN(Fixture)
 {
     free_memory_module(&utest_fixture->mem);
     free_executor(&utest_fixture->executor);
@@ -29,12 +42,42 @@ UTEST_F_TEARDOWN(Fixture)
     free(utest_fixture->pc);
 }
 
-UTEST_F(Fixture, ConstructorAndTeardown) { EXPECT_TRUE(1); }
+/*
+ * Replaces segment 0 with a copy of the given program and resets the program
+ * counter. The memory module frees segment 0 with HugePages_free, so the copy
+ * is allocated to match.
+ */
+static void load(struct Fixture *fixture, const uint32_t *program, int length)
+{
+    Segment *prog_seg = get_segment(fixture->mem, 0);
+    HugePages_free(prog_seg->data, (size_t)prog_seg->size * sizeof(uint32_t));
+    prog_seg->data = HugePages_alloc((size_t)length * sizeof(uint32_t));
+    prog_seg->size = length;
+    for (int i = 0; i < length; i++)
+        prog_seg->data[i] = program[i];
+
+    *fixture->pc = 0;
+}
+
+/*
+ * Executes a single instruction on the fixture's engine by running it as a
+ * program followed by a halt. Returns HALT if the instruction itself halted,
+ * and CONT if the program went on to halt anywhere else.
+ */
+static Status execute(struct Fixture *fixture, uint32_t instruction)
+{
+    uint32_t program[] = {instruction, 0x70000000};
+    load(fixture, program, 2);
+
+    Executor_run(fixture->executor);
+    return *fixture->pc == 1 ? HALT : CONT;
+}
 
-UTEST_F(Fixture, ConditionalMoveInstructionFalse)
+UTEST_I(Fixture, ConstructorAndTeardown, NUM_ENGINES) { EXPECT_TRUE(1); }
+
+UTEST_I(Fixture, ConditionalMoveInstructionFalse, NUM_ENGINES)
 {
     uint32_t *reg = utest_fixture->reg;
-    Executor executor = utest_fixture->executor;
 
     // Conditional move, A=0, B=1, C=2
     uint32_t instruction = 0x0000000A;
@@ -43,16 +86,15 @@ UTEST_F(Fixture, ConditionalMoveInstructionFalse)
     uint32_t FLAG = 0x8F8F8F8F;
     reg[1] = FLAG;
 
-    EXPECT_EQ(Executor_process(executor, instruction), CONT);
+    EXPECT_EQ(execute(utest_fixture, instruction), CONT);
     EXPECT_EQ(reg[0], 0);
     EXPECT_EQ(reg[1], FLAG);
     EXPECT_EQ(reg[2], 0);
 }
 
-UTEST_F(Fixture, ConditionalMoveInstructionTrue)
+UTEST_I(Fixture, ConditionalMoveInstructionTrue, NUM_ENGINES)
 {
     uint32_t *reg = utest_fixture->reg;
-    Executor executor = utest_fixture->executor;
 
     // Conditional move, A=0, B=1, C=2
     uint32_t instruction = 0x0000000A;
@@ -62,23 +104,22 @@ UTEST_F(Fixture, ConditionalMoveInstructionTrue)
     reg[1] = FLAG;
     reg[2] = 1;
 
-    EXPECT_EQ(Executor_process(executor, instruction), CONT);
+    EXPECT_EQ(execute(utest_fixture, instruction), CONT);
     EXPECT_EQ(reg[0], FLAG);
     EXPECT_EQ(reg[1], FLAG);
     EXPECT_EQ(reg[2], 1);
 }
 
-UTEST_F(Fixture, SegmentedLoadInstruction)
+UTEST_I(Fixture, SegmentedLoadInstruction, NUM_ENGINES)
 {
     uint32_t *reg = utest_fixture->reg;
-    Executor executor = utest_fixture->executor;
     Memory mem = utest_fixture->mem;
 
     // Segmented load, A=0, B=1, C=2
     uint32_t instruction = 0x1000000A;
 
     // Map a segment
-    int seg_id = new_segment(mem, 32);
+    uint32_t seg_id = new_segment(mem, 32);
 
     // Setup values m[r[B]][r[C]]=FLAG
     uint32_t FLAG = 0x8F8F8F8F;
@@ -86,24 +127,23 @@ UTEST_F(Fixture, SegmentedLoadInstruction)
     reg[2] = 16;
     get_segment(mem, reg[1])->data[reg[2]] = FLAG;
 
-    EXPECT_EQ(Executor_process(executor, instruction), CONT);
+    EXPECT_EQ(execute(utest_fixture, instruction), CONT);
     EXPECT_EQ(reg[0], FLAG);
     EXPECT_EQ(reg[1], seg_id);
     EXPECT_EQ(reg[2], 16);
     EXPECT_EQ(get_segment(mem, reg[1])->data[reg[2]], FLAG);
 }
 
-UTEST_F(Fixture, SegmentedStoreInstruction)
+UTEST_I(Fixture, SegmentedStoreInstruction, NUM_ENGINES)
 {
     uint32_t *reg = utest_fixture->reg;
-    Executor executor = utest_fixture->executor;
     Memory mem = utest_fixture->mem;
 
     // Segmented store, A=0, B=1, C=2
     uint32_t instruction = 0x2000000A;
 
     // Map a segment
-    int seg_id = new_segment(mem, 32);
+    uint32_t seg_id = new_segment(mem, 32);
 
     // Setup values r[A]=seg_id, r[B]=16, r[C]=FLAG
     uint32_t FLAG = 0x8F8F8F8F;
@@ -111,17 +151,16 @@ UTEST_F(Fixture, SegmentedStoreInstruction)
     reg[1] = 16;
     reg[2] = FLAG;
 
-    EXPECT_EQ(Executor_process(executor, instruction), CONT);
+    EXPECT_EQ(execute(utest_fixture, instruction), CONT);
     EXPECT_EQ(reg[0], seg_id);
     EXPECT_EQ(reg[1], 16);
     EXPECT_EQ(reg[2], FLAG);
     EXPECT_EQ(get_segment(mem, reg[0])->data[reg[1]], reg[2]);
 }
 
-UTEST_F(Fixture, AddInstruction)
+UTEST_I(Fixture, AddInstruction, NUM_ENGINES)
 {
     uint32_t *reg = utest_fixture->reg;
-    Executor executor = utest_fixture->executor;
 
     // Add, A=0, B=1, C=2
     uint32_t instruction = 0x3000000A;
@@ -132,16 +171,15 @@ UTEST_F(Fixture, AddInstruction)
     reg[1] = num1;
     reg[2] = num2;
 
-    EXPECT_EQ(Executor_process(executor, instruction), CONT);
+    EXPECT_EQ(execute(utest_fixture, instruction), CONT);
     EXPECT_EQ(reg[0], num1 + num2);
     EXPECT_EQ(reg[1], num1);
     EXPECT_EQ(reg[2], num2);
 }
 
-UTEST_F(Fixture, MultiplyInstruction)
+UTEST_I(Fixture, MultiplyInstruction, NUM_ENGINES)
 {
     uint32_t *reg = utest_fixture->reg;
-    Executor executor = utest_fixture->executor;
 
     // Multiply, A=0, B=1, C=2
     uint32_t instruction = 0x4000000A;
@@ -152,16 +190,15 @@ UTEST_F(Fixture, MultiplyInstruction)
     reg[1] = num1;
     reg[2] = num2;
 
-    EXPECT_EQ(Executor_process(executor, instruction), CONT);
+    EXPECT_EQ(execute(utest_fixture, instruction), CONT);
     EXPECT_EQ(reg[0], num1 * num2);
     EXPECT_EQ(reg[1], num1);
     EXPECT_EQ(reg[2], num2);
 }
 
-UTEST_F(Fixture, DivideInstruction)
+UTEST_I(Fixture, DivideInstruction, NUM_ENGINES)
 {
     uint32_t *reg = utest_fixture->reg;
-    Executor executor = utest_fixture->executor;
 
     // Divide, A=0, B=1, C=2
     uint32_t instruction = 0x5000000A;
@@ -172,16 +209,15 @@ UTEST_F(Fixture, DivideInstruction)
     reg[1] = num1;
     reg[2] = num2;
 
-    EXPECT_EQ(Executor_process(executor, instruction), CONT);
+    EXPECT_EQ(execute(utest_fixture, instruction), CONT);
     EXPECT_EQ(reg[0], num1 / num2);
     EXPECT_EQ(reg[1], num1);
     EXPECT_EQ(reg[2], num2);
 }
 
-UTEST_F(Fixture, BitwiseNANDInstruction)
+UTEST_I(Fixture, BitwiseNANDInstruction, NUM_ENGINES)
 {
     uint32_t *reg = utest_fixture->reg;
-    Executor executor = utest_fixture->executor;
 
     // Bitwise NAND, A=0, B=1, C=2
     uint32_t instruction = 0x6000000A;
@@ -192,26 +228,24 @@ UTEST_F(Fixture, BitwiseNANDInstruction)
     reg[1] = num1;
     reg[2] = num2;
 
-    EXPECT_EQ(Executor_process(executor, instruction), CONT);
+    EXPECT_EQ(execute(utest_fixture, instruction), CONT);
     EXPECT_EQ(reg[0], ~(num1 & num2));
     EXPECT_EQ(reg[1], num1);
     EXPECT_EQ(reg[2], num2);
 }
 
-UTEST_F(Fixture, HaltInstruction)
+UTEST_I(Fixture, HaltInstruction, NUM_ENGINES)
 {
-    Executor executor = utest_fixture->executor;
 
     // Halt
     uint32_t instruction = 0x70000000;
 
-    EXPECT_EQ(Executor_process(executor, instruction), HALT);
+    EXPECT_EQ(execute(utest_fixture, instruction), HALT);
 }
 
-UTEST_F(Fixture, MapSegmentInstruction)
+UTEST_I(Fixture, MapSegmentInstruction, NUM_ENGINES)
 {
     uint32_t *reg = utest_fixture->reg;
-    Executor executor = utest_fixture->executor;
     Memory mem = utest_fixture->mem;
 
     // MapSegment, A=0, B=1, C=2
@@ -221,8 +255,8 @@ UTEST_F(Fixture, MapSegmentInstruction)
     uint32_t size = 0x80;
     reg[2] = size;
 
-    EXPECT_EQ(Executor_process(executor, instruction), CONT);
-    int id = reg[1];
+    EXPECT_EQ(execute(utest_fixture, instruction), CONT);
+    uint32_t id = reg[1];
     EXPECT_EQ(get_segment(mem, id)->size, size);
     EXPECT_EQ(reg[2], size);
 
@@ -231,29 +265,27 @@ UTEST_F(Fixture, MapSegmentInstruction)
         EXPECT_EQ(get_segment(mem, id)->data[i], 0);
 }
 
-UTEST_F(Fixture, UnmapSegmentInstruction)
+UTEST_I(Fixture, UnmapSegmentInstruction, NUM_ENGINES)
 {
     uint32_t *reg = utest_fixture->reg;
-    Executor executor = utest_fixture->executor;
     Memory mem = utest_fixture->mem;
 
     // UnmapSegment, A=0, B=1, C=2
     uint32_t instruction = 0x9000000A;
 
-    int id = new_segment(mem, 0x80);
+    uint32_t id = new_segment(mem, 0x80);
 
     // Setup registers r[B]=0, r[C]=size
     reg[2] = id;
 
-    EXPECT_EQ(Executor_process(executor, instruction), CONT);
+    EXPECT_EQ(execute(utest_fixture, instruction), CONT);
     EXPECT_EQ((uint64_t)get_segment(mem, id)->data, 0);
     EXPECT_EQ(reg[2], id);
 }
 
-UTEST_F(Fixture, LoadProgramInstruction)
+UTEST_I(Fixture, LoadProgramInstruction, NUM_ENGINES)
 {
     uint32_t *reg = utest_fixture->reg;
-    Executor executor = utest_fixture->executor;
     Memory mem = utest_fixture->mem;
     uint32_t *pc = utest_fixture->pc;
 
@@ -262,26 +294,30 @@ UTEST_F(Fixture, LoadProgramInstruction)
 
     uint32_t FLAG = 0x8F8F8F8F;
 
-    // Setup new program segment
-    int prog_id = new_segment(mem, 16);
+    uint32_t HALT_WORD = 0x70000000;
+
+    // Setup new program segment, which halts at the new program counter
+    uint32_t prog_id = new_segment(mem, 16);
+    get_segment(mem, prog_id)->data[4] = HALT_WORD;
     // Set arbitrary data to check
     get_segment(mem, prog_id)->data[15] = FLAG;
 
-    // Setup registers r[B]=prog_id, r[C]=1
+    // Setup registers r[B]=prog_id, r[C]=4
     reg[1] = prog_id;
     reg[2] = 4;
 
-    EXPECT_EQ(Executor_process(executor, instruction), CONT);
+    EXPECT_EQ(execute(utest_fixture, instruction), CONT);
     EXPECT_EQ(reg[1], prog_id);
     EXPECT_EQ(reg[2], 4);
 
-    // Check that pc is set correctly
-    EXPECT_EQ(*pc, 4u);
+    // Check that pc was set correctly: the new program halted at word 4
+    EXPECT_EQ(*pc, 5u);
 
     // Check that both segments are intact
     for (int i = 0; i < 15; i++) {
-        EXPECT_EQ(get_segment(mem, 0)->data[i], 0);
-        EXPECT_EQ(get_segment(mem, prog_id)->data[i], 0);
+        uint32_t expected = (i == 4 ? HALT_WORD : 0);
+        EXPECT_EQ(get_segment(mem, 0)->data[i], expected);
+        EXPECT_EQ(get_segment(mem, prog_id)->data[i], expected);
     }
     EXPECT_EQ(get_segment(mem, 0)->data[15], FLAG);
     EXPECT_EQ(get_segment(mem, prog_id)->data[15], FLAG);
@@ -290,15 +326,792 @@ UTEST_F(Fixture, LoadProgramInstruction)
     EXPECT_NE(get_segment(mem, prog_id), get_segment(mem, 0));
 }
 
-UTEST_F(Fixture, LoadValueInstruction)
+UTEST_I(Fixture, LoadValueInstruction, NUM_ENGINES)
 {
     uint32_t *reg = utest_fixture->reg;
-    Executor executor = utest_fixture->executor;
 
     // LoadValue, A=0, value=0x8F8F
     uint32_t val = 0x8F8F;
     uint32_t instruction = 0xD0000000 | val;
 
-    EXPECT_EQ(Executor_process(executor, instruction), CONT);
+    EXPECT_EQ(execute(utest_fixture, instruction), CONT);
     EXPECT_EQ(reg[0], val);
 }
+
+UTEST_I(Fixture, RunRemapAfterUnmapSegment, NUM_ENGINES)
+{
+    uint32_t *reg = utest_fixture->reg;
+    Executor executor = utest_fixture->executor;
+
+    // The remapped segment reuses the unmapped one's ID but not its data
+    uint32_t program[] = {
+        0xD2000008, // r1 = 8
+        0x80000011, // r2 = map(r1)
+        0xD6000005, // r3 = 5
+        0x2000009B, // m[r2][r3] = r3
+        0x10000113, // r4 = m[r2][r3]
+        0x90000002, // unmap(r2)
+        0x80000029, // r5 = map(r1)
+        0x100001AB, // r6 = m[r5][r3]
+        0x70000000, // halt
+    };
+    int length = sizeof(program) / sizeof(program[0]);
+    load(utest_fixture, program, length);
+
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(reg[5], reg[2]);
+    EXPECT_EQ(reg[4], 5u);
+    EXPECT_EQ(reg[6], 0u);
+
+    uint64_t hits, misses;
+    Executor_segment_cache_stats(executor, &hits, &misses);
+    EXPECT_EQ(hits, 1u);
+    EXPECT_EQ(misses, 2u);
+}
+
+UTEST_I(Fixture, RunPastMemoryQuota, NUM_ENGINES)
+{
+    uint32_t *reg = utest_fixture->reg;
+    Executor executor = utest_fixture->executor;
+
+    // Map 8-word segments until the quota stops the program
+    uint32_t program[] = {
+        0xD2000008, // r1 = 8
+        0x80000011, // r2 = map(r1)
+        0xD6000001, // r3 = 1
+        0xC0000003, // goto r3
+    };
+    int length = sizeof(program) / sizeof(program[0]);
+    load(utest_fixture, program, length);
+    set_memory_quota(utest_fixture->mem, 3 * 8);
+
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_TRUE(memory_quota_exceeded(utest_fixture->mem));
+    EXPECT_EQ(reg[2], 0u);
+    EXPECT_EQ(*utest_fixture->pc, 2u);
+    EXPECT_EQ(Executor_steps(executor), 1u + 3 * 3 + 1);
+    EXPECT_EQ(memory_stats(utest_fixture->mem).live_segments, 4u);
+}
+
+UTEST_I(Fixture, RunKeepsHotSpilledSegmentResident, NUM_ENGINES)
+{
+    uint32_t *reg = utest_fixture->reg;
+    Executor executor = utest_fixture->executor;
+
+    // Two spilled segments fit in the budget; every store uses the first
+    uint32_t program[] = {
+        0xD2004000, // r1 = 16384
+        0x80000011, // r2 = map(r1)
+        0x80000019, // r3 = map(r1)
+        0x20000080, // m[r2][r0] = r0
+        0x80000021, // r4 = map(r1)
+        0x20000080, // m[r2][r0] = r0
+        0x80000029, // r5 = map(r1)
+        0x20000080, // m[r2][r0] = r0
+        0x70000000, // halt
+    };
+    int length = sizeof(program) / sizeof(program[0]);
+    load(utest_fixture, program, length);
+    ASSERT_TRUE(use_spill_file(utest_fixture->mem, "/tmp",
+                               2 * SPILL_THRESHOLD));
+
+    // Only the two segments mapped but never stored to are paged out, so
+    // using the hot one again pages nothing out
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(memory_pageouts(utest_fixture->mem), 2u);
+    EXPECT_EQ(segment_data(utest_fixture->mem, reg[2])[0], 0u);
+    EXPECT_EQ(memory_pageouts(utest_fixture->mem), 2u);
+
+    uint64_t hits, misses;
+    Executor_segment_cache_stats(executor, &hits, &misses);
+    EXPECT_EQ(hits, 0u);
+}
+
+UTEST_I(Fixture, RunOutOfBoundsLoadInSafeMode, NUM_ENGINES)
+{
+    uint32_t *reg = utest_fixture->reg;
+    Executor executor = utest_fixture->executor;
+
+    // Too small to be guarded, so the load is checked explicitly
+    uint32_t program[] = {
+        0xD2000008, // r1 = 8
+        0x80000011, // r2 = map(r1)
+        0x10000111, // r4 = m[r2][r1]
+        0x70000000, // halt
+    };
+    int length = sizeof(program) / sizeof(program[0]);
+    load(utest_fixture, program, length);
+    ASSERT_TRUE(Executor_use_safe_mode(executor));
+
+    MachineFault fault;
+    EXPECT_EQ(Executor_run(executor), HALT);
+    ASSERT_TRUE(Executor_fault(executor, &fault));
+    EXPECT_EQ(fault.pc, 2u);
+    EXPECT_EQ(fault.opcode, 1u);
+    EXPECT_EQ(fault.segment, reg[2]);
+    EXPECT_EQ(fault.index, 8u);
+    EXPECT_EQ(Executor_steps(executor), 3u);
+}
+
+UTEST_I(Fixture, RunPastGuardedSegmentInSafeMode, NUM_ENGINES)
+{
+    uint32_t *reg = utest_fixture->reg;
+    Executor executor = utest_fixture->executor;
+
+    // Large enough to be guarded, so the store faults on the guard page
+    uint32_t program[] = {
+        0xD2001000, // r1 = 4096
+        0x80000011, // r2 = map(r1)
+        0xD6000007, // r3 = 7
+        0x2000008B, // m[r2][r1] = r3
+        0x70000000, // halt
+    };
+    int length = sizeof(program) / sizeof(program[0]);
+    load(utest_fixture, program, length);
+    ASSERT_TRUE(Executor_use_safe_mode(executor));
+
+    MachineFault fault;
+    EXPECT_EQ(Executor_run(executor), HALT);
+    ASSERT_TRUE(Executor_fault(executor, &fault));
+    EXPECT_EQ(fault.pc, 3u);
+    EXPECT_EQ(fault.opcode, 2u);
+    EXPECT_EQ(fault.segment, reg[2]);
+    EXPECT_EQ(fault.index, 4096u);
+    EXPECT_EQ(Executor_steps(executor), 4u);
+}
+
+UTEST_I(Fixture, RunProfiledEveryInstruction, NUM_ENGINES)
+{
+    Executor executor = utest_fixture->executor;
+
+    uint32_t program[] = {
+        0xD2000003, // r1 = 3
+        0xC0000001, // goto r1
+        0x70000000, // halt (skipped)
+        0x70000000, // halt
+    };
+    int length = sizeof(program) / sizeof(program[0]);
+    load(utest_fixture, program, length);
+    Profiler profiler = new_profiler(1);
+    Executor_use_profiler(executor, profiler);
+
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(Profiler_samples(profiler), 3u);
+
+    char *folded;
+    size_t size;
+    FILE *fp = open_memstream(&folded, &size);
+    Profiler_write(profiler, fp);
+    fclose(fp);
+    EXPECT_STREQ(folded, "gen0;0x0:loadv 1\n"
+                         "gen0;0x1:loadp 1\n"
+                         "gen0;0x3;0x3:halt 1\n");
+
+    free(folded);
+    free_profiler(&profiler);
+}
+
+UTEST_I(Fixture, RunWithMemTrace, NUM_ENGINES)
+{
+    uint32_t *reg = utest_fixture->reg;
+    Executor executor = utest_fixture->executor;
+
+    uint32_t program[] = {
+        0xD2000008, // r1 = 8
+        0x80000011, // r2 = map(r1)
+        0x90000002, // unmap(r2)
+        0x80000011, // r2 = map(r1)
+        0xD9C00000, // r4 = 0x1C00000
+        0xDA000040, // r5 = 64
+        0x40000125, // r4 = r4 * r5, a halt
+        0xD6000000, // r3 = 0
+        0x2000009C, // m[r2][r3] = r4
+        0xC0000013, // load program r2, goto r3
+    };
+    int length = sizeof(program) / sizeof(program[0]);
+    load(utest_fixture, program, length);
+    MemTrace trace = new_mem_trace("/tmp/um-test.memtrace", length);
+    ASSERT_TRUE(trace != NULL);
+    Executor_use_mem_trace(executor, trace);
+
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_TRUE(free_mem_trace(&trace));
+
+    uint32_t size;
+    MemTraceReader reader = open_mem_trace("/tmp/um-test.memtrace", &size);
+    ASSERT_TRUE(reader != NULL);
+    EXPECT_EQ(size, (uint32_t)length);
+
+    MemRecord record;
+    MemEvent events[] = {MEM_MAP, MEM_UNMAP, MEM_MAP, MEM_LOAD};
+    uint64_t steps[] = {2, 3, 4, 10};
+    for (int i = 0; i < 4; i++) {
+        ASSERT_TRUE(MemTraceReader_next(reader, &record));
+        EXPECT_EQ(record.event, events[i]);
+        EXPECT_EQ(record.steps, steps[i]);
+        EXPECT_EQ(record.id, reg[2]);
+        EXPECT_EQ(record.size, events[i] == MEM_MAP ? 8u : 0u);
+    }
+    EXPECT_FALSE(MemTraceReader_next(reader, &record));
+
+    close_mem_trace(&reader);
+    remove("/tmp/um-test.memtrace");
+}
+
+UTEST_I(Fixture, RunWithInstrTrace, NUM_ENGINES)
+{
+    Executor executor = utest_fixture->executor;
+
+    // Count r1 down from 40000, for more than two sync intervals
+    uint32_t program[] = {
+        0xD2009C40, // r1 = 40000
+        0x60000080, // r2 = ~(r0 & r0)
+        0xD6000003, // r3 = 3
+        0x3000004A, // r1 = r1 + r2
+        0xDA000007, // r5 = 7
+        0x00000159, // if (r1 != 0) r5 = r3
+        0xC0000005, // load program r0, goto r5
+        0x70000000, // halt
+    };
+    load(utest_fixture, program, sizeof(program) / sizeof(program[0]));
+    InstrTrace trace = new_instr_trace("/tmp/um-test.trace");
+    ASSERT_TRUE(trace != NULL);
+    Executor_use_instr_trace(executor, trace);
+
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_TRUE(free_instr_trace(&trace));
+
+    InstrTraceReader reader = open_instr_trace("/tmp/um-test.trace");
+    ASSERT_TRUE(reader != NULL);
+    ASSERT_EQ(InstrTraceReader_length(reader), (uint64_t)(3 + 4 * 40000 + 1));
+
+    InstrStep step;
+    for (uint32_t i = 0; i < 4; i++) {
+        ASSERT_TRUE(InstrTraceReader_next(reader, &step));
+        EXPECT_EQ(step.steps, (uint64_t)i);
+        EXPECT_EQ(step.pc, i);
+        EXPECT_EQ(step.word, program[i]);
+    }
+    EXPECT_EQ(step.registers[1], 40000u);
+    EXPECT_EQ(step.registers[2], 0xFFFFFFFFu);
+
+    // Into the second sync interval, at the 25000th r5 = 7
+    ASSERT_TRUE(InstrTraceReader_seek(reader, 100000));
+    ASSERT_TRUE(InstrTraceReader_next(reader, &step));
+    EXPECT_EQ(step.steps, 100000u);
+    EXPECT_EQ(step.pc, 4u);
+    EXPECT_EQ(step.word, program[4]);
+    EXPECT_EQ(step.registers[1], 15000u);
+    EXPECT_EQ(step.registers[5], 3u);
+
+    ASSERT_TRUE(InstrTraceReader_seek(reader, 4 * 40000 + 3));
+    ASSERT_TRUE(InstrTraceReader_next(reader, &step));
+    EXPECT_EQ(step.pc, 7u);
+    EXPECT_EQ(step.registers[1], 0u);
+    EXPECT_FALSE(InstrTraceReader_next(reader, &step));
+    EXPECT_FALSE(InstrTraceReader_seek(reader, 4 * 40000 + 5));
+
+    close_instr_trace(&reader);
+    remove("/tmp/um-test.trace");
+}
+
+UTEST_I(Fixture, RunToStepLimitAndResume, NUM_ENGINES)
+{
+    uint32_t *reg = utest_fixture->reg;
+    Executor executor = utest_fixture->executor;
+
+    // Count r1 down from 1000, with a jump every 4 instructions
+    uint32_t program[] = {
+        0xD20003E8, // r1 = 1000
+        0x60000080, // r2 = ~(r0 & r0)
+        0xD6000003, // r3 = 3
+        0x3000004A, // r1 = r1 + r2
+        0xDA000007, // r5 = 7
+        0x00000159, // if (r1 != 0) r5 = r3
+        0xC0000005, // load program r0, goto r5
+        0x70000000, // halt
+    };
+    load(utest_fixture, program, sizeof(program) / sizeof(program[0]));
+
+    // The limit takes effect at the first jump to reach it
+    Executor_use_step_limit(executor, 100);
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(Executor_stopped(executor), STOP_STEPS);
+    EXPECT_EQ(Executor_steps(executor), 103u);
+    EXPECT_EQ(*utest_fixture->pc, 3u);
+    EXPECT_EQ(reg[1], 975u);
+
+    Executor_use_step_limit(executor, UINT64_MAX);
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(Executor_stopped(executor), STOP_NONE);
+    EXPECT_EQ(Executor_steps(executor), 3u + 4 * 1000 + 1);
+    EXPECT_EQ(reg[1], 0u);
+}
+
+UTEST_I(Fixture, RunFromSnapshotCountsEarlierSteps, NUM_ENGINES)
+{
+    uint32_t *reg = utest_fixture->reg;
+    Executor executor = utest_fixture->executor;
+
+    // The same countdown, resumed as if 1000 instructions had run before
+    uint32_t program[] = {
+        0xD20003E8, // r1 = 1000
+        0x60000080, // r2 = ~(r0 & r0)
+        0xD6000003, // r3 = 3
+        0x3000004A, // r1 = r1 + r2
+        0xDA000007, // r5 = 7
+        0x00000159, // if (r1 != 0) r5 = r3
+        0xC0000005, // load program r0, goto r5
+        0x70000000, // halt
+    };
+    load(utest_fixture, program, sizeof(program) / sizeof(program[0]));
+    Executor_set_steps(executor, 1000);
+
+    // The limit counts the earlier instructions too
+    Executor_use_step_limit(executor, 1100);
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(Executor_stopped(executor), STOP_STEPS);
+    EXPECT_EQ(Executor_steps(executor), 1103u);
+    EXPECT_EQ(reg[1], 975u);
+
+    Executor_use_step_limit(executor, UINT64_MAX);
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(Executor_stopped(executor), STOP_NONE);
+    EXPECT_EQ(Executor_steps(executor), 1000u + 3 + 4 * 1000 + 1);
+}
+
+/*
+ * Keeps the report handed to a Reporter.
+ */
+typedef struct Report {
+    int calls;
+    uint64_t steps;
+    JumpCount hottest[REPORT_HOTTEST];
+    int count;
+} Report;
+
+static void keep_report(Executor executor, const JumpCount *hottest,
+                        int count, void *cl)
+{
+    Report *report = cl;
+    report->calls++;
+    report->steps = Executor_steps(executor);
+    memcpy(report->hottest, hottest, count * sizeof(JumpCount));
+    report->count = count;
+}
+
+UTEST_I(Fixture, RunWithReport, NUM_ENGINES)
+{
+    Executor executor = utest_fixture->executor;
+
+    // Count r1 down from 1000, with a jump every 4 instructions
+    uint32_t program[] = {
+        0xD20003E8, // r1 = 1000
+        0x60000080, // r2 = ~(r0 & r0)
+        0xD6000003, // r3 = 3
+        0x3000004A, // r1 = r1 + r2
+        0xDA000007, // r5 = 7
+        0x00000159, // if (r1 != 0) r5 = r3
+        0xC0000005, // load program r0, goto r5
+        0x70000000, // halt
+    };
+    load(utest_fixture, program, sizeof(program) / sizeof(program[0]));
+    Report report = {0, 0, {{0, 0}}, 0};
+    Executor_use_reporter(executor, keep_report, &report);
+
+    // Too few jumps to finish sampling, so the run reports as it halts
+    Executor_request_report(executor);
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(Executor_stopped(executor), STOP_NONE);
+    EXPECT_EQ(Executor_steps(executor), 3u + 4 * 1000 + 1);
+    EXPECT_EQ(report.calls, 1);
+    EXPECT_EQ(report.steps, 3u + 4 * 1000 + 1);
+    ASSERT_EQ(report.count, 2);
+    EXPECT_EQ(report.hottest[0].target, 3u);
+    EXPECT_EQ(report.hottest[0].count, 999u);
+    EXPECT_EQ(report.hottest[1].target, 7u);
+    EXPECT_EQ(report.hottest[1].count, 1u);
+
+    // The request has been served
+    *utest_fixture->pc = 0;
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(report.calls, 1);
+}
+
+/*
+ * What the hooks of RunWithHooks saw.
+ */
+typedef struct Hooked {
+    uint64_t instructions;
+    uint64_t mismatches; /* words that were not the program's */
+    uint64_t jumps;
+    uint32_t last_pc;
+    uint64_t maps;
+    uint32_t mapped;
+    uint64_t unmaps;
+    uint64_t unmap_steps;
+} Hooked;
+
+static const uint32_t hooked_program[] = {
+    0xD2000005, // r1 = 5
+    0x80000021, // r4 = map(r1)
+    0x90000004, // unmap(r4)
+    0xD200000A, // r1 = 10
+    0x60000080, // r2 = ~(r0 & r0)
+    0xD6000006, // r3 = 6
+    0x3000004A, // r1 = r1 + r2
+    0xDA00000A, // r5 = 10
+    0x00000159, // if (r1 != 0) r5 = r3
+    0xC0000005, // load program r0, goto r5
+    0x70000000, // halt
+};
+
+static void hook_instruction(void *cl, uint64_t steps, uint32_t pc,
+                             uint32_t word, const uint32_t *registers)
+{
+    (void)steps;
+    (void)registers;
+    Hooked *hooked = cl;
+    hooked->instructions++;
+    hooked->mismatches += word != hooked_program[pc];
+}
+
+static void hook_lodp(void *cl, uint64_t steps, uint32_t segment, uint32_t pc)
+{
+    (void)steps;
+    (void)segment;
+    Hooked *hooked = cl;
+    hooked->jumps++;
+    hooked->last_pc = pc;
+}
+
+static void hook_map(void *cl, uint64_t steps, uint32_t segment,
+                     uint32_t size)
+{
+    (void)steps;
+    (void)segment;
+    Hooked *hooked = cl;
+    hooked->maps++;
+    hooked->mapped = size;
+}
+
+static void hook_unmap(void *cl, uint64_t steps, uint32_t segment)
+{
+    (void)segment;
+    Hooked *hooked = cl;
+    hooked->unmaps++;
+    hooked->unmap_steps = steps;
+}
+
+UTEST_I(Fixture, RunWithHooks, NUM_ENGINES)
+{
+    Executor executor = utest_fixture->executor;
+
+    load(utest_fixture, hooked_program,
+         sizeof(hooked_program) / sizeof(hooked_program[0]));
+    Hooked hooked;
+    memset(&hooked, 0, sizeof(hooked));
+    ExecutorHooks hooks = {hook_instruction, hook_lodp, hook_map,
+                           hook_unmap, NULL, &hooked};
+    Executor_use_hooks(executor, &hooks);
+
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(Executor_steps(executor), 6u + 4 * 10 + 1);
+    EXPECT_EQ(hooked.instructions, 6u + 4 * 10 + 1);
+    EXPECT_EQ(hooked.mismatches, 0u);
+    EXPECT_EQ(hooked.jumps, 10u);
+    EXPECT_EQ(hooked.last_pc, 10u);
+    EXPECT_EQ(hooked.maps, 1u);
+    EXPECT_EQ(hooked.mapped, 5u);
+    EXPECT_EQ(hooked.unmaps, 1u);
+    EXPECT_EQ(hooked.unmap_steps, 3u);
+}
+
+/*
+ * Creates a file holding text, for a branch to read, and names it in path.
+ */
+static void write_input(char *path, const char *text)
+{
+    strcpy(path, "/tmp/um-branch-XXXXXX");
+    int fd = mkstemp(path);
+    ssize_t written = write(fd, text, strlen(text));
+    (void)written;
+    close(fd);
+}
+
+UTEST_I(Fixture, BranchAtEndOfInput, NUM_ENGINES)
+{
+    Executor executor = utest_fixture->executor;
+    uint32_t *reg = utest_fixture->reg;
+
+    uint32_t program[] = {
+        0xD4000007, // r2 = 7
+        0xB0000001, // r1 = input
+        0x70000000, // halt
+    };
+    load(utest_fixture, program, sizeof(program) / sizeof(program[0]));
+    ASSERT_TRUE(freopen("/dev/null", "r", stdin) != NULL);
+
+    // The input instruction is left to be executed again
+    Executor_stop_at_eof(executor, true);
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(Executor_stopped(executor), STOP_INPUT);
+    EXPECT_EQ(*utest_fixture->pc, 1u);
+    EXPECT_EQ(Executor_steps(executor), 1u);
+
+    // Each child reads its own byte, and exits with it plus r2
+    char inputs[2][32], outputs[2][40];
+    write_input(inputs[0], "A");
+    write_input(inputs[1], "B");
+    Branch branches[2];
+    for (int i = 0; i < 2; i++) {
+        sprintf(outputs[i], "%s.out", inputs[i]);
+        branches[i].input = inputs[i];
+        branches[i].output = outputs[i];
+    }
+    int branch = Branch_fork(branches, 2, 1);
+    if (branch >= 0) {
+        Executor_stop_at_eof(executor, false);
+        Executor_run(executor);
+        _exit(Executor_steps(executor) == 3 ? (reg[1] + reg[2]) & 0xFF : 0);
+    }
+
+    EXPECT_EQ(branch, -1);
+    for (int i = 0; i < 2; i++) {
+        EXPECT_TRUE(WIFEXITED(branches[i].status));
+        EXPECT_EQ(WEXITSTATUS(branches[i].status), "AB"[i] + 7);
+        unlink(inputs[i]);
+        unlink(outputs[i]);
+    }
+}
+
+UTEST_I(Fixture, RunWithTelemetry, NUM_ENGINES)
+{
+    Executor executor = utest_fixture->executor;
+
+    // Map and jump 100 times, leaving the segments mapped
+    uint32_t program[] = {
+        0xD2000064, // r1 = 100
+        0x60000080, // r2 = ~(r0 & r0)
+        0xD6000003, // r3 = 3
+        0x80000021, // r4 = map(r1)
+        0x3000004A, // r1 = r1 + r2
+        0xDA000008, // r5 = 8
+        0x00000159, // if (r1 != 0) r5 = r3
+        0xC0000005, // load program r0, goto r5
+        0x70000000, // halt
+    };
+    load(utest_fixture, program, sizeof(program) / sizeof(program[0]));
+    Telemetry telemetry = new_telemetry("telemetry-test");
+    ASSERT_TRUE(telemetry != NULL);
+    ASSERT_TRUE(Executor_use_telemetry(executor, telemetry));
+
+    EXPECT_EQ(Executor_run(executor), HALT);
+
+    const TelemetryPage *page = open_telemetry(getpid());
+    ASSERT_TRUE(page != NULL);
+    TelemetryPage vm;
+    EXPECT_TRUE(Telemetry_snapshot(page, &vm));
+    EXPECT_EQ(vm.pid, (int64_t)getpid());
+    EXPECT_EQ(vm.state, (uint64_t)VM_HALTED);
+    EXPECT_EQ(vm.steps, (uint64_t)(3 + 5 * 100 + 1));
+    EXPECT_EQ(vm.jumps, 100u);
+    EXPECT_EQ(vm.live_segments, 101u);
+    // load() replaces segment 0 without telling the memory module
+    EXPECT_EQ(vm.live_words, (uint64_t)(100 * 101 / 2));
+    EXPECT_EQ(strcmp(vm.program, "telemetry-test"), 0);
+
+    close_telemetry(&page);
+    Executor_use_telemetry(executor, NULL);
+    free_telemetry(&telemetry);
+    EXPECT_TRUE(open_telemetry(getpid()) == NULL);
+}
+
+static void *cancel_soon(void *executor)
+{
+    struct timespec delay = {0, 10 * 1000000};
+    nanosleep(&delay, NULL);
+    Executor_cancel(executor);
+    return NULL;
+}
+
+UTEST_I(Fixture, RunEndlessLoopToTimeoutAndCancel, NUM_ENGINES)
+{
+    Executor executor = utest_fixture->executor;
+
+    uint32_t program[] = {0xC0000000}; // load program r0, goto r0
+    load(utest_fixture, program, 1);
+
+    ASSERT_TRUE(Executor_use_time_limit(executor, 10));
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(Executor_stopped(executor), STOP_TIMEOUT);
+    EXPECT_EQ(*utest_fixture->pc, 0u);
+    uint64_t steps = Executor_steps(executor);
+    EXPECT_GT(steps, 0u);
+
+    ASSERT_TRUE(Executor_use_time_limit(executor, 0));
+    pthread_t thread;
+    ASSERT_EQ(pthread_create(&thread, NULL, cancel_soon, executor), 0);
+    EXPECT_EQ(Executor_run(executor), HALT);
+    pthread_join(thread, NULL);
+    EXPECT_EQ(Executor_stopped(executor), STOP_CANCELLED);
+    EXPECT_GT(Executor_steps(executor), steps);
+
+    // A cancelled executor stays cancelled
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(Executor_stopped(executor), STOP_CANCELLED);
+}
+
+UTEST_I(Fixture, RunSelfModifyingProgram, NUM_ENGINES)
+{
+    uint32_t *reg = utest_fixture->reg;
+    Executor executor = utest_fixture->executor;
+
+    // Copy the halt at word 6 over word 4 before word 4 is reached
+    uint32_t program[] = {
+        0xD2000006, // r1 = 6
+        0x10000081, // r2 = m[r0][r1]
+        0xD6000004, // r3 = 4
+        0x2000001A, // m[r0][r3] = r2
+        0xD8000001, // r4 = 1 (replaced by halt)
+        0xDA000063, // r5 = 99
+        0x70000000, // halt
+    };
+    int length = sizeof(program) / sizeof(program[0]);
+    load(utest_fixture, program, length);
+
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(reg[2], 0x70000000u);
+    EXPECT_EQ(reg[4], 0);
+    EXPECT_EQ(reg[5], 0);
+    EXPECT_EQ(*utest_fixture->pc, 5u);
+    EXPECT_EQ(Executor_steps(executor), 5u);
+}
+
+UTEST_I(Fixture, RunRepeatedLoadOfIdenticalCode, NUM_ENGINES)
+{
+    uint32_t *reg = utest_fixture->reg;
+    Executor executor = utest_fixture->executor;
+    Memory mem = utest_fixture->mem;
+
+    // Load an identical copy of the program twice, then halt
+    uint32_t program[] = {
+        0xD2000001, // r1 = 1
+        0xD4000004, // r2 = 4
+        0xC000000A, // load program m[r1], pc = r2
+        0x70000000, // halt
+        0xD4000003, // r2 = 3
+        0xC000000A, // load program m[r1], pc = r2
+    };
+    int length = sizeof(program) / sizeof(program[0]);
+    load(utest_fixture, program, length);
+
+    uint32_t copy_id = new_segment(mem, length);
+    for (int i = 0; i < length; i++)
+        get_segment(mem, copy_id)->data[i] = program[i];
+
+    EXPECT_EQ(copy_id, 1);
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(reg[2], 3u);
+    EXPECT_EQ(*utest_fixture->pc, 4u);
+    EXPECT_EQ(Executor_steps(executor), 6u);
+
+    // Both loads retire a translation of the same code and take it back
+    uint64_t reused = utest_fixture->engine == ENGINE_HANDLERS ? 0 : 2;
+    EXPECT_EQ(Executor_reused_translations(executor), reused);
+}
+
+UTEST_I(Fixture, RunWithBackgroundCompiler, NUM_ENGINES)
+{
+    uint32_t *reg = utest_fixture->reg;
+    Executor executor = utest_fixture->executor;
+    Memory mem = utest_fixture->mem;
+
+    // Count r1 down from 100000 in a loop, then halt
+    uint32_t program[] = {
+        0xD20186A0, // r1 = 100000
+        0x60000080, // r2 = ~(r0 & r0), i.e. -1
+        0xD8000004, // r4 = 4 (loop)
+        0xDA000009, // r5 = 9 (exit)
+        0x3000004A, // r1 = r1 + r2
+        0x000001AA, // r6 = r5
+        0x000001A1, // if r1 != 0 then r6 = r4
+        0xC000001E, // load program m[r3], pc = r6
+        0x70000000, // halt (not reached)
+        0x70000000, // halt
+    };
+    int length = sizeof(program) / sizeof(program[0]);
+    load(utest_fixture, program, length);
+
+    Compiler compiler = new_compiler(NULL);
+    ASSERT_TRUE(compiler != NULL);
+    Executor_use_compiler(executor, compiler);
+
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(reg[1], 0);
+    EXPECT_EQ(Executor_steps(executor), 400005u);
+
+    free_executor(&utest_fixture->executor);
+    free_compiler(&compiler);
+    utest_fixture->executor =
+        new_executor(mem, utest_fixture->reg, utest_fixture->pc);
+}
+
+UTEST_I(Fixture, RunSelfModifyingProgramWriteProtected, NUM_ENGINES)
+{
+    uint32_t *reg = utest_fixture->reg;
+    Executor executor = utest_fixture->executor;
+
+    // As RunSelfModifyingProgram, but the store is caught by a page fault
+    uint32_t program[] = {
+        0xD2000006, // r1 = 6
+        0x10000081, // r2 = m[r0][r1]
+        0xD6000004, // r3 = 4
+        0x2000001A, // m[r0][r3] = r2
+        0xD8000001, // r4 = 1 (replaced by halt)
+        0xDA000063, // r5 = 99
+        0x70000000, // halt
+    };
+    int length = sizeof(program) / sizeof(program[0]);
+    load(utest_fixture, program, length);
+    ASSERT_TRUE(Executor_use_write_protection(executor));
+
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(reg[2], 0x70000000u);
+    EXPECT_EQ(reg[4], 0);
+    EXPECT_EQ(reg[5], 0);
+    EXPECT_EQ(*utest_fixture->pc, 5u);
+    EXPECT_EQ(Executor_steps(executor), 5u);
+}
+
+UTEST_I(Fixture, RunDataInProgramPageWriteProtected, NUM_ENGINES)
+{
+    uint32_t *reg = utest_fixture->reg;
+    Executor executor = utest_fixture->executor;
+    Memory mem = utest_fixture->mem;
+
+    // Store r1 into word 12 of segment 0 on every iteration of a loop
+    uint32_t program[] = {
+        0xD2000064, // r1 = 100
+        0x60000080, // r2 = ~(r0 & r0), i.e. -1
+        0xD8000005, // r4 = 5 (loop)
+        0xDA00000B, // r5 = 11 (exit)
+        0xDE00000C, // r7 = 12
+        0x3000004A, // r1 = r1 + r2
+        0x200000F9, // m[r3][r7] = r1
+        0x000001AA, // r6 = r5
+        0x000001A1, // if r1 != 0 then r6 = r4
+        0xC000001E, // load program m[r3], pc = r6
+        0x70000000, // halt (not reached)
+        0x70000000, // halt
+        0xFFFFFFFF, // data
+    };
+    int length = sizeof(program) / sizeof(program[0]);
+    load(utest_fixture, program, length);
+    ASSERT_TRUE(Executor_use_write_protection(executor));
+
+    EXPECT_EQ(Executor_run(executor), HALT);
+    EXPECT_EQ(reg[1], 0);
+    EXPECT_EQ(get_segment(mem, 0)->data[12], 0);
+    EXPECT_EQ(Executor_steps(executor), 506u);
+}
@@ -1,20 +1,107 @@
 #include "executor.h"
 #include "memory.h"
+#include "memtrace.h"
+#include "profiler.h"
+#include "segcache.h"
+#include "specialized.h"
+#include "translation.h"
 #include <assert.h>
 #include <mem.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #define OPCODE_WIDTH 4
 #define OPCODE_LSB 28
 #define NUM_INSTRUCTIONS 14
+#define RECENT_PROGRAMS 8
+#define INTERPRET_SLICE 4096
+#define MAX_PAGE_FAULTS 16
+
+/* Requests, from other threads, for the executor's attention at its next
+ * load program instruction */
+#define ATTEND_TIMEOUT 1
+#define ATTEND_CANCEL 2
+#define ATTEND_PUBLISH 4
+#define ATTEND_REPORT 8
+
+/* Passed to stop_due where control is not transferred by a jump */
+#define NO_JUMP -1
+
+/* Slots for distinct jump targets while a report is sampled; targets beyond
+ * them are not counted */
+#define REPORT_SLOTS 4096
+
+/* The sets of hooks the engines are compiled for, leanest first:
+ * none, the counters telemetry publishes, those and memory tracing, and
+ * everything */
+#define HOOK_CONFIGS(X)                                                        \
+    X(plain, 0)                                                                \
+    X(counted, HOOK_LODP | HOOK_IO)                                            \
+    X(mapped, HOOK_LODP | HOOK_MAP | HOOK_UNMAP | HOOK_IO)                     \
+    X(hooked, HOOKS_ALL)
+
+static const char *engine_names[NUM_ENGINES] = {"handlers", "predecoded",
+                                                "specialized"};
+
+/* The executor whose segment 0 the SIGSEGV handler watches */
+static Executor protected_executor = NULL;
+/* The executor whose guard pages the SIGSEGV handler watches */
+static Executor safe_executor = NULL;
+static size_t page_size;
+
+typedef Status (*Handler)(Executor executor, uint32_t instruction);
 
 struct Executor {
     Memory memory;
     uint32_t *registers;
     uint32_t *pc;
-    Status (*handlers[NUM_INSTRUCTIONS])(Executor executor,
-                                         uint32_t instruction);
+    uint64_t steps;
+    SegCache segs;
+    Engine engine;
+    Translation program;
+    Specialized spec;
+    TransTable recent;
+    TransCache cache;
+    Compiler compiler;
+    CompileJob job;
+    bool write_protect;
+    uint32_t *protected_base; /* segment 0 while its pages are protected */
+    uint32_t protected_length;
+    uint32_t *page_faults;
+    bool protection_abandoned;
+    bool safe;
+    bool faulted;
+    MachineFault fault;
+    bool fault_armed; /* fault_jump is set up, in Executor_run */
+    sigjmp_buf fault_jump;
+    Profiler profiler;
+    MemTrace memtrace;
+    InstrTrace instrtrace;
+    ExecutorHooks hooks;
+    unsigned client_hooks; /* HOOK_ bits of the client's hooks */
+    uint64_t max_steps; /* UINT64_MAX for no limit */
+    bool stop_at_eof;
+    uint64_t time_limit; /* in ms, 0 for no limit */
+    bool has_timer;
+    timer_t timer;
+    Telemetry telemetry;
+    timer_t ticker; /* while telemetry is not NULL */
+    volatile sig_atomic_t attention; /* ATTEND_ bits */
+    Stop stopped;
+    uint64_t jumps;
+    uint64_t input;
+    uint64_t output;
+    Reporter reporter;
+    void *report_cl;
+    JumpCount *sampled; /* REPORT_SLOTS slots, while a report is sampled */
+    uint32_t sample_left;
+    Handler handlers[NUM_INSTRUCTIONS];
 };
 
 Status handle_cmov(Executor executor, uint32_t instruction);
@@ -31,6 +118,73 @@ Status handle_outp(Executor executor, uint32_t instruction);
 Status handle_inpt(Executor executor, uint32_t instruction);
 Status handle_lodp(Executor executor, uint32_t instruction);
 Status handle_lodv(Executor executor, uint32_t instruction);
+static inline Status hooked_mseg(Executor executor, uint32_t instruction,
+                                 const unsigned hooks)
+    __attribute__((always_inline));
+static inline Status hooked_useg(Executor executor, uint32_t instruction,
+                                 const unsigned hooks)
+    __attribute__((always_inline));
+static inline Status hooked_outp(Executor executor, uint32_t instruction,
+                                 const unsigned hooks)
+    __attribute__((always_inline));
+static inline Status hooked_inpt(Executor executor, uint32_t instruction,
+                                 const unsigned hooks)
+    __attribute__((always_inline));
+static inline Status hooked_lodp(Executor executor, uint32_t instruction,
+                                 const unsigned hooks)
+    __attribute__((always_inline));
+
+static Status store_word(Executor executor, uint32_t id, uint32_t index,
+                         uint32_t value);
+static uint32_t *checked_word(Executor executor, uint32_t id, uint32_t index);
+static bool checked_unmap(Executor executor, uint32_t id);
+static Status machine_fault(Executor executor, uint32_t id, uint32_t index);
+static bool install_fault_handler(void);
+static unsigned hooks_in_use(Executor executor);
+static inline void on_instruction(Executor executor, uint64_t steps,
+                                  uint32_t pc, uint32_t word);
+static inline void on_lodp(Executor executor, uint64_t steps,
+                           uint32_t segment, uint32_t pc);
+static inline void on_map(Executor executor, uint64_t steps, uint32_t segment,
+                          uint32_t size);
+static inline void on_unmap(Executor executor, uint64_t steps,
+                            uint32_t segment);
+static inline void on_io(Executor executor, uint64_t steps, bool output,
+                         int byte);
+static Status run_engine(Executor executor);
+static inline bool stop_due(Executor executor, uint64_t steps,
+                            int64_t target);
+static bool attend(Executor executor, uint64_t steps, int64_t target);
+static void sample_jump(Executor executor, uint64_t steps, uint32_t target);
+static void write_report(Executor executor);
+static void publish(Executor executor, uint64_t steps, VMState state);
+static bool create_timer(Executor executor, timer_t *timer,
+                         void (*notify)(union sigval));
+static void arm_timer(timer_t timer, uint64_t ms, bool repeat);
+static void time_up(union sigval value);
+static void publish_due(union sigval value);
+static void load_program(Executor executor, uint32_t id);
+static void translate_program(Executor executor);
+static Status interpret(Executor executor);
+static inline Status interpret_loop(Executor executor, const Handler *handlers,
+                                    const unsigned hooks)
+    __attribute__((always_inline));
+static void adopt_translation(Executor executor, Translation trans);
+static void protect_program(Executor executor);
+static bool refresh_page(Executor executor, uint32_t index);
+static void abandon_protection(Executor executor);
+static void handle_fault(int sig, siginfo_t *info, void *context);
+static Status run_handlers(Executor executor);
+static inline Status handlers_loop(Executor executor, const Handler *handlers,
+                                   const unsigned hooks)
+    __attribute__((always_inline));
+static int hook_config(Executor executor);
+static Status run_predecoded(Executor executor);
+static inline Status predecoded_loop(Executor executor,
+                                     const bool check_stores, const bool safe,
+                                     const unsigned hooks)
+    __attribute__((always_inline));
+static Status run_specialized(Executor executor);
 
 Executor new_executor(Memory memory, uint32_t *registers, uint32_t *pc)
 {
@@ -43,6 +197,42 @@ Executor new_executor(Memory memory, uint32_t *registers, uint32_t *pc)
     executor->memory = memory;
     executor->registers = registers;
     executor->pc = pc;
+    executor->steps = 0;
+    SegCache_clear(&executor->segs);
+    executor->engine = ENGINE_PREDECODED;
+    executor->program = NULL;
+    executor->spec = NULL;
+    executor->recent = new_trans_table(RECENT_PROGRAMS);
+    executor->cache = NULL;
+    executor->compiler = NULL;
+    executor->job = NULL;
+    executor->write_protect = false;
+    executor->protected_base = NULL;
+    executor->protected_length = 0;
+    executor->page_faults = NULL;
+    executor->protection_abandoned = false;
+    executor->safe = false;
+    executor->faulted = false;
+    executor->fault_armed = false;
+    executor->profiler = NULL;
+    executor->memtrace = NULL;
+    executor->instrtrace = NULL;
+    memset(&executor->hooks, 0, sizeof(executor->hooks));
+    executor->client_hooks = 0;
+    executor->max_steps = UINT64_MAX;
+    executor->stop_at_eof = false;
+    executor->time_limit = 0;
+    executor->has_timer = false;
+    executor->telemetry = NULL;
+    executor->attention = 0;
+    executor->stopped = STOP_NONE;
+    executor->jumps = 0;
+    executor->input = 0;
+    executor->output = 0;
+    executor->reporter = NULL;
+    executor->report_cl = NULL;
+    executor->sampled = NULL;
+    executor->sample_left = 0;
 
     executor->handlers[0] = handle_cmov;
     executor->handlers[1] = handle_slod;
@@ -67,7 +257,249 @@ void free_executor(Executor *executor)
     assert(executor != NULL && *executor != NULL);
 
     Executor dexecutor = *executor;
+    if (dexecutor->spec != NULL)
+        free_specialized(&dexecutor->spec);
+    if (dexecutor->program != NULL)
+        free_translation(&dexecutor->program);
+    if (dexecutor->job != NULL)
+        free_compile_job(&dexecutor->job);
+    free_trans_table(&dexecutor->recent);
+    if (dexecutor->has_timer)
+        timer_delete(dexecutor->timer);
+    if (dexecutor->telemetry != NULL)
+        timer_delete(dexecutor->ticker);
+    if (protected_executor == dexecutor)
+        protected_executor = NULL;
+    if (safe_executor == dexecutor)
+        safe_executor = NULL;
+    free(dexecutor->page_faults);
+    if (dexecutor->sampled != NULL)
+        FREE(dexecutor->sampled);
     FREE(dexecutor);
+    *executor = NULL;
+}
+
+void Executor_use_engine(Executor executor, Engine engine)
+{
+    assert(executor != NULL);
+
+    executor->engine = engine;
+}
+
+const char *Engine_name(Engine engine)
+{
+    assert(engine < NUM_ENGINES);
+    return engine_names[engine];
+}
+
+bool Engine_from_name(const char *name, Engine *engine)
+{
+    assert(name != NULL && engine != NULL);
+
+    for (int i = 0; i < NUM_ENGINES; i++) {
+        if (strcmp(name, engine_names[i]) == 0) {
+            *engine = (Engine)i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+uint64_t Executor_steps(Executor executor)
+{
+    assert(executor != NULL);
+    return executor->steps;
+}
+
+void Executor_set_steps(Executor executor, uint64_t steps)
+{
+    assert(executor != NULL);
+    executor->steps = steps;
+}
+
+void Executor_segment_cache_stats(Executor executor, uint64_t *hits,
+                                  uint64_t *misses)
+{
+    assert(executor != NULL);
+
+    *hits = executor->segs.hits;
+    *misses = executor->segs.misses;
+}
+
+uint64_t Executor_reused_translations(Executor executor)
+{
+    assert(executor != NULL);
+    return TransTable_hits(executor->recent);
+}
+
+bool Executor_use_write_protection(Executor executor)
+{
+    assert(executor != NULL);
+    assert(protected_executor == NULL || protected_executor == executor);
+
+    if (!install_fault_handler())
+        return false;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    align_program_segment(executor->memory);
+    executor->write_protect = true;
+    protected_executor = executor;
+
+    return true;
+}
+
+bool Executor_use_safe_mode(Executor executor)
+{
+    assert(executor != NULL);
+    assert(safe_executor == NULL || safe_executor == executor);
+
+    if (!install_fault_handler())
+        return false;
+
+    // Without a guard zone every segment is checked explicitly
+    use_guard_pages(executor->memory);
+    SegCache_clear(&executor->segs);
+    executor->safe = true;
+    safe_executor = executor;
+
+    return true;
+}
+
+void Executor_use_step_limit(Executor executor, uint64_t steps)
+{
+    assert(executor != NULL);
+
+    executor->max_steps = steps;
+}
+
+bool Executor_use_time_limit(Executor executor, uint64_t ms)
+{
+    assert(executor != NULL);
+
+    if (ms > 0 && !executor->has_timer) {
+        if (!create_timer(executor, &executor->timer, time_up))
+            return false;
+        executor->has_timer = true;
+    }
+    executor->time_limit = ms;
+
+    return true;
+}
+
+void Executor_cancel(Executor executor)
+{
+    assert(executor != NULL);
+
+    __atomic_fetch_or(&executor->attention, ATTEND_CANCEL, __ATOMIC_RELAXED);
+}
+
+void Executor_use_reporter(Executor executor, Reporter reporter, void *cl)
+{
+    assert(executor != NULL);
+
+    executor->reporter = reporter;
+    executor->report_cl = cl;
+}
+
+void Executor_request_report(Executor executor)
+{
+    assert(executor != NULL);
+
+    __atomic_fetch_or(&executor->attention, ATTEND_REPORT, __ATOMIC_RELAXED);
+}
+
+bool Executor_use_telemetry(Executor executor, Telemetry telemetry)
+{
+    assert(executor != NULL);
+
+    if (telemetry != NULL && executor->telemetry == NULL &&
+        !create_timer(executor, &executor->ticker, publish_due))
+        return false;
+    if (telemetry == NULL && executor->telemetry != NULL)
+        timer_delete(executor->ticker);
+    executor->telemetry = telemetry;
+
+    return true;
+}
+
+void Executor_stop_at_eof(Executor executor, bool stop)
+{
+    assert(executor != NULL);
+
+    executor->stop_at_eof = stop;
+}
+
+Stop Executor_stopped(Executor executor)
+{
+    assert(executor != NULL);
+
+    return executor->stopped;
+}
+
+bool Executor_fault(Executor executor, MachineFault *fault)
+{
+    assert(executor != NULL && fault != NULL);
+
+    if (!executor->faulted)
+        return false;
+
+    // Segment 0 is not replaced once the program has stopped
+    *fault = executor->fault;
+    fault->opcode = get_segment(executor->memory, 0)->data[fault->pc] >>
+                    OPCODE_LSB;
+    return true;
+}
+
+void Executor_use_profiler(Executor executor, Profiler profiler)
+{
+    assert(executor != NULL);
+
+    executor->profiler = profiler;
+}
+
+void Executor_use_mem_trace(Executor executor, MemTrace trace)
+{
+    assert(executor != NULL);
+
+    executor->memtrace = trace;
+}
+
+void Executor_use_instr_trace(Executor executor, InstrTrace trace)
+{
+    assert(executor != NULL);
+
+    executor->instrtrace = trace;
+}
+
+void Executor_use_hooks(Executor executor, const ExecutorHooks *hooks)
+{
+    assert(executor != NULL);
+
+    memset(&executor->hooks, 0, sizeof(executor->hooks));
+    if (hooks != NULL)
+        executor->hooks = *hooks;
+
+    ExecutorHooks *set = &executor->hooks;
+    executor->client_hooks = (set->instruction != NULL ? HOOK_INSTRUCTION : 0) |
+                             (set->lodp != NULL ? HOOK_LODP : 0) |
+                             (set->map != NULL ? HOOK_MAP : 0) |
+                             (set->unmap != NULL ? HOOK_UNMAP : 0) |
+                             (set->io != NULL ? HOOK_IO : 0);
+}
+
+void Executor_use_cache(Executor executor, TransCache cache)
+{
+    assert(executor != NULL);
+
+    executor->cache = cache;
+}
+
+void Executor_use_compiler(Executor executor, Compiler compiler)
+{
+    assert(executor != NULL);
+
+    executor->compiler = compiler;
 }
 
 Status Executor_process(Executor executor, uint32_t instruction)
@@ -79,6 +511,240 @@ Status Executor_process(Executor executor, uint32_t instruction)
     return executor->handlers[opcode](executor, instruction);
 }
 
+Status Executor_run(Executor executor)
+{
+    assert(executor != NULL);
+
+    // Every run gets the whole time limit; a cancellation stays in force
+    executor->stopped = STOP_NONE;
+    __atomic_fetch_and(&executor->attention, ~ATTEND_TIMEOUT,
+                       __ATOMIC_RELAXED);
+    if (executor->has_timer)
+        arm_timer(executor->timer, executor->time_limit, false);
+    if (executor->telemetry != NULL) {
+        publish(executor, executor->steps, VM_RUNNING);
+        arm_timer(executor->ticker, TELEMETRY_INTERVAL_MS, true);
+    }
+
+    if (!executor->safe) {
+        run_engine(executor);
+    } else if (sigsetjmp(executor->fault_jump, 1) == 0) {
+        // The SIGSEGV handler comes back here when a guard page is hit
+        executor->fault_armed = true;
+        run_engine(executor);
+    }
+    executor->fault_armed = false;
+    if (executor->sampled != NULL)
+        write_report(executor);
+    if (executor->has_timer)
+        arm_timer(executor->timer, 0, false);
+    if (executor->telemetry != NULL) {
+        arm_timer(executor->ticker, 0, false);
+        publish(executor, executor->steps,
+                executor->faulted                     ? VM_FAILED
+                : executor->stopped != STOP_NONE      ? VM_STOPPED
+                                                      : VM_HALTED);
+    }
+
+    return HALT;
+}
+
+/*
+ * Runs the program with the selected engine until it halts.
+ */
+static Status run_engine(Executor executor)
+{
+    Status status = CONT;
+    while (status != HALT) {
+        // Loads of new code come back here, so this is where they stop
+        if (stop_due(executor, executor->steps, NO_JUMP))
+            return HALT;
+        if (executor->engine == ENGINE_HANDLERS)
+            return run_handlers(executor);
+
+        // (Re)translate segment 0 whenever new code has been loaded
+        if (executor->program == NULL)
+            translate_program(executor);
+        if (executor->write_protect && executor->program != NULL &&
+            executor->protected_base == NULL &&
+            !executor->protection_abandoned)
+            protect_program(executor);
+
+        // Interpret while the compiler thread is busy with new code. The
+        // specialized engine keeps the program counter and instruction count
+        // to itself and counts nothing else, so safe mode, profiling,
+        // tracing, client hooks, step limits, telemetry and stopping at the
+        // end of input run its programs on the pre-decoded engine instead
+        if (executor->program == NULL)
+            status = interpret(executor);
+        else if (executor->engine == ENGINE_SPECIALIZED && !executor->safe &&
+                 executor->profiler == NULL && executor->memtrace == NULL &&
+                 executor->instrtrace == NULL && executor->client_hooks == 0 &&
+                 executor->max_steps == UINT64_MAX &&
+                 executor->telemetry == NULL && !executor->stop_at_eof)
+            status = run_specialized(executor);
+        else
+            status = run_predecoded(executor);
+    }
+
+    return HALT;
+}
+
+/*
+ * Decides whether a run must stop before the program halts, and records
+ * why. Called only where control is transferred, at load program
+ * instructions, so that straight-line code carries no check; requests from
+ * other threads wait there too, and the target of the jump is sampled if a
+ * report was requested.
+ */
+static inline bool stop_due(Executor executor, uint64_t steps, int64_t target)
+{
+    if (executor->attention == 0 && steps < executor->max_steps)
+        return false;
+
+    return attend(executor, steps, target);
+}
+
+/*
+ * The slow path of stop_due: publishes telemetry if it is due and samples
+ * the jump for a report, then decides.
+ */
+static bool attend(Executor executor, uint64_t steps, int64_t target)
+{
+    int requests = __atomic_fetch_and(&executor->attention, ~ATTEND_PUBLISH,
+                                      __ATOMIC_RELAXED);
+    if (requests & ATTEND_PUBLISH)
+        publish(executor, steps, VM_RUNNING);
+    if ((requests & ATTEND_REPORT) && target != NO_JUMP)
+        sample_jump(executor, steps, (uint32_t)target);
+
+    if (requests & ATTEND_CANCEL)
+        executor->stopped = STOP_CANCELLED;
+    else if (requests & ATTEND_TIMEOUT)
+        executor->stopped = STOP_TIMEOUT;
+    else if (steps >= executor->max_steps)
+        executor->stopped = STOP_STEPS;
+    else
+        return false;
+
+    return true;
+}
+
+/*
+ * Counts a jump towards a report, in a table of targets with linear
+ * probing, and writes the report after the last one. The request stays in
+ * force until then, so that every jump in between comes here.
+ */
+static void sample_jump(Executor executor, uint64_t steps, uint32_t target)
+{
+    if (executor->sampled == NULL) {
+        executor->sampled = CALLOC(REPORT_SLOTS, sizeof(JumpCount));
+        executor->sample_left = REPORT_JUMPS;
+    }
+
+    uint32_t slot = (target * 2654435761u) & (REPORT_SLOTS - 1);
+    for (int probes = 0; probes < REPORT_SLOTS; probes++) {
+        JumpCount *entry = &executor->sampled[slot];
+        if (entry->count == 0 || entry->target == target) {
+            entry->target = target;
+            entry->count++;
+            break;
+        }
+        slot = (slot + 1) & (REPORT_SLOTS - 1);
+    }
+
+    if (--executor->sample_left == 0) {
+        // The engines keep these to themselves until they stop
+        executor->steps = steps;
+        *executor->pc = target;
+        write_report(executor);
+    }
+}
+
+/*
+ * Hands the hottest sampled targets to the reporter, and ends the request.
+ */
+static void write_report(Executor executor)
+{
+    JumpCount hottest[REPORT_HOTTEST];
+    int count = 0;
+    for (int i = 0; i < REPORT_SLOTS; i++) {
+        JumpCount entry = executor->sampled[i];
+        if (entry.count == 0)
+            continue;
+
+        // Insert into the few kept so far, in order, dropping the coldest
+        int j = count < REPORT_HOTTEST ? count++ : REPORT_HOTTEST;
+        for (; j > 0 && hottest[j - 1].count < entry.count; j--)
+            if (j < REPORT_HOTTEST)
+                hottest[j] = hottest[j - 1];
+        if (j < REPORT_HOTTEST)
+            hottest[j] = entry;
+    }
+
+    FREE(executor->sampled);
+    __atomic_fetch_and(&executor->attention, ~ATTEND_REPORT, __ATOMIC_RELAXED);
+    if (executor->reporter != NULL)
+        executor->reporter(executor, hottest, count, executor->report_cl);
+}
+
+static void publish(Executor executor, uint64_t steps, VMState state)
+{
+    MemoryStats stats = memory_stats(executor->memory);
+    TelemetrySample sample = {state,
+                              steps,
+                              stats.live_segments,
+                              stats.live_words,
+                              executor->jumps,
+                              executor->input,
+                              executor->output};
+
+    Telemetry_publish(executor->telemetry, &sample);
+}
+
+/*
+ * Creates a timer that calls notify with the executor, on a thread of its
+ * own, whenever it expires.
+ */
+static bool create_timer(Executor executor, timer_t *timer,
+                         void (*notify)(union sigval))
+{
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD;
+    event.sigev_notify_function = notify;
+    event.sigev_value.sival_ptr = executor;
+
+    return timer_create(CLOCK_MONOTONIC, &event, timer) == 0;
+}
+
+/*
+ * Starts a timer, to expire once or every ms, or stops it if ms is 0.
+ */
+static void arm_timer(timer_t timer, uint64_t ms, bool repeat)
+{
+    struct itimerspec spec = {{0, 0}, {0, 0}};
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = (long)(ms % 1000) * 1000000;
+    if (repeat)
+        spec.it_interval = spec.it_value;
+    timer_settime(timer, 0, &spec, NULL);
+}
+
+static void time_up(union sigval value)
+{
+    Executor executor = value.sival_ptr;
+
+    __atomic_fetch_or(&executor->attention, ATTEND_TIMEOUT, __ATOMIC_RELAXED);
+}
+
+static void publish_due(union sigval value)
+{
+    Executor executor = value.sival_ptr;
+
+    __atomic_fetch_or(&executor->attention, ATTEND_PUBLISH, __ATOMIC_RELAXED);
+}
+
 Status handle_cmov(Executor executor, uint32_t instruction)
 {
     uint32_t ra = Bitpack_getu(instruction, 3, 6);
@@ -102,7 +768,15 @@ Status handle_slod(Executor executor, uint32_t instruction)
     uint32_t *reg = executor->registers;
     Memory mem = executor->memory;
 
-    reg[ra] = (get_segment(mem, reg[rb])->data)[reg[rc]];
+    if (executor->safe) {
+        uint32_t *word = checked_word(executor, reg[rb], reg[rc]);
+        if (word == NULL)
+            return HALT;
+        reg[ra] = *word;
+        return CONT;
+    }
+
+    reg[ra] = SegCache_lookup(&executor->segs, mem, reg[rb])[reg[rc]];
 
     return CONT;
 }
@@ -115,9 +789,7 @@ Status handle_sstr(Executor executor, uint32_t instruction)
 
     uint32_t *reg = executor->registers;
 
-    get_segment(executor->memory, reg[ra])->data[reg[rb]] = reg[rc];
-
-    return CONT;
+    return store_word(executor, reg[ra], reg[rb], reg[rc]);
 }
 
 Status handle_adtn(Executor executor, uint32_t instruction)
@@ -180,28 +852,74 @@ Status handle_halt(Executor executor, uint32_t instruction)
     return HALT;
 }
 
+/*
+ * The handlers with hook points call every hook in use. The engines run
+ * copies of them compiled for one set of hooks each, from the bodies below,
+ * so that the copy without hooks carries no hook checks.
+ */
 Status handle_mseg(Executor executor, uint32_t instruction)
+{
+    return hooked_mseg(executor, instruction, HOOKS_ALL);
+}
+
+Status handle_useg(Executor executor, uint32_t instruction)
+{
+    return hooked_useg(executor, instruction, HOOKS_ALL);
+}
+
+Status handle_outp(Executor executor, uint32_t instruction)
+{
+    return hooked_outp(executor, instruction, HOOKS_ALL);
+}
+
+Status handle_inpt(Executor executor, uint32_t instruction)
+{
+    return hooked_inpt(executor, instruction, HOOKS_ALL);
+}
+
+Status handle_lodp(Executor executor, uint32_t instruction)
+{
+    return hooked_lodp(executor, instruction, HOOKS_ALL);
+}
+
+static inline Status hooked_mseg(Executor executor, uint32_t instruction,
+                                 const unsigned hooks)
 {
     uint32_t rb = Bitpack_getu(instruction, 3, 3);
     uint32_t rc = Bitpack_getu(instruction, 3, 0);
 
     uint32_t *reg = executor->registers;
 
-    reg[rb] = new_segment(executor->memory, reg[rc]);
+    // The memory module refuses segments beyond its quota or once every
+    // index is in use
+    uint32_t size = reg[rc];
+    reg[rb] = new_segment(executor->memory, size);
+    if (reg[rb] == 0)
+        return HALT;
 
+    if (hooks & HOOK_MAP)
+        on_map(executor, executor->steps, reg[rb], size);
     return CONT;
 }
 
-Status handle_useg(Executor executor, uint32_t instruction)
+static inline Status hooked_useg(Executor executor, uint32_t instruction,
+                                 const unsigned hooks)
 {
     uint32_t rc = Bitpack_getu(instruction, 3, 0);
 
+    if (executor->safe && !checked_unmap(executor, executor->registers[rc]))
+        return HALT;
+    if (hooks & HOOK_UNMAP)
+        on_unmap(executor, executor->steps, executor->registers[rc]);
+
     remove_segment(executor->memory, executor->registers[rc]);
+    SegCache_forget(&executor->segs, executor->registers[rc]);
 
     return CONT;
 }
 
-Status handle_outp(Executor executor, uint32_t instruction)
+static inline Status hooked_outp(Executor executor, uint32_t instruction,
+                                 const unsigned hooks)
 {
     uint32_t rc = Bitpack_getu(instruction, 3, 0);
 
@@ -209,11 +927,14 @@ Status handle_outp(Executor executor, uint32_t instruction)
 
     assert(0 <= (int)reg[rc] && (int)reg[rc] < 256);
     putc((char)(reg[rc]), stdout);
+    if (hooks & HOOK_IO)
+        on_io(executor, executor->steps, true, (int)reg[rc]);
 
     return CONT;
 }
 
-Status handle_inpt(Executor executor, uint32_t instruction)
+static inline Status hooked_inpt(Executor executor, uint32_t instruction,
+                                 const unsigned hooks)
 {
     uint32_t rc = Bitpack_getu(instruction, 3, 0);
 
@@ -221,41 +942,43 @@ Status handle_inpt(Executor executor, uint32_t instruction)
 
     assert(c >= -1 && c < 256);
 
+    // Undone, to be executed again when the run is resumed
+    if (c == -1 && executor->stop_at_eof) {
+        (*executor->pc)--;
+        executor->steps--;
+        executor->stopped = STOP_INPUT;
+        return HALT;
+    }
     executor->registers[rc] = (c == -1 ? ~(0u) : (uint32_t)c);
+    if (hooks & HOOK_IO)
+        on_io(executor, executor->steps, false, c);
 
     return CONT;
 }
 
-Status handle_lodp(Executor executor, uint32_t instruction)
+static inline Status hooked_lodp(Executor executor, uint32_t instruction,
+                                 const unsigned hooks)
 {
     uint32_t rb = Bitpack_getu(instruction, 3, 3);
     uint32_t rc = Bitpack_getu(instruction, 3, 0);
 
     uint32_t *reg = executor->registers;
-    Memory mem = executor->memory;
 
     uint32_t rbv = reg[rb];
     uint32_t rcv = reg[rc];
 
-    if (rbv != 0) {
-        // Get segments to operate on
-        Segment *seg = get_segment(mem, rbv);
-        Segment *prog_seg = get_segment(mem, 0);
+    if (executor->safe && rbv != 0 && !checked_unmap(executor, rbv))
+        return HALT;
 
-        // Duplicate the segment
-        uint32_t *new_data = malloc(seg->size * sizeof(uint32_t));
-        for (int i = 0; i < seg->size; i++)
-            new_data[i] = seg->data[i];
+    if (rbv != 0)
+        load_program(executor, rbv);
+    if (hooks & HOOK_LODP)
+        on_lodp(executor, executor->steps, rbv, rcv);
 
-        // Free old program and set new program
-        free(prog_seg->data);
-        prog_seg->data = new_data;
-        prog_seg->size = seg->size;
-    }
     // Set program counter
     *executor->pc = rcv;
 
-    return CONT;
+    return stop_due(executor, executor->steps, rcv) ? HALT : CONT;
 }
 
 Status handle_lodv(Executor executor, uint32_t instruction)
@@ -268,3 +991,741 @@ Status handle_lodv(Executor executor, uint32_t instruction)
 
     return CONT;
 }
+
+/*
+ * Stores a word into a segment. Stores into segment 0 also update the
+ * translation of the running program, if there is one. Returns HALT if safe
+ * mode rejects the store.
+ */
+static Status store_word(Executor executor, uint32_t id, uint32_t index,
+                         uint32_t value)
+{
+    if (executor->safe) {
+        uint32_t *word = checked_word(executor, id, index);
+        if (word == NULL)
+            return HALT;
+        *word = value;
+    } else {
+        SegCache_lookup(&executor->segs, executor->memory, id)[index] = value;
+    }
+
+    if (id == 0 && executor->program != NULL)
+        Translation_patch(executor->program, index, value);
+
+    return CONT;
+}
+
+/*
+ * Returns the address of a word that a segmented load or store in safe mode
+ * is about to access, or NULL after recording a machine failure if the
+ * access is known to be invalid. Accesses past the end of a guarded segment
+ * are let through, to fault on its guard.
+ */
+static uint32_t *checked_word(Executor executor, uint32_t id, uint32_t index)
+{
+    uint32_t *data = SegCache_checked(&executor->segs, executor->memory, id,
+                                      index);
+    if (data == NULL) {
+        machine_fault(executor, id, index);
+        return NULL;
+    }
+
+    return data + index;
+}
+
+/*
+ * Checks in safe mode that a segment about to be unmapped or loaded as the
+ * program is mapped. Segment 0 may be loaded but not unmapped; to keep things
+ * simple, loading it never gets here. Returns false after recording a
+ * machine failure if not.
+ */
+static bool checked_unmap(Executor executor, uint32_t id)
+{
+    uint32_t limit;
+    if (id == 0 || checked_segment(executor->memory, id, &limit) == NULL) {
+        machine_fault(executor, id, 0);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Records a machine failure of the instruction just fetched, an access to a
+ * word of a segment, and returns HALT.
+ */
+static Status machine_fault(Executor executor, uint32_t id, uint32_t index)
+{
+    executor->fault.pc = *executor->pc - 1;
+    executor->fault.segment = id;
+    executor->fault.index = index;
+    executor->faulted = true;
+
+    return HALT;
+}
+
+/*
+ * Replaces segment 0 with a duplicate of the given segment. The translation
+ * of the old program is retired to the table of recent programs; the new one
+ * is found or built lazily by Executor_run.
+ */
+static void load_program(Executor executor, uint32_t id)
+{
+    // The old segment 0 is about to be unmapped
+    executor->protected_base = NULL;
+    executor->protection_abandoned = false;
+    free(executor->page_faults);
+    executor->page_faults = NULL;
+
+    load_program_segment(executor->memory, id);
+    SegCache_forget(&executor->segs, 0);
+    if (executor->profiler != NULL)
+        Profiler_load(executor->profiler);
+
+    if (executor->spec != NULL)
+        free_specialized(&executor->spec);
+    if (executor->program != NULL) {
+        TransTable_insert(executor->recent, executor->program);
+        executor->program = NULL;
+    }
+    if (executor->job != NULL)
+        free_compile_job(&executor->job);
+}
+
+/*
+ * Translates segment 0. A translation of identical code is reinstated from
+ * the table of recent programs if possible, then from the on-disk cache when
+ * one is in use. Otherwise the segment is handed to the background compiler,
+ * leaving the executor without a translation for now, or translated on the
+ * spot. Fresh translations are written back to the cache.
+ */
+static void translate_program(Executor executor)
+{
+    Segment *prog_seg = get_segment(executor->memory, 0);
+    uint32_t length = prog_seg->size;
+    uint64_t hash = Translation_hash(prog_seg->data, length);
+
+    executor->program = TransTable_take(executor->recent, hash, length);
+    if (executor->program != NULL)
+        return;
+
+    if (executor->cache != NULL) {
+        executor->program = TransCache_lookup(executor->cache, hash, length);
+        if (executor->program != NULL)
+            return;
+    }
+
+    if (executor->compiler != NULL) {
+        executor->job = Compiler_submit(executor->compiler, prog_seg->data,
+                                        length, hash);
+        if (executor->job != NULL)
+            return;
+    }
+
+    executor->program = new_translation(prog_seg->data, length, hash);
+    if (executor->cache != NULL)
+        TransCache_store(executor->cache, executor->program);
+}
+
+/*
+ * The loop of interpret, for one set of hooks.
+ */
+static inline Status interpret_loop(Executor executor, const Handler *handlers,
+                                    const unsigned hooks)
+{
+    Memory mem = executor->memory;
+    uint32_t *pc = executor->pc;
+
+    for (;;) {
+        for (int i = 0; i < INTERPRET_SLICE; i++) {
+            uint32_t instruction = get_segment(mem, 0)->data[(*pc)++];
+            executor->steps++;
+            if (hooks & HOOK_INSTRUCTION)
+                on_instruction(executor, executor->steps, *pc - 1,
+                               instruction);
+            uint32_t opcode =
+                Bitpack_getu(instruction, OPCODE_WIDTH, OPCODE_LSB);
+            if (handlers[opcode](executor, instruction) == HALT)
+                return HALT;
+
+            // load_program abandons the job when it replaces segment 0
+            if (executor->job == NULL)
+                return CONT;
+        }
+
+        Translation trans = CompileJob_result(executor->job);
+        if (trans != NULL) {
+            adopt_translation(executor, trans);
+            return CONT;
+        }
+    }
+}
+
+/*
+ * Installs a translation built in the background. Words of segment 0 that
+ * were stored to since the request was made are re-decoded first.
+ */
+static void adopt_translation(Executor executor, Translation trans)
+{
+    const uint32_t *words = CompileJob_words(executor->job);
+    Segment *prog_seg = get_segment(executor->memory, 0);
+
+    for (uint32_t i = 0; i < trans->length; i++)
+        if (prog_seg->data[i] != words[i])
+            Translation_patch(trans, i, prog_seg->data[i]);
+
+    executor->program = trans;
+    free_compile_job(&executor->job);
+}
+
+/*
+ * The loop of run_handlers, for one set of hooks.
+ */
+static inline Status handlers_loop(Executor executor, const Handler *handlers,
+                                   const unsigned hooks)
+{
+    Memory mem = executor->memory;
+    uint32_t *pc = executor->pc;
+
+    Status status;
+    do {
+        uint32_t instruction = get_segment(mem, 0)->data[(*pc)++];
+        executor->steps++;
+        if (hooks & HOOK_INSTRUCTION)
+            on_instruction(executor, executor->steps, *pc - 1, instruction);
+        uint32_t opcode = Bitpack_getu(instruction, OPCODE_WIDTH, OPCODE_LSB);
+        status = handlers[opcode](executor, instruction);
+    } while (status != HALT);
+
+    return HALT;
+}
+
+/*
+ * Copies of the handlers with hook points, of the handlers and interpreter
+ * loops running them, and of the pre-decoded loop, for each set of hooks in
+ * HOOK_CONFIGS. The pre-decoded loop is copied within each set for write
+ * protection, whose stores skip the segment 0 check, and for safe mode,
+ * which checks segmented accesses and keeps the program counter in the
+ * executor up to date for the SIGSEGV handler.
+ */
+#define DEFINE_HOOK_CONFIG(name, hooks)                                        \
+    static Status mseg_##name(Executor executor, uint32_t instruction)         \
+    {                                                                          \
+        return hooked_mseg(executor, instruction, hooks);                      \
+    }                                                                          \
+    static Status useg_##name(Executor executor, uint32_t instruction)         \
+    {                                                                          \
+        return hooked_useg(executor, instruction, hooks);                      \
+    }                                                                          \
+    static Status outp_##name(Executor executor, uint32_t instruction)         \
+    {                                                                          \
+        return hooked_outp(executor, instruction, hooks);                      \
+    }                                                                          \
+    static Status inpt_##name(Executor executor, uint32_t instruction)         \
+    {                                                                          \
+        return hooked_inpt(executor, instruction, hooks);                      \
+    }                                                                          \
+    static Status lodp_##name(Executor executor, uint32_t instruction)         \
+    {                                                                          \
+        return hooked_lodp(executor, instruction, hooks);                      \
+    }                                                                          \
+    static const Handler handlers_##name[NUM_INSTRUCTIONS] = {                 \
+        handle_cmov, handle_slod, handle_sstr, handle_adtn,                    \
+        handle_mult, handle_dvsn, handle_nand, handle_halt,                    \
+        mseg_##name, useg_##name, outp_##name, inpt_##name,                    \
+        lodp_##name, handle_lodv};                                             \
+    static Status interpret_##name(Executor executor)                          \
+    {                                                                          \
+        return interpret_loop(executor, handlers_##name, hooks);               \
+    }                                                                          \
+    static Status run_handlers_##name(Executor executor)                       \
+    {                                                                          \
+        return handlers_loop(executor, handlers_##name, hooks);                \
+    }                                                                          \
+    static Status predecoded_##name(Executor executor, bool check_stores,      \
+                                    bool safe)                                 \
+    {                                                                          \
+        if (safe)                                                              \
+            return check_stores                                                \
+                       ? predecoded_loop(executor, true, true, hooks)          \
+                       : predecoded_loop(executor, false, true, hooks);        \
+        return check_stores ? predecoded_loop(executor, true, false, hooks)    \
+                            : predecoded_loop(executor, false, false, hooks);  \
+    }
+HOOK_CONFIGS(DEFINE_HOOK_CONFIG)
+
+#define HOOK_CONFIG_ENTRY(name, hooks)                                         \
+    {hooks, interpret_##name, run_handlers_##name, predecoded_##name},
+static const struct {
+    unsigned hooks;
+    Status (*interpret)(Executor executor);
+    Status (*handlers)(Executor executor);
+    Status (*predecoded)(Executor executor, bool check_stores, bool safe);
+} hook_configs[] = {HOOK_CONFIGS(HOOK_CONFIG_ENTRY)};
+
+/*
+ * Picks the leanest set of hooks in hook_configs with all the hooks in use;
+ * the last has them all.
+ */
+static int hook_config(Executor executor)
+{
+    unsigned hooks = hooks_in_use(executor);
+
+    int i = 0;
+    while ((hook_configs[i].hooks & hooks) != hooks)
+        i++;
+    return i;
+}
+
+/*
+ * Interprets segment 0 one word at a time while its translation is being
+ * built, checking for the result every INTERPRET_SLICE instructions. Returns
+ * HALT if the program halts, or CONT once the translation has been adopted
+ * or a load program instruction has installed other code. Runs the leanest
+ * copy of the loop with all the hooks in use.
+ */
+static Status interpret(Executor executor)
+{
+    return hook_configs[hook_config(executor)].interpret(executor);
+}
+
+/*
+ * The handlers engine: the original fetch and Executor_process loop, run
+ * straight from the words of segment 0 until the program halts, with the
+ * leanest copy of the handlers that has all the hooks in use.
+ */
+static Status run_handlers(Executor executor)
+{
+    return hook_configs[hook_config(executor)].handlers(executor);
+}
+
+/*
+ * The pre-decoded engine: a switch over the translation of segment 0.
+ * Returns HALT if the program halts, or CONT once a load program
+ * instruction has installed new code. Runs the leanest copy of the loop
+ * with all the hooks in use.
+ */
+static Status run_predecoded(Executor executor)
+{
+    bool check_stores = executor->protected_base == NULL;
+
+    return hook_configs[hook_config(executor)].predecoded(
+        executor, check_stores, executor->safe);
+}
+
+static inline Status predecoded_loop(Executor executor, const bool check_stores,
+                                     const bool safe, const unsigned hooks)
+{
+    uint32_t *reg = executor->registers;
+    Memory mem = executor->memory;
+    SegCache *segs = &executor->segs;
+    uint32_t pc = *executor->pc;
+    uint64_t steps = executor->steps;
+    Instr *code = executor->program->code;
+    // Segment 0 stays put until a load program instruction ends the loop
+    const uint32_t *words =
+        (hooks & HOOK_INSTRUCTION) ? segment_data(mem, 0) : NULL;
+
+    for (;;) {
+        Instr instr = code[pc++];
+        steps++;
+        // A stale instruction is hooked when it is retried
+        if ((hooks & HOOK_INSTRUCTION) && instr.opcode != INSTR_STALE)
+            on_instruction(executor, steps, pc - 1, words[pc - 1]);
+        uint32_t a = instr.ra, b = instr.rb, c = instr.rc;
+
+        switch (instr.opcode) {
+        case 0:
+            if (reg[c] != 0)
+                reg[a] = reg[b];
+            break;
+        case 1:
+            if (safe) {
+                *executor->pc = pc;
+                executor->steps = steps;
+                uint32_t *word = checked_word(executor, reg[b], reg[c]);
+                if (word == NULL)
+                    return HALT;
+                reg[a] = *word;
+                break;
+            }
+            reg[a] = SegCache_lookup(segs, mem, reg[b])[reg[c]];
+            break;
+        case 2:
+            if (safe) {
+                *executor->pc = pc;
+                executor->steps = steps;
+                uint32_t *word = checked_word(executor, reg[a], reg[b]);
+                if (word == NULL)
+                    return HALT;
+                *word = reg[c];
+            } else {
+                SegCache_lookup(segs, mem, reg[a])[reg[b]] = reg[c];
+            }
+            if (check_stores && reg[a] == 0)
+                Translation_patch(executor->program, reg[b], reg[c]);
+            break;
+        case 3:
+            reg[a] = reg[b] + reg[c];
+            break;
+        case 4:
+            reg[a] = reg[b] * reg[c];
+            break;
+        case 5:
+            reg[a] = reg[b] / reg[c];
+            break;
+        case 6:
+            reg[a] = ~(reg[b] & reg[c]);
+            break;
+        case 7:
+            *executor->pc = pc;
+            executor->steps = steps;
+            return HALT;
+        case 8: {
+            uint32_t size = reg[c];
+            reg[b] = new_segment(mem, size);
+            if (reg[b] == 0) {
+                *executor->pc = pc;
+                executor->steps = steps;
+                return HALT;
+            }
+            if (hooks & HOOK_MAP)
+                on_map(executor, steps, reg[b], size);
+            break;
+        }
+        case 9:
+            if (safe) {
+                *executor->pc = pc;
+                executor->steps = steps;
+                if (!checked_unmap(executor, reg[c]))
+                    return HALT;
+            }
+            if (hooks & HOOK_UNMAP)
+                on_unmap(executor, steps, reg[c]);
+            remove_segment(mem, reg[c]);
+            SegCache_forget(segs, reg[c]);
+            break;
+        case 10:
+            assert(reg[c] < 256);
+            putc((char)reg[c], stdout);
+            if (hooks & HOOK_IO)
+                on_io(executor, steps, true, (int)reg[c]);
+            break;
+        case 11: {
+            int ch = getchar();
+            assert(ch >= -1 && ch < 256);
+            if (ch == -1 && executor->stop_at_eof) {
+                *executor->pc = pc - 1;
+                executor->steps = steps - 1;
+                executor->stopped = STOP_INPUT;
+                return HALT;
+            }
+            reg[c] = (ch == -1 ? ~(0u) : (uint32_t)ch);
+            if (hooks & HOOK_IO)
+                on_io(executor, steps, false, ch);
+            break;
+        }
+        case 12:
+            if (reg[b] != 0) {
+                if (safe) {
+                    *executor->pc = pc;
+                    executor->steps = steps;
+                    if (!checked_unmap(executor, reg[b]))
+                        return HALT;
+                }
+                load_program(executor, reg[b]);
+                if (hooks & HOOK_LODP)
+                    on_lodp(executor, steps, reg[b], reg[c]);
+                *executor->pc = reg[c];
+                executor->steps = steps;
+                return stop_due(executor, steps, reg[c]) ? HALT : CONT;
+            }
+            if (hooks & HOOK_LODP)
+                on_lodp(executor, steps, 0, reg[c]);
+            pc = reg[c];
+            if (stop_due(executor, steps, pc)) {
+                *executor->pc = pc;
+                executor->steps = steps;
+                return HALT;
+            }
+            break;
+        case 13:
+            reg[a] = instr.value;
+            break;
+        case INSTR_STALE:
+            // Invalidated by a store under write protection; retry
+            pc--;
+            steps--;
+            if (refresh_page(executor, pc)) {
+                // Protection was given up; switch to the checked loop
+                *executor->pc = pc;
+                executor->steps = steps;
+                return CONT;
+            }
+            break;
+        default:
+            assert(instr.opcode < NUM_INSTRUCTIONS);
+        }
+    }
+}
+
+/*
+ * The specialized engine: builds the handler stream for the current
+ * translation if there is none yet, and runs it. Returns like
+ * run_predecoded.
+ */
+static Status run_specialized(Executor executor)
+{
+    if (executor->spec == NULL)
+        executor->spec =
+            new_specialized(executor->program, executor->memory,
+                            &executor->segs, executor->protected_base == NULL,
+                            &executor->attention);
+
+    uint32_t load_id;
+    SpecStatus status = Specialized_run(executor->spec, executor->registers,
+                                        executor->pc, &load_id,
+                                        &executor->steps);
+    if (status == SPEC_HALT)
+        return HALT;
+    if (status == SPEC_STOP)
+        return stop_due(executor, executor->steps, *executor->pc) ? HALT
+                                                                  : CONT;
+
+    // If protection is given up, the stream is rebuilt with checked stores
+    if (status == SPEC_STALE) {
+        refresh_page(executor, *executor->pc);
+        return CONT;
+    }
+
+    // Specialized_run has already set the program counter
+    load_program(executor, load_id);
+    return stop_due(executor, executor->steps, *executor->pc) ? HALT : CONT;
+}
+
+/*
+ * Makes every page of segment 0 read-only, so that the first store into each
+ * page reaches handle_fault. If the pages cannot be protected, stores are
+ * checked instead for the rest of the current program.
+ */
+static void protect_program(Executor executor)
+{
+    Segment *prog_seg = get_segment(executor->memory, 0);
+    size_t bytes = (size_t)prog_seg->size * sizeof(uint32_t);
+
+    if (bytes > 0 && mprotect(prog_seg->data, bytes, PROT_READ) != 0) {
+        executor->protection_abandoned = true;
+        return;
+    }
+
+    uint32_t page_words = page_size / sizeof(uint32_t);
+    uint32_t pages = (prog_seg->size + page_words - 1) / page_words;
+    executor->page_faults = calloc(pages > 0 ? pages : 1, sizeof(uint32_t));
+
+    executor->protected_length = prog_seg->size;
+    executor->protected_base = prog_seg->data;
+}
+
+/*
+ * Re-translates the page of segment 0 holding the given word after stores
+ * into it have invalidated its translation, and protects it again. A page
+ * that keeps being written to holds data as well as code, and faulting on
+ * it would cost far more than checking stores, so after MAX_PAGE_FAULTS
+ * faults protection is given up for the rest of the current program.
+ * Returns whether that happened.
+ */
+static bool refresh_page(Executor executor, uint32_t index)
+{
+    uint32_t page_words = page_size / sizeof(uint32_t);
+    if (executor->page_faults[index / page_words] > MAX_PAGE_FAULTS) {
+        abandon_protection(executor);
+        return true;
+    }
+
+    uint32_t first = index / page_words * page_words;
+    uint32_t count = executor->protected_length - first;
+    if (count > page_words)
+        count = page_words;
+
+    uint32_t *data = executor->protected_base;
+    for (uint32_t i = first; i < first + count; i++)
+        Translation_patch(executor->program, i, data[i]);
+    if (executor->spec != NULL)
+        Specialized_refresh(executor->spec, first, count);
+
+    int result = mprotect(data + first, page_size, PROT_READ);
+    assert(result == 0);
+    (void)result;
+    return false;
+}
+
+/*
+ * Unprotects all of segment 0 and re-translates every stale instruction.
+ * The handler stream of the specialized engine, built without store checks,
+ * is dropped so that it is rebuilt with them.
+ */
+static void abandon_protection(Executor executor)
+{
+    uint32_t *data = executor->protected_base;
+    Translation program = executor->program;
+
+    executor->protected_base = NULL;
+    executor->protection_abandoned = true;
+    int result = mprotect(data,
+                          (size_t)executor->protected_length *
+                              sizeof(uint32_t),
+                          PROT_READ | PROT_WRITE);
+    assert(result == 0);
+    (void)result;
+
+    for (uint32_t i = 0; i < program->length; i++)
+        if (program->code[i].opcode == INSTR_STALE)
+            Translation_patch(program, i, data[i]);
+
+    if (executor->spec != NULL)
+        free_specialized(&executor->spec);
+}
+
+/*
+ * The hook points the executor's own instrumentation and the client's hooks
+ * need.
+ */
+static unsigned hooks_in_use(Executor executor)
+{
+    unsigned hooks = executor->client_hooks;
+    if (executor->profiler != NULL)
+        hooks |= HOOK_INSTRUCTION | HOOK_LODP;
+    if (executor->instrtrace != NULL)
+        hooks |= HOOK_INSTRUCTION;
+    if (executor->memtrace != NULL)
+        hooks |= HOOK_LODP | HOOK_MAP | HOOK_UNMAP;
+    if (executor->telemetry != NULL)
+        hooks |= HOOK_LODP | HOOK_IO;
+
+    return hooks;
+}
+
+/*
+ * Samples and traces the instruction at pc, which is about to be executed.
+ * The word is taken from segment 0, since its translation may be stale.
+ */
+static inline void on_instruction(Executor executor, uint64_t steps,
+                                  uint32_t pc, uint32_t word)
+{
+    if (executor->profiler != NULL && steps >= executor->profiler->due)
+        Profiler_sample(executor->profiler, pc, word >> OPCODE_LSB, steps);
+    if (executor->instrtrace != NULL)
+        InstrTrace_record(executor->instrtrace, pc, word, executor->registers);
+    if (executor->hooks.instruction != NULL)
+        executor->hooks.instruction(executor->hooks.cl, steps, pc, word,
+                                    executor->registers);
+}
+
+/*
+ * Called once a load program instruction has loaded segment, or 0 for a
+ * jump, and is about to continue at pc.
+ */
+static inline void on_lodp(Executor executor, uint64_t steps,
+                           uint32_t segment, uint32_t pc)
+{
+    executor->jumps++;
+    if (segment != 0 && executor->memtrace != NULL)
+        MemTrace_record(executor->memtrace, MEM_LOAD, steps, segment, 0);
+    if (executor->profiler != NULL)
+        Profiler_jump(executor->profiler, pc);
+    if (executor->hooks.lodp != NULL)
+        executor->hooks.lodp(executor->hooks.cl, steps, segment, pc);
+}
+
+static inline void on_map(Executor executor, uint64_t steps, uint32_t segment,
+                          uint32_t size)
+{
+    if (executor->memtrace != NULL)
+        MemTrace_record(executor->memtrace, MEM_MAP, steps, segment, size);
+    if (executor->hooks.map != NULL)
+        executor->hooks.map(executor->hooks.cl, steps, segment, size);
+}
+
+static inline void on_unmap(Executor executor, uint64_t steps,
+                            uint32_t segment)
+{
+    if (executor->memtrace != NULL)
+        MemTrace_record(executor->memtrace, MEM_UNMAP, steps, segment, 0);
+    if (executor->hooks.unmap != NULL)
+        executor->hooks.unmap(executor->hooks.cl, steps, segment);
+}
+
+static inline void on_io(Executor executor, uint64_t steps, bool output,
+                         int byte)
+{
+    if (output)
+        executor->output++;
+    else
+        executor->input += byte != -1;
+    if (executor->hooks.io != NULL)
+        executor->hooks.io(executor->hooks.cl, steps, output, byte);
+}
+
+/*
+ * Installs handle_fault as the SIGSEGV handler.
+ */
+static bool install_fault_handler(void)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handle_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+
+    return sigaction(SIGSEGV, &action, NULL) == 0;
+}
+
+/*
+ * The SIGSEGV handler used with write protection and safe mode. A fault
+ * inside protected segment 0 invalidates the translation of the faulting
+ * page and unprotects it, so that the store is retried and succeeds. A fault
+ * on a guard page while a safe executor runs is recorded as a machine
+ * failure and ends Executor_run. Any other fault restores the default action,
+ * so that retrying the access kills the process as usual.
+ */
+static void handle_fault(int sig, siginfo_t *info, void *context)
+{
+    (void)context;
+
+    Executor executor = protected_executor;
+    uintptr_t addr = (uintptr_t)info->si_addr;
+
+    if (executor == NULL || executor->protected_base == NULL ||
+        addr < (uintptr_t)executor->protected_base ||
+        addr >= (uintptr_t)(executor->protected_base +
+                            executor->protected_length)) {
+        Executor safe = safe_executor;
+        uint32_t id, index;
+        if (safe != NULL && safe->fault_armed &&
+            guard_fault(safe->memory, info->si_addr, &id, &index)) {
+            machine_fault(safe, id, index);
+            siglongjmp(safe->fault_jump, 1);
+        }
+        signal(sig, SIG_DFL);
+        return;
+    }
+
+    uint32_t page_words = page_size / sizeof(uint32_t);
+    uint32_t index = (addr - (uintptr_t)executor->protected_base) /
+                     sizeof(uint32_t);
+    uint32_t first = index / page_words * page_words;
+    uint32_t count = executor->protected_length - first;
+    if (count > page_words)
+        count = page_words;
+
+    executor->page_faults[index / page_words]++;
+    Translation_invalidate(executor->program, first, count);
+    if (executor->spec != NULL)
+        Specialized_invalidate(executor->spec, first, count);
+
+    // Returning to a store that still faults would loop forever, so let it
+    // crash instead
+    if (mprotect(executor->protected_base + first, page_size,
+                 PROT_READ | PROT_WRITE) != 0)
+        signal(sig, SIG_DFL);
+}
@@ -2,12 +2,122 @@
 #define EXECUTOR_INCLUDED
 
 #include "bitpack.h"
+#include "compiler.h"
+#include "instrtrace.h"
 #include "memory.h"
+#include "memtrace.h"
+#include "profiler.h"
+#include "telemetry.h"
+#include "transcache.h"
 #include <stdlib.h>
 
 typedef struct Executor *Executor;
 typedef enum Status { CONT, HALT } Status;
 
+/*
+ * A machine failure caught in safe mode: the instruction at pc, with the
+ * given opcode, accessed word index of segment, which was either not mapped
+ * or too short. Failed unmap and load program instructions have index 0.
+ */
+typedef struct MachineFault {
+    uint32_t pc;
+    uint32_t opcode;
+    uint32_t segment;
+    uint32_t index;
+} MachineFault;
+
+/*
+ * Why Executor_run stopped before the program halted, if it did.
+ */
+typedef enum Stop {
+    STOP_NONE,      /* the program halted, or failed in safe mode */
+    STOP_STEPS,     /* the step limit was reached */
+    STOP_TIMEOUT,   /* the time limit was reached */
+    STOP_CANCELLED, /* Executor_cancel was called */
+    STOP_INPUT      /* the input ran out, under Executor_stop_at_eof */
+} Stop;
+
+/*
+ * A load program target, and how many of the jumps sampled for a progress
+ * report went there.
+ */
+typedef struct JumpCount {
+    uint32_t target;
+    uint64_t count;
+} JumpCount;
+
+/* The jumps sampled for a progress report, and the most frequent targets
+ * handed to a Reporter */
+#define REPORT_JUMPS 65536
+#define REPORT_HOTTEST 10
+
+/*
+ * Called on the executor's own thread with a progress report: the hottest
+ * load program targets, most frequent first, and the client's closure. The
+ * program counter, registers and Executor_steps are up to date.
+ */
+typedef void (*Reporter)(Executor executor, const JumpCount *hottest,
+                         int count, void *cl);
+
+/*
+ * The points in a run that can be hooked.
+ */
+typedef enum Hook {
+    HOOK_INSTRUCTION = 1,
+    HOOK_LODP = 2,
+    HOOK_MAP = 4,
+    HOOK_UNMAP = 8,
+    HOOK_IO = 16
+} Hook;
+
+#define HOOKS_ALL 31
+
+/*
+ * Functions for Executor_run to call at the hooked points, with the client's
+ * closure and the number of instructions executed so far, counting the one
+ * that triggers the call. Any of them may be NULL.
+ *
+ * instruction  Before every instruction, with its pc and word and the
+ *              registers
+ * lodp         After every load program instruction, with the segment
+ *              loaded (0 for a jump within segment 0) and the new pc
+ * map          After every segment mapped, with its identifier and size
+ * unmap        Before every segment unmapped
+ * io           After every output instruction, with output true and the
+ *              byte, and every input instruction, with the byte or -1 at
+ *              the end of input
+ */
+typedef struct ExecutorHooks {
+    void (*instruction)(void *cl, uint64_t steps, uint32_t pc, uint32_t word,
+                        const uint32_t *registers);
+    void (*lodp)(void *cl, uint64_t steps, uint32_t segment, uint32_t pc);
+    void (*map)(void *cl, uint64_t steps, uint32_t segment, uint32_t size);
+    void (*unmap)(void *cl, uint64_t steps, uint32_t segment);
+    void (*io)(void *cl, uint64_t steps, bool output, int byte);
+    void *cl;
+} ExecutorHooks;
+
+/*
+ * The ways Executor_run can execute a program.
+ *
+ * ENGINE_HANDLERS      Fetches each word from segment 0 and hands it to
+ *                      Executor_process; nothing is translated
+ * ENGINE_PREDECODED    A switch over pre-decoded instructions
+ * ENGINE_SPECIALIZED   One handler call per instruction, with a handler
+ *                      generated for every combination of register operands.
+ *                      Slower than ENGINE_PREDECODED in an optimized build
+ *                      and kept only to compare against: it honours stop
+ *                      and report requests, but ENGINE_PREDECODED runs in
+ *                      its place whenever anything else has to be counted
+ *                      or checked
+ */
+typedef enum Engine {
+    ENGINE_HANDLERS,
+    ENGINE_PREDECODED,
+    ENGINE_SPECIALIZED,
+    NUM_ENGINES
+} Engine;
+
 /*
  * Executor_new
  *
@@ -49,4 +159,354 @@ void free_executor(Executor *exec);
  */
 Status Executor_process(Executor executor, uint32_t instruction);
 
+/*
+ * Executor_run
+ *
+ * Runs the program in segment 0 from the current program counter until it
+ * halts. Segment 0 is translated once into pre-decoded instructions, and
+ * retranslated only when a load program instruction installs new code. Stores
+ * into segment 0 keep the translation up to date.
+ *
+ * The program also halts, just after the instruction, when a map segment
+ * instruction is refused by the memory module, over its quota or out of
+ * indices; the instruction's register B is then 0, and memory_quota_exceeded
+ * and memory_exhausted tell the cases apart. In safe mode, it halts instead
+ * of executing an instruction that would fail; Executor_fault then describes
+ * the failure.
+ *
+ * @param  Executor executor    The executor to run
+ * @return Status               HALT once the program has halted
+ * @expect The program counter points into segment 0
+ */
+Status Executor_run(Executor executor);
+
+/*
+ * Executor_use_engine
+ *
+ * Selects the engine Executor_run executes translated programs with. The
+ * default is ENGINE_PREDECODED.
+ *
+ * @param  Executor executor    The executor to configure
+ * @param  Engine engine        The engine to use
+ */
+void Executor_use_engine(Executor executor, Engine engine);
+
+/*
+ * Engine_name
+ *
+ * @param  Engine engine        An engine
+ * @return char *               The name of the engine, as accepted by
+ *                              Engine_from_name
+ */
+const char *Engine_name(Engine engine);
+
+/*
+ * Engine_from_name
+ *
+ * Looks up an engine by name ("handlers", "predecoded" or "specialized").
+ *
+ * @param  char *name           The name to look up
+ * @param  Engine *engine       Set to the engine if the name is known
+ * @return bool                 Whether the name is known
+ */
+bool Engine_from_name(const char *name, Engine *engine);
+
+/*
+ * Executor_steps
+ *
+ * @param  Executor executor    The executor to query
+ * @return uint64_t             The number of instructions executed so far by
+ *                              Executor_run, including the final halt
+ */
+uint64_t Executor_steps(Executor executor);
+
+/*
+ * Executor_set_steps
+ *
+ * Sets the instruction count of a run resumed from a snapshot to the number
+ * of instructions executed before the snapshot, so that Executor_steps and
+ * the step limit count those too.
+ *
+ * @param  Executor executor    The executor to update
+ * @param  uint64_t steps       The instructions executed so far
+ * @expect The executor is not running
+ */
+void Executor_set_steps(Executor executor, uint64_t steps);
+
+/*
+ * Executor_use_write_protection
+ *
+ * Detects writes to segment 0 with page protection instead of checking the
+ * segment of every store. While a translation of segment 0 is in use, its
+ * pages are read-only; the first store into a page raises SIGSEGV, whose
+ * handler invalidates the translation of that page only and makes it
+ * writable so the store can go ahead. The page is re-translated and
+ * protected again when one of its instructions is next executed. Stores to
+ * other segments then carry no check at all.
+ *
+ * Segment 0 is moved into a page-aligned mapping of its own, so the client
+ * must not free or replace its data directly afterwards. Only one executor
+ * may use write protection at a time, since it owns the SIGSEGV handler.
+ *
+ * @param  Executor executor    The executor to configure
+ * @return bool                 Whether the signal handler could be installed
+ */
+bool Executor_use_write_protection(Executor executor);
+
+/*
+ * Executor_use_safe_mode
+ *
+ * Makes Executor_run report out-of-bounds segmented loads and stores, and
+ * accesses, unmaps and program loads of unmapped segments, as machine
+ * failures instead of corrupting memory or crashing. Large segments are
+ * placed in front of guard pages, so their bounds cost nothing to check: an
+ * access past the end raises SIGSEGV, whose handler records the failure and
+ * stops the run. Only segments too small or too many to guard are checked
+ * explicitly. The specialized engine is not available in safe mode, and
+ * ENGINE_PREDECODED is used in its place.
+ *
+ * Must be called before any segment other than segment 0 is mapped. Only
+ * one executor may use safe mode at a time, since it shares the SIGSEGV
+ * handler with write protection.
+ *
+ * @param  Executor executor    The executor to configure
+ * @return bool                 Whether the signal handler could be installed
+ */
+bool Executor_use_safe_mode(Executor executor);
+
+/*
+ * Executor_fault
+ *
+ * @param  Executor executor    The executor to query
+ * @param  MachineFault *fault  Set to the machine failure that stopped the
+ *                              last run, if any
+ * @return bool                 Whether a run was stopped by a machine failure
+ */
+bool Executor_fault(Executor executor, MachineFault *fault);
+
+/*
+ * Executor_use_step_limit
+ *
+ * Makes Executor_run stop once the program has executed a number of
+ * instructions. The limit is checked only at load program instructions, so
+ * the run stops at the first one to reach it; since every loop goes through
+ * one, a run can only overshoot by a stretch of straight-line code. The
+ * pre-decoded engine is used in place of the specialized one while a limit
+ * is set.
+ *
+ * @param  Executor executor    The executor to configure
+ * @param  uint64_t steps       The number of instructions, or UINT64_MAX for
+ *                              no limit
+ */
+void Executor_use_step_limit(Executor executor, uint64_t steps);
+
+/*
+ * Executor_use_time_limit
+ *
+ * Makes each call of Executor_run stop once it has run for a number of
+ * milliseconds of wall-clock time. A timer thread stops the run the way
+ * Executor_cancel does.
+ *
+ * @param  Executor executor    The executor to configure
+ * @param  uint64_t ms          The time limit, or 0 for no limit
+ * @return bool                 Whether the timer could be created
+ */
+bool Executor_use_time_limit(Executor executor, uint64_t ms);
+
+/*
+ * Executor_cancel
+ *
+ * Asks a run to stop at its next load program instruction. May be called
+ * from any thread, or from a signal handler. The request stays in force, so
+ * an executor cancelled before or between runs stops at once.
+ *
+ * @param  Executor executor    The executor to stop
+ */
+void Executor_cancel(Executor executor);
+
+/*
+ * Executor_use_telemetry
+ *
+ * Makes Executor_run publish its counters to a telemetry page: when it
+ * starts and stops, and every TELEMETRY_INTERVAL_MS in between, at the next
+ * load program instruction. The pre-decoded engine is used in place of the
+ * specialized one while publishing. The telemetry is not freed with the
+ * executor.
+ *
+ * @param  Executor executor    The executor to configure
+ * @param  Telemetry telemetry  The page to publish to, or NULL to stop
+ *                              publishing
+ * @return bool                 Whether the interval timer could be created
+ */
+bool Executor_use_telemetry(Executor executor, Telemetry telemetry);
+
+/*
+ * Executor_stop_at_eof
+ *
+ * Makes Executor_run stop at an input instruction that finds the end of
+ * input, without executing it, rather than giving the program all ones. The
+ * run can then be resumed once more input is available, after reopening
+ * standard input, or after forking to try several continuations. The
+ * pre-decoded engine is used in place of the specialized one while stopping
+ * at the end of input.
+ *
+ * @param  Executor executor    The executor to configure
+ * @param  bool stop            Whether to stop at the end of input
+ */
+void Executor_stop_at_eof(Executor executor, bool stop);
+
+/*
+ * Executor_stopped
+ *
+ * Tells why the last run stopped early. The program counter and
+ * Executor_steps then show how far it got. The state is consistent, so a
+ * run stopped by its step or time limit can be resumed with Executor_run,
+ * after raising the step limit or with a new time limit.
+ *
+ * @param  Executor executor    The executor to query
+ * @return Stop                 Why the last run stopped, or STOP_NONE if the
+ *                              program halted
+ */
+Stop Executor_stopped(Executor executor);
+
+/*
+ * Executor_use_reporter
+ *
+ * Sets the function Executor_request_report hands its reports to. The
+ * executor does no reporting of its own, so the client decides what to print
+ * and where.
+ *
+ * @param  Executor executor    The executor to configure
+ * @param  Reporter reporter    The function to call, or NULL to ignore
+ *                              requests
+ * @param  void *cl             Passed to the reporter
+ */
+void Executor_use_reporter(Executor executor, Reporter reporter, void *cl);
+
+/*
+ * Executor_request_report
+ *
+ * Asks a run for a progress report without stopping it. May be called from
+ * any thread, or from a signal handler, since it only sets a flag. From its
+ * next load program instruction the run counts the targets of REPORT_JUMPS
+ * jumps, then calls the reporter and carries on; a run that halts first
+ * reports what it has counted. A program waiting for input reports once it
+ * gets some. A request made between runs is served by the next one.
+ *
+ * @param  Executor executor    The executor to ask
+ */
+void Executor_request_report(Executor executor);
+
+/*
+ * Executor_use_hooks
+ *
+ * Makes Executor_run call the client's hooks. The profiler, the traces and
+ * telemetry hook into the same points. The pre-decoded loop is compiled
+ * once for each of a few sets of hooks, with the calls for the others left
+ * out, and each run uses the leanest copy that covers the points in use, so
+ * that a run without instrumentation carries no hook checks at all. The
+ * pre-decoded engine is used in place of the specialized one while client
+ * hooks are set.
+ *
+ * @param  Executor executor        The executor to configure
+ * @param  ExecutorHooks *hooks     The hooks to copy, or NULL to remove them
+ */
+void Executor_use_hooks(Executor executor, const ExecutorHooks *hooks);
+
+/*
+ * Executor_use_profiler
+ *
+ * Makes Executor_run take a sample whenever the profiler is due for one,
+ * and tell it about program loads and jumps. The pre-decoded engine is then
+ * used in place of the specialized one. The profiler is not freed with the
+ * executor.
+ *
+ * @param  Executor executor    The executor to configure
+ * @param  Profiler profiler    The profiler to feed, or NULL to stop
+ *                              profiling
+ */
+void Executor_use_profiler(Executor executor, Profiler profiler);
+
+/*
+ * Executor_use_mem_trace
+ *
+ * Makes Executor_run log every segment mapped and unmapped, and every
+ * program load, with the instruction count, for replay against other memory
+ * module configurations. The pre-decoded engine is then used in place of the
+ * specialized one. The trace is not freed with the executor.
+ *
+ * @param  Executor executor    The executor to configure
+ * @param  MemTrace trace       The trace to append to, or NULL to stop
+ *                              tracing
+ */
+void Executor_use_mem_trace(Executor executor, MemTrace trace);
+
+/*
+ * Executor_use_instr_trace
+ *
+ * Makes Executor_run trace every instruction it executes, with its pc and
+ * word and the registers before it. The pre-decoded engine is then used in
+ * place of the specialized one. The trace is not freed with the executor.
+ *
+ * @param  Executor executor    The executor to configure
+ * @param  InstrTrace trace     The trace to append to, or NULL to stop
+ *                              tracing
+ */
+void Executor_use_instr_trace(Executor executor, InstrTrace trace);
+
+/*
+ * Executor_segment_cache_stats
+ *
+ * Reports how segmented loads and stores fared in the executor's cache of
+ * recent segment lookups.
+ *
+ * @param  Executor executor    The executor to query
+ * @param  uint64_t *hits       Set to the number of lookups found in the
+ *                              cache
+ * @param  uint64_t *misses     Set to the number of lookups that went to the
+ *                              memory module
+ */
+void Executor_segment_cache_stats(Executor executor, uint64_t *hits,
+                                  uint64_t *misses);
+
+/*
+ * Executor_reused_translations
+ *
+ * @param  Executor executor    The executor to query
+ * @return uint64_t             The number of times a load program instruction
+ *                              installed code whose translation was taken
+ *                              back from the table of recent programs instead
+ *                              of being rebuilt
+ */
+uint64_t Executor_reused_translations(Executor executor);
+
+/*
+ * Executor_use_cache
+ *
+ * Makes the executor consult an on-disk translation cache whenever segment 0
+ * has to be translated, both when the program is first run and after every
+ * load program instruction that installs new code. The cache is not freed
+ * with the executor.
+ *
+ * @param  Executor executor    The executor to configure
+ * @param  TransCache cache     The cache to use, or NULL to disable caching
+ */
+void Executor_use_cache(Executor executor, TransCache cache);
+
+/*
+ * Executor_use_compiler
+ *
+ * Moves translation of segment 0 onto a background compiler thread. Whenever
+ * new code shows up that is not cached, Executor_run interprets it word by
+ * word and switches to the translation as soon as it has been published.
+ * Without a compiler (the default), translation happens synchronously, which
+ * keeps runs fully deterministic. The compiler is not freed with the
+ * executor, and must outlive it.
+ *
+ * @param  Executor executor    The executor to configure
+ * @param  Compiler compiler    The compiler to use, or NULL to translate on
+ *                              the executor's own thread
+ */
+void Executor_use_compiler(Executor executor, Compiler compiler);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,135 @@
+#include "hugepages.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static bool enabled = false;
+
+/*
+ * Bytes in live huge page allocations and advised ranges. The compiler
+ * thread allocates translations too, so it is updated atomically.
+ */
+static size_t requested = 0;
+
+static size_t round_up(size_t bytes)
+{
+    return (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+static bool use_huge(size_t bytes)
+{
+    return enabled && bytes >= HUGE_PAGE_THRESHOLD;
+}
+
+/*
+ * Maps zeroed memory that is only backed once it is touched, without
+ * reserving swap for it, so that even a 16 GiB segment costs nothing up
+ * front.
+ */
+static void *map_lazily(size_t length)
+{
+    void *data = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(data != MAP_FAILED);
+
+    return data;
+}
+
+void HugePages_enable(void) { enabled = true; }
+
+bool HugePages_enabled(void) { return enabled; }
+
+void *HugePages_alloc(size_t bytes)
+{
+    if (bytes < HUGE_PAGE_THRESHOLD) {
+        void *data = calloc(1, bytes);
+        assert(data != NULL || bytes == 0);
+        return data;
+    }
+
+    size_t length = round_up(bytes);
+    if (!enabled)
+        return map_lazily(length);
+    __atomic_fetch_add(&requested, length, __ATOMIC_RELAXED);
+
+    // A reserved pool of huge pages, if the system has one
+    void *data = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data != MAP_FAILED)
+        return data;
+
+    // Otherwise a 2 MiB aligned mapping that transparent huge pages can back
+    char *raw = map_lazily(length + HUGE_PAGE_SIZE);
+
+    char *aligned = (char *)round_up((uintptr_t)raw);
+    if (aligned > raw)
+        munmap(raw, aligned - raw);
+    munmap(aligned + length, raw + HUGE_PAGE_SIZE - aligned);
+    madvise(aligned, length, MADV_HUGEPAGE);
+
+    return aligned;
+}
+
+void HugePages_free(void *data, size_t bytes)
+{
+    if (data == NULL)
+        return;
+
+    if (bytes < HUGE_PAGE_THRESHOLD) {
+        free(data);
+        return;
+    }
+
+    munmap(data, round_up(bytes));
+    if (enabled)
+        __atomic_fetch_sub(&requested, round_up(bytes), __ATOMIC_RELAXED);
+}
+
+void HugePages_advise(void *data, size_t bytes)
+{
+    if (!use_huge(bytes))
+        return;
+
+    // madvise wants a page-aligned start
+    uintptr_t first = round_up((uintptr_t)data);
+    uintptr_t end = ((uintptr_t)data + bytes) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    if (first >= end)
+        return;
+
+    if (madvise((void *)first, end - first, MADV_HUGEPAGE) == 0)
+        __atomic_fetch_add(&requested, end - first, __ATOMIC_RELAXED);
+}
+
+size_t HugePages_requested(void)
+{
+    return __atomic_load_n(&requested, __ATOMIC_RELAXED);
+}
+
+long HugePages_backed(void)
+{
+    FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+    if (fp == NULL)
+        return -1;
+
+    // Transparent huge pages, then pages from the hugetlb pool
+    static const char *fields[] = {"AnonHugePages:", "Private_Hugetlb:",
+                                   "Shared_Hugetlb:"};
+    long total = 0;
+    bool found = false;
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+            size_t n = strlen(fields[i]);
+            if (strncmp(line, fields[i], n) == 0) {
+                total += strtol(line + n, NULL, 10);
+                found = true;
+            }
+        }
+    }
+    fclose(fp);
+
+    return found ? total : -1;
+}
@@ -0,0 +1,93 @@
+#ifndef HUGEPAGES_INCLUDED
+#define HUGEPAGES_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Backing for large allocations with 2 MiB pages, to cut the dTLB misses of
+ * walking a big segment 0, its translation, or a big data segment. Where the
+ * system has a pool of huge pages they come from MAP_HUGETLB; otherwise the
+ * mapping is 2 MiB aligned and advised with MADV_HUGEPAGE, so that
+ * transparent huge pages can back it.
+ *
+ * Allocations below HUGE_PAGE_THRESHOLD are plain calloc and free. Larger
+ * ones are always mappings of their own whose pages are only backed once
+ * touched, so that a huge segment costs nothing until it is used; huge pages
+ * just change how those mappings are backed.
+ */
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define HUGE_PAGE_THRESHOLD (HUGE_PAGE_SIZE / 4)
+
+/*
+ * HugePages_enable
+ *
+ * Makes later allocations of at least HUGE_PAGE_THRESHOLD bytes use huge
+ * pages.
+ *
+ * @expect Nothing is allocated with HugePages_alloc before this is called
+ */
+void HugePages_enable(void);
+
+/*
+ * HugePages_enabled
+ *
+ * @return bool                 Whether HugePages_enable has been called
+ */
+bool HugePages_enabled(void);
+
+/*
+ * HugePages_alloc
+ *
+ * Allocates zeroed memory. Allocations of at least HUGE_PAGE_THRESHOLD
+ * bytes are backed lazily, and on huge pages if they are enabled.
+ *
+ * @param  size_t bytes         The number of bytes to allocate
+ * @return void *               The new memory
+ * @expect The memory can be allocated
+ */
+void *HugePages_alloc(size_t bytes);
+
+/*
+ * HugePages_free
+ *
+ * Frees memory allocated with HugePages_alloc.
+ *
+ * @param  void *data           The memory to free, or NULL
+ * @param  size_t bytes         The size it was allocated with
+ */
+void HugePages_free(void *data, size_t bytes);
+
+/*
+ * HugePages_advise
+ *
+ * Asks for part of an existing mapping to be backed by transparent huge
+ * pages, if huge pages are enabled and the range is large enough. Only the
+ * whole 2 MiB pages inside the range can be.
+ *
+ * @param  void *data           The start of the range
+ * @param  size_t bytes         The length of the range
+ */
+void HugePages_advise(void *data, size_t bytes);
+
+/*
+ * HugePages_requested
+ *
+ * @return size_t               The number of bytes currently allocated on
+ *                              huge pages, plus the bytes of every range
+ *                              advised so far
+ */
+size_t HugePages_requested(void);
+
+/*
+ * HugePages_backed
+ *
+ * Reads from /proc how much of the process's memory is actually on huge
+ * pages, transparent or not.
+ *
+ * @return long                 The number of kB on huge pages, or -1 if it
+ *                              could not be read
+ */
+long HugePages_backed(void);
+
+#endif
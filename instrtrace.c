@@ -0,0 +1,497 @@
+#include "instrtrace.h"
+#include <assert.h>
+#include <mem.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TRACE_MAGIC 0x54494d55u /* "UMIT" */
+#define INDEX_MAGIC 0x58494d55u /* "UMIX" */
+#define TRACE_VERSION 1u
+#define BUFFER_BYTES 65536
+#define MAX_RECORD 32 /* a tag, a pc, a word and a register */
+#define WORDS_MIN_CAPACITY 1024
+#define HALT_WORD 0x70000000u
+
+/* Bits of a record's tag */
+#define TAG_JUMP 0x01     /* a varint pc follows; otherwise pc is last + 1 */
+#define TAG_WORD 0x02     /* the word follows; otherwise it is as last seen */
+#define TAG_REGISTER 0x04 /* a register number and a varint follow */
+#define TAG_SYNC 0x80     /* the full state follows instead */
+
+typedef struct Header {
+    uint32_t magic;
+    uint32_t version;
+} Header;
+
+/*
+ * The end of the file: after the last record come count index entries, each
+ * the step and file offset of a sync record, then this.
+ */
+typedef struct Footer {
+    uint64_t count;
+    uint64_t steps; /* in the whole trace */
+    uint32_t magic;
+    uint32_t pad;
+} Footer;
+
+typedef struct IndexEntry {
+    uint64_t steps;
+    uint64_t offset;
+} IndexEntry;
+
+/*
+ * The state that records are relative to, shared by the writer and reader.
+ * The last word seen at each pc is kept with the epoch in which it was seen;
+ * each sync starts a new epoch, so that after a seek no word is taken as
+ * known that the reader never saw.
+ */
+typedef struct State {
+    uint64_t steps;
+    uint32_t pc; /* of the last record */
+    bool synced; /* no record since the last sync */
+    uint32_t registers[8];
+    uint32_t epoch;
+    uint32_t *words;
+    uint32_t *epochs;
+    uint32_t capacity;
+} State;
+
+struct InstrTrace {
+    FILE *fp;
+    uint64_t offset; /* of the start of buf */
+    uint8_t buf[BUFFER_BYTES];
+    size_t length;
+    State state;
+    uint32_t word; /* of the last record */
+    IndexEntry *index;
+    uint64_t index_count;
+    uint64_t index_capacity;
+};
+
+struct InstrTraceReader {
+    FILE *fp;
+    State state;
+    IndexEntry *index;
+    uint64_t index_count;
+    uint64_t length;
+};
+
+static int destination(uint32_t word);
+static void state_reset(State *state);
+static void state_free(State *state);
+static bool word_known(State *state, uint32_t pc, uint32_t word);
+static void word_learn(State *state, uint32_t pc, uint32_t word);
+static void flush(InstrTrace trace);
+static void write_sync(InstrTrace trace, const uint32_t *registers);
+static uint8_t *put_varint(uint8_t *p, uint64_t value);
+static bool get_varint(FILE *fp, uint64_t *value);
+static bool read_sync(InstrTraceReader reader);
+
+InstrTrace new_instr_trace(const char *path)
+{
+    assert(path != NULL);
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+        return NULL;
+
+    Header header = {TRACE_MAGIC, TRACE_VERSION};
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+        fclose(fp);
+        return NULL;
+    }
+
+    InstrTrace trace;
+    NEW(trace);
+    trace->fp = fp;
+    trace->offset = sizeof(header);
+    trace->length = 0;
+    state_reset(&trace->state);
+    trace->word = HALT_WORD;
+    trace->index = NULL;
+    trace->index_count = 0;
+    trace->index_capacity = 0;
+
+    return trace;
+}
+
+bool free_instr_trace(InstrTrace *trace)
+{
+    assert(trace != NULL && *trace != NULL);
+    InstrTrace t = *trace;
+
+    flush(t);
+    Footer footer = {t->index_count, t->state.steps, INDEX_MAGIC, 0};
+    fwrite(t->index, sizeof(IndexEntry), t->index_count, t->fp);
+    fwrite(&footer, sizeof(footer), 1, t->fp);
+
+    bool ok = !ferror(t->fp);
+    ok = fclose(t->fp) == 0 && ok;
+    state_free(&t->state);
+    FREE(t->index);
+    FREE(*trace);
+
+    return ok;
+}
+
+void InstrTrace_record(InstrTrace trace, uint32_t pc, uint32_t word,
+                       const uint32_t *registers)
+{
+    assert(trace != NULL && registers != NULL);
+    State *state = &trace->state;
+
+    if (state->steps % INSTR_TRACE_SYNC == 0)
+        write_sync(trace, registers);
+    if (trace->length > BUFFER_BYTES - MAX_RECORD)
+        flush(trace);
+
+    uint8_t *tag = &trace->buf[trace->length];
+    uint8_t *p = tag + 1;
+    *tag = 0;
+
+    if (state->synced || pc != state->pc + 1) {
+        *tag |= TAG_JUMP;
+        p = put_varint(p, pc);
+    }
+    if (!word_known(state, pc, word)) {
+        *tag |= TAG_WORD;
+        memcpy(p, &word, sizeof(word));
+        p += sizeof(word);
+        word_learn(state, pc, word);
+    }
+
+    // Only the register the last instruction writes can have changed.
+    // Comparing just that one is cheaper than scanning all 8, which would
+    // stall on the store the instruction has only just made
+    int r = destination(trace->word);
+    if (r >= 0 && registers[r] != state->registers[r]) {
+        *tag |= TAG_REGISTER;
+        *p++ = (uint8_t)r;
+        p = put_varint(p, registers[r] ^ state->registers[r]);
+        state->registers[r] = registers[r];
+    }
+
+    trace->length = p - trace->buf;
+    trace->word = word;
+    state->pc = pc;
+    state->synced = false;
+    state->steps++;
+}
+
+InstrTraceReader open_instr_trace(const char *path)
+{
+    assert(path != NULL);
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+
+    Header header;
+    Footer footer;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        header.magic != TRACE_MAGIC || header.version != TRACE_VERSION ||
+        fseeko(fp, -(off_t)sizeof(footer), SEEK_END) != 0 ||
+        fread(&footer, sizeof(footer), 1, fp) != 1 ||
+        footer.magic != INDEX_MAGIC) {
+        fclose(fp);
+        return NULL;
+    }
+
+    off_t index_size = (off_t)(footer.count * sizeof(IndexEntry));
+    IndexEntry *index = footer.count > 0 ? ALLOC(index_size) : NULL;
+    if (fseeko(fp, -(off_t)sizeof(footer) - index_size, SEEK_END) != 0 ||
+        fread(index, sizeof(IndexEntry), footer.count, fp) != footer.count) {
+        FREE(index);
+        fclose(fp);
+        return NULL;
+    }
+
+    InstrTraceReader reader;
+    NEW(reader);
+    reader->fp = fp;
+    state_reset(&reader->state);
+    reader->index = index;
+    reader->index_count = footer.count;
+    reader->length = footer.steps;
+
+    if (!InstrTraceReader_seek(reader, 0)) {
+        close_instr_trace(&reader);
+        return NULL;
+    }
+
+    return reader;
+}
+
+void close_instr_trace(InstrTraceReader *reader)
+{
+    assert(reader != NULL && *reader != NULL);
+
+    fclose((*reader)->fp);
+    state_free(&(*reader)->state);
+    FREE((*reader)->index);
+    FREE(*reader);
+}
+
+uint64_t InstrTraceReader_length(InstrTraceReader reader)
+{
+    assert(reader != NULL);
+    return reader->length;
+}
+
+bool InstrTraceReader_seek(InstrTraceReader reader, uint64_t steps)
+{
+    assert(reader != NULL);
+
+    if (steps > reader->length)
+        return false;
+    if (reader->index_count == 0)
+        return steps == 0;
+
+    // The last sync at or before the step; syncs are every INSTR_TRACE_SYNC
+    // steps, so it can be found directly
+    uint64_t i = steps / INSTR_TRACE_SYNC;
+    if (i >= reader->index_count)
+        i = reader->index_count - 1;
+
+    if (fseeko(reader->fp, (off_t)reader->index[i].offset, SEEK_SET) != 0 ||
+        getc(reader->fp) != TAG_SYNC || !read_sync(reader))
+        return false;
+
+    InstrStep step;
+    while (reader->state.steps < steps)
+        if (!InstrTraceReader_next(reader, &step))
+            return false;
+
+    return true;
+}
+
+bool InstrTraceReader_next(InstrTraceReader reader, InstrStep *step)
+{
+    assert(reader != NULL && step != NULL);
+    State *state = &reader->state;
+
+    if (state->steps >= reader->length)
+        return false;
+
+    int tag = getc(reader->fp);
+    if (tag == TAG_SYNC) {
+        if (!read_sync(reader))
+            return false;
+        tag = getc(reader->fp);
+    }
+    if (tag == EOF || (tag & TAG_SYNC))
+        return false;
+
+    uint64_t value;
+    uint32_t pc = state->pc + 1;
+    if (tag & TAG_JUMP) {
+        if (!get_varint(reader->fp, &value))
+            return false;
+        pc = (uint32_t)value;
+    } else if (state->synced) {
+        return false;
+    }
+
+    uint32_t word;
+    if (tag & TAG_WORD) {
+        if (fread(&word, sizeof(word), 1, reader->fp) != 1)
+            return false;
+        word_learn(state, pc, word);
+    } else if (pc >= state->capacity || state->epochs[pc] != state->epoch) {
+        return false;
+    } else {
+        word = state->words[pc];
+    }
+
+    if (tag & TAG_REGISTER) {
+        int r = getc(reader->fp);
+        if (r == EOF || r >= 8 || !get_varint(reader->fp, &value))
+            return false;
+        state->registers[r] ^= (uint32_t)value;
+    }
+
+    step->steps = state->steps;
+    step->pc = pc;
+    step->word = word;
+    memcpy(step->registers, state->registers, sizeof(step->registers));
+
+    state->pc = pc;
+    state->synced = false;
+    state->steps++;
+
+    return true;
+}
+
+/*
+ * Returns the register an instruction writes, or -1 if it writes none.
+ */
+static int destination(uint32_t word)
+{
+    switch (word >> 28) {
+    case 0:
+    case 1:
+    case 3:
+    case 4:
+    case 5:
+    case 6:
+        return (word >> 6) & 7;
+    case 8:
+        return (word >> 3) & 7;
+    case 11:
+        return word & 7;
+    case 13:
+        return (word >> 25) & 7;
+    default:
+        return -1;
+    }
+}
+
+static void state_reset(State *state)
+{
+    state->steps = 0;
+    state->pc = 0;
+    state->synced = true;
+    memset(state->registers, 0, sizeof(state->registers));
+    state->epoch = 0;
+    state->words = NULL;
+    state->epochs = NULL;
+    state->capacity = 0;
+}
+
+static void state_free(State *state)
+{
+    FREE(state->words);
+    FREE(state->epochs);
+}
+
+static bool word_known(State *state, uint32_t pc, uint32_t word)
+{
+    return pc < state->capacity && state->epochs[pc] == state->epoch &&
+           state->words[pc] == word;
+}
+
+static void word_learn(State *state, uint32_t pc, uint32_t word)
+{
+    if (pc >= state->capacity) {
+        uint32_t capacity =
+            state->capacity > 0 ? state->capacity : WORDS_MIN_CAPACITY;
+        while (capacity <= pc && capacity < UINT32_MAX / 2 + 1)
+            capacity *= 2;
+        if (capacity <= pc)
+            capacity = UINT32_MAX;
+
+        // Mem_resize takes no NULL, so the first growth allocates
+        long bytes = (long)capacity * sizeof(uint32_t);
+        if (state->capacity == 0) {
+            state->words = ALLOC(bytes);
+            state->epochs = ALLOC(bytes);
+        } else {
+            RESIZE(state->words, bytes);
+            RESIZE(state->epochs, bytes);
+        }
+        // An epoch that is never current marks the new words unknown
+        memset(state->epochs + state->capacity, 0xFF,
+               (size_t)(capacity - state->capacity) * sizeof(uint32_t));
+        state->capacity = capacity;
+    }
+
+    state->words[pc] = word;
+    state->epochs[pc] = state->epoch;
+}
+
+static void flush(InstrTrace trace)
+{
+    fwrite(trace->buf, 1, trace->length, trace->fp);
+    trace->offset += trace->length;
+    trace->length = 0;
+}
+
+/*
+ * Writes the full state, as a sync record, and indexes it.
+ */
+static void write_sync(InstrTrace trace, const uint32_t *registers)
+{
+    State *state = &trace->state;
+
+    if (trace->length > BUFFER_BYTES - (1 + 9 + 8 * 5))
+        flush(trace);
+
+    if (trace->index_count == trace->index_capacity) {
+        // Mem_resize takes no NULL, so the first growth allocates
+        if (trace->index_capacity == 0) {
+            trace->index_capacity = 64;
+            trace->index = ALLOC(64 * sizeof(IndexEntry));
+        } else {
+            trace->index_capacity *= 2;
+            RESIZE(trace->index,
+                   (long)(trace->index_capacity * sizeof(IndexEntry)));
+        }
+    }
+    trace->index[trace->index_count++] =
+        (IndexEntry){state->steps, trace->offset + trace->length};
+
+    uint8_t *p = &trace->buf[trace->length];
+    *p++ = TAG_SYNC;
+    p = put_varint(p, state->steps);
+    for (int r = 0; r < 8; r++)
+        p = put_varint(p, registers[r]);
+    trace->length = p - trace->buf;
+
+    memcpy(state->registers, registers, sizeof(state->registers));
+    state->synced = true;
+    state->epoch++;
+}
+
+/*
+ * Reads the body of a sync record, after its tag, into the reader's state.
+ */
+static bool read_sync(InstrTraceReader reader)
+{
+    State *state = &reader->state;
+    uint64_t value;
+
+    if (!get_varint(reader->fp, &value))
+        return false;
+    state->steps = value;
+    for (int r = 0; r < 8; r++) {
+        if (!get_varint(reader->fp, &value))
+            return false;
+        state->registers[r] = (uint32_t)value;
+    }
+    state->synced = true;
+    // Syncs are numbered from 1 in the writer, so the epoch follows from the
+    // step alone and never matches a word learnt before the seek
+    state->epoch = (uint32_t)(state->steps / INSTR_TRACE_SYNC) + 1;
+
+    return true;
+}
+
+/*
+ * Writes an unsigned LEB128 varint: seven bits a byte, low bits first, with
+ * the top bit set on every byte but the last.
+ */
+static uint8_t *put_varint(uint8_t *p, uint64_t value)
+{
+    while (value >= 0x80) {
+        *p++ = (uint8_t)(value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+
+    return p;
+}
+
+static bool get_varint(FILE *fp, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = getc(fp);
+        if (byte == EOF)
+            return false;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,117 @@
+#ifndef INSTRTRACE_INCLUDED
+#define INSTRTRACE_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A full trace of the instructions a run executed, in a compact binary file.
+ * For each instruction the trace holds its pc and word and the registers
+ * before it executed, all as differences from the instruction before: a tag
+ * byte says whether the pc broke the sequence, whether the word at that pc
+ * is new and whether a register changed, and only what changed follows.
+ * Every INSTR_TRACE_SYNC instructions a sync record holds the full state, so
+ * that a reader can seek; their offsets are indexed at the end of the file.
+ */
+#define INSTR_TRACE_SYNC 65536
+
+typedef struct InstrTrace *InstrTrace;
+typedef struct InstrTraceReader *InstrTraceReader;
+
+/*
+ * One traced instruction, with the registers as they were before it
+ * executed.
+ */
+typedef struct InstrStep {
+    uint64_t steps; /* instructions executed before it */
+    uint32_t pc;
+    uint32_t word;
+    uint32_t registers[8];
+} InstrStep;
+
+/*
+ * new_instr_trace
+ *
+ * Creates a trace file, replacing any file at the path.
+ *
+ * @param  char *path           The file to write to
+ * @return InstrTrace           The trace, or NULL if the file could not be
+ *                              created
+ */
+InstrTrace new_instr_trace(const char *path);
+
+/*
+ * free_instr_trace
+ *
+ * Writes out the rest of the trace and its index, and closes it.
+ *
+ * @param  InstrTrace *trace    A pointer to the trace to free
+ * @return bool                 Whether the whole trace was written
+ * @expect The trace is not NULL
+ */
+bool free_instr_trace(InstrTrace *trace);
+
+/*
+ * InstrTrace_record
+ *
+ * Appends an instruction that is about to be executed. Between syncs only
+ * the register written by the previous instruction is checked for a change,
+ * so nothing else may change the registers while tracing.
+ *
+ * @param  InstrTrace trace         The trace to append to
+ * @param  uint32_t pc              The index of the instruction in segment 0
+ * @param  uint32_t word            The instruction
+ * @param  uint32_t *registers      The 8 registers
+ */
+void InstrTrace_record(InstrTrace trace, uint32_t pc, uint32_t word,
+                       const uint32_t *registers);
+
+/*
+ * open_instr_trace
+ *
+ * @param  char *path               The trace file to read
+ * @return InstrTraceReader         A reader positioned at the first
+ *                                  instruction, or NULL if the file could not
+ *                                  be opened or is not a complete trace
+ */
+InstrTraceReader open_instr_trace(const char *path);
+
+/*
+ * close_instr_trace
+ *
+ * @param  InstrTraceReader *reader A pointer to the reader to close
+ * @expect The reader is not NULL
+ */
+void close_instr_trace(InstrTraceReader *reader);
+
+/*
+ * InstrTraceReader_length
+ *
+ * @param  InstrTraceReader reader  The reader to query
+ * @return uint64_t                 The number of instructions in the trace
+ */
+uint64_t InstrTraceReader_length(InstrTraceReader reader);
+
+/*
+ * InstrTraceReader_seek
+ *
+ * Positions the reader at an instruction, by decoding forward from the
+ * last sync record before it.
+ *
+ * @param  InstrTraceReader reader  The reader to position
+ * @param  uint64_t steps           The number of instructions to skip from
+ *                                  the start of the trace
+ * @return bool                     Whether the trace is that long
+ */
+bool InstrTraceReader_seek(InstrTraceReader reader, uint64_t steps);
+
+/*
+ * InstrTraceReader_next
+ *
+ * @param  InstrTraceReader reader  The reader to read from
+ * @param  InstrStep *step          Set to the next instruction
+ * @return bool                     Whether there was one
+ */
+bool InstrTraceReader_next(InstrTraceReader reader, InstrStep *step);
+
+#endif
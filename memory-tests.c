@@ -1,6 +1,11 @@
+#include "checkpoint.h"
 #include "memory.h"
+#include "spill.h"
 #include "utest.h"
 #include <except.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 struct Fixture {
     Memory mem;
@@ -15,7 +20,7 @@ UTEST_F(Fixture, ConstructorAndTeardown) { EXPECT_TRUE(1); }
 UTEST_F(Fixture, NewSegment)
 {
     Memory mem = utest_fixture->mem;
-    int id = new_segment(mem, 10);
+    uint32_t id = new_segment(mem, 10);
 }
 
 UTEST_F(Fixture, MultipleNewSegments)
@@ -28,14 +33,14 @@ UTEST_F(Fixture, MultipleNewSegments)
 UTEST_F(Fixture, RemoveSegment)
 {
     Memory mem = utest_fixture->mem;
-    int id = new_segment(mem, 10);
+    uint32_t id = new_segment(mem, 10);
     remove_segment(mem, id);
 }
 
 UTEST_F(Fixture, RemoveMultipleSegments)
 {
     Memory mem = utest_fixture->mem;
-    int ids[64];
+    uint32_t ids[64];
     for (int i = 0; i < 64; i++)
         ids[i] = new_segment(mem, 32);
 
@@ -46,7 +51,7 @@ UTEST_F(Fixture, RemoveMultipleSegments)
 UTEST_F(Fixture, ReassignIds)
 {
     Memory mem = utest_fixture->mem;
-    int ids[64];
+    uint32_t ids[64];
     // Create 64 segments
     for (int i = 0; i < 64; i++)
         ids[i] = new_segment(mem, 32);
@@ -58,13 +63,13 @@ UTEST_F(Fixture, ReassignIds)
         ids[i] = new_segment(mem, 32);
     // Ensure all IDs were reassigned
     for (int i = 0; i < 64; i++)
-        EXPECT_LE(ids[i], 64);
+        EXPECT_LE(ids[i], 64u);
 }
 
 UTEST_F(Fixture, UniqueIds)
 {
     Memory mem = utest_fixture->mem;
-    int ids[64];
+    uint32_t ids[64];
     // Create 64 segments
     for (int i = 0; i < 64; i++)
         ids[i] = new_segment(mem, 32);
@@ -74,10 +79,45 @@ UTEST_F(Fixture, UniqueIds)
             EXPECT_NE(ids[i], ids[j]);
 }
 
+UTEST_F(Fixture, ReuseLowestIdFirst)
+{
+    Memory mem = utest_fixture->mem;
+    uint32_t ids[8];
+    for (int i = 0; i < 8; i++)
+        ids[i] = new_segment(mem, 4);
+
+    remove_segment(mem, ids[5]);
+    remove_segment(mem, ids[2]);
+    remove_segment(mem, ids[6]);
+    EXPECT_EQ(new_segment(mem, 4), ids[2]);
+    EXPECT_EQ(new_segment(mem, 4), ids[5]);
+    EXPECT_EQ(new_segment(mem, 4), ids[6]);
+}
+
+UTEST_F(Fixture, TableShrinksOnceTopIsFree)
+{
+    Memory mem = utest_fixture->mem;
+    static uint32_t ids[100000];
+    for (int i = 0; i < 100000; i++)
+        ids[i] = new_segment(mem, 1);
+    EXPECT_EQ(memory_stats(mem).table_slots, 100001u);
+
+    // A live segment holds up the table below it
+    for (int i = 0; i < 100000; i++)
+        if (i != 10)
+            remove_segment(mem, ids[i]);
+    EXPECT_EQ(memory_stats(mem).table_slots, 12u);
+    EXPECT_EQ(get_segment(mem, ids[10])->size, 1u);
+
+    EXPECT_EQ(new_segment(mem, 1), ids[0]);
+    remove_segment(mem, ids[10]);
+    EXPECT_EQ(memory_stats(mem).table_slots, 2u);
+}
+
 UTEST_F(Fixture, GetSegment)
 {
     Memory mem = utest_fixture->mem;
-    int id = new_segment(mem, 10);
+    uint32_t id = new_segment(mem, 10);
     Segment *seg = get_segment(mem, id);
     EXPECT_EQ(seg->size, 10);
     for (int i = 0; i < 10; i++)
@@ -87,7 +127,7 @@ UTEST_F(Fixture, GetSegment)
 UTEST_F(Fixture, PersistentSegments)
 {
     Memory mem = utest_fixture->mem;
-    int id = new_segment(mem, 10);
+    uint32_t id = new_segment(mem, 10);
     Segment *seg = get_segment(mem, id);
     seg->data[0] = 1;
     seg->data[1] = 2;
@@ -95,3 +135,279 @@ UTEST_F(Fixture, PersistentSegments)
     EXPECT_EQ(seg->data[0], 1u);
     EXPECT_EQ(seg->data[1], 2u);
 }
+
+UTEST_F(Fixture, ArenaSegments)
+{
+    Memory mem = utest_fixture->mem;
+    ASSERT_TRUE(use_segment_arena(mem));
+
+    uint32_t id = new_segment(mem, 10);
+    Segment *seg = get_segment(mem, id);
+    EXPECT_EQ(seg->size, 10);
+    EXPECT_EQ(segment_data(mem, id), seg->data);
+    for (int i = 0; i < 10; i++)
+        EXPECT_EQ(seg->data[i], 0u);
+}
+
+UTEST_F(Fixture, ArenaReusedSegmentsAreZeroed)
+{
+    Memory mem = utest_fixture->mem;
+    ASSERT_TRUE(use_segment_arena(mem));
+
+    uint32_t id = new_segment(mem, 10);
+    for (int i = 0; i < 10; i++)
+        segment_data(mem, id)[i] = i + 1;
+    remove_segment(mem, id);
+
+    // The freed block is the only one of its size, so it is reused
+    EXPECT_EQ(new_segment(mem, 12), id);
+    EXPECT_EQ(get_segment(mem, id)->size, 12);
+    for (int i = 0; i < 12; i++)
+        EXPECT_EQ(segment_data(mem, id)[i], 0u);
+}
+
+UTEST_F(Fixture, ArenaFallsBackToTable)
+{
+    Memory mem = utest_fixture->mem;
+    ASSERT_TRUE(use_segment_arena(mem));
+
+    // Fill the arena exactly, one block of each power of two words
+    uint32_t arena_ids[28];
+    for (int i = 0; i < 3; i++)
+        arena_ids[i] = new_segment(mem, (1 << 28) - 4);
+    for (int k = 27; k >= 3; k--)
+        arena_ids[30 - k] = new_segment(mem, (1 << k) - 4);
+
+    uint32_t id = new_segment(mem, 10);
+    for (int i = 0; i < 28; i++)
+        EXPECT_NE(arena_ids[i], id);
+    EXPECT_EQ(get_segment(mem, id)->size, 10);
+    for (int i = 0; i < 10; i++)
+        EXPECT_EQ(segment_data(mem, id)[i], 0u);
+
+    // Its ID goes back to the table, not to the arena
+    remove_segment(mem, id);
+    EXPECT_EQ(new_segment(mem, 10), id);
+}
+
+UTEST_F(Fixture, MemoryStats)
+{
+    Memory mem = utest_fixture->mem;
+    uint32_t a = new_segment(mem, 10);
+    uint32_t b = new_segment(mem, 20);
+    remove_segment(mem, a);
+    new_segment(mem, 5);
+
+    MemoryStats stats = memory_stats(mem);
+    EXPECT_EQ(stats.live_segments, 3u);
+    EXPECT_EQ(stats.live_words, 25u);
+    EXPECT_EQ(stats.peak_words, 30u);
+    EXPECT_EQ(stats.maps, 3u);
+    EXPECT_EQ(stats.unmaps, 1u);
+
+    load_program_segment(mem, b);
+    EXPECT_EQ(memory_stats(mem).live_words, 45u);
+    EXPECT_EQ(memory_stats(mem).peak_words, 45u);
+}
+
+UTEST_F(Fixture, MemoryQuota)
+{
+    Memory mem = utest_fixture->mem;
+    set_memory_quota(mem, 30);
+
+    uint32_t id = new_segment(mem, 20);
+    EXPECT_NE(id, 0u);
+    EXPECT_EQ(new_segment(mem, 11), 0u);
+    EXPECT_TRUE(memory_quota_exceeded(mem));
+    EXPECT_EQ(memory_stats(mem).maps, 1u);
+
+    // Unmapping makes room again
+    remove_segment(mem, id);
+    EXPECT_NE(new_segment(mem, 30), 0u);
+}
+
+UTEST_F(Fixture, SpillSegments)
+{
+    Memory mem = utest_fixture->mem;
+    ASSERT_TRUE(use_spill_file(mem, "/tmp", SPILL_THRESHOLD));
+
+    // Only one of these fits in the budget at a time
+    uint32_t ids[3];
+    for (int i = 0; i < 3; i++) {
+        ids[i] = new_segment(mem, SPILL_THRESHOLD);
+        segment_data(mem, ids[i])[SPILL_THRESHOLD - 1] = i + 1;
+    }
+    for (int i = 0; i < 3; i++)
+        EXPECT_EQ(segment_data(mem, ids[i])[SPILL_THRESHOLD - 1], i + 1u);
+    EXPECT_GE(memory_pageouts(mem), 2u);
+
+    // Small segments stay in memory
+    uint32_t small = new_segment(mem, 10);
+    EXPECT_EQ(segment_data(mem, small)[0], 0u);
+
+    remove_segment(mem, ids[1]);
+    uint32_t id = new_segment(mem, SPILL_THRESHOLD);
+    EXPECT_EQ(segment_data(mem, id)[SPILL_THRESHOLD - 1], 0u);
+}
+
+UTEST_F(Fixture, HugeSegment)
+{
+    Memory mem = utest_fixture->mem;
+
+    // 16 GiB of address space, of which only two pages are ever touched
+    uint32_t id = new_segment(mem, UINT32_MAX);
+    Segment *seg = get_segment(mem, id);
+    EXPECT_EQ(seg->size, UINT32_MAX);
+    EXPECT_EQ(seg->data[UINT32_MAX - 1], 0u);
+    seg->data[UINT32_MAX - 1] = 1;
+    seg->data[0] = 2;
+    EXPECT_EQ(segment_data(mem, id)[UINT32_MAX - 1], 1u);
+
+    remove_segment(mem, id);
+}
+
+UTEST_F(Fixture, TableGrowthKeepsSegmentsInPlace)
+{
+    Memory mem = utest_fixture->mem;
+    uint32_t first = new_segment(mem, 1);
+    Segment *seg = get_segment(mem, first);
+
+    // Enough segments to need several chunks of the table
+    for (int i = 0; i < 20000; i++)
+        EXPECT_EQ(get_segment(mem, new_segment(mem, 1))->size, 1u);
+
+    EXPECT_EQ(get_segment(mem, first), seg);
+}
+
+UTEST_F(Fixture, WalkAndRebuildArena)
+{
+    Memory mem = utest_fixture->mem;
+    ASSERT_TRUE(use_segment_arena(mem));
+    uint32_t a = new_segment(mem, 10);
+    uint32_t b = new_segment(mem, 100);
+    uint32_t c = new_segment(mem, 10);
+    remove_segment(mem, b);
+
+    EXPECT_EQ(next_segment(mem, 0), a);
+    EXPECT_EQ(next_segment(mem, a), c);
+    EXPECT_EQ(next_segment(mem, c), 0u);
+
+    // The same indices, with the space between them free again
+    Memory copy = new_memory_module(NULL, 0);
+    ASSERT_TRUE(use_segment_arena(copy));
+    EXPECT_TRUE(map_segment_at(copy, a, 10));
+    EXPECT_TRUE(map_segment_at(copy, c, 10));
+    EXPECT_FALSE(map_segment_at(copy, a, 10));
+    EXPECT_EQ(next_segment(copy, a), c);
+    EXPECT_EQ(memory_stats(copy).live_segments, 3u);
+    EXPECT_EQ(new_segment(copy, 100), b);
+    free_memory_module(&copy);
+}
+
+UTEST_F(Fixture, CheckpointDeltas)
+{
+    Memory mem = utest_fixture->mem;
+    char path[] = "/tmp/um-checkpoint-XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    uint32_t small = new_segment(mem, 10);
+    uint32_t large = new_segment(mem, 4 * CHECKPOINT_PAGE_WORDS + 5);
+    segment_data(mem, small)[3] = 7;
+    for (uint32_t i = 0; i < 4 * CHECKPOINT_PAGE_WORDS + 5; i++)
+        segment_data(mem, large)[i] = i;
+    CheckpointState state = {{1, 2, 3, 4, 5, 6, 7, 8}, 42, 1000, -1, false};
+    Checkpoint checkpoint = new_checkpoint(path);
+    ASSERT_TRUE(Checkpoint_save(checkpoint, mem, &state));
+    struct stat base;
+    stat(path, &base);
+
+    // One page of the large segment changes, and the small one is replaced
+    segment_data(mem, large)[2 * CHECKPOINT_PAGE_WORDS + 1] = 99;
+    remove_segment(mem, small);
+    uint32_t other = new_segment(mem, 3);
+    segment_data(mem, other)[2] = 5;
+    state.pc = 43;
+    ASSERT_TRUE(Checkpoint_save(checkpoint, mem, &state));
+    struct stat delta;
+    stat(path, &delta);
+    EXPECT_LT(delta.st_size - base.st_size, 2 * CHECKPOINT_PAGE_WORDS * 4);
+    free_checkpoint(&checkpoint);
+
+    CheckpointState loaded;
+    Snapshot snapshot = load_checkpoint(path, &loaded);
+    ASSERT_TRUE(snapshot != NULL);
+    EXPECT_EQ(loaded.pc, 43u);
+    EXPECT_EQ(loaded.registers[7], 8u);
+    EXPECT_EQ(loaded.steps, 1000u);
+    uint32_t size;
+    Memory copy = new_memory_module(Snapshot_program(snapshot, &size), 0);
+    EXPECT_EQ(size, 0u);
+    EXPECT_TRUE(Snapshot_restore(snapshot, copy));
+    free_snapshot(&snapshot);
+
+    EXPECT_EQ(get_segment(copy, other)->size, 3u);
+    EXPECT_EQ(segment_data(copy, other)[2], 5u);
+    EXPECT_EQ(get_segment(copy, large)->size, 4 * CHECKPOINT_PAGE_WORDS + 5);
+    EXPECT_EQ(segment_data(copy, large)[2 * CHECKPOINT_PAGE_WORDS + 1], 99u);
+    EXPECT_EQ(segment_data(copy, large)[4 * CHECKPOINT_PAGE_WORDS + 4],
+              4 * CHECKPOINT_PAGE_WORDS + 4);
+    EXPECT_EQ(next_segment(copy, large), 0u);
+    free_memory_module(&copy);
+    remove(path);
+}
+
+UTEST_F(Fixture, CheckpointComparesUnchangedPages)
+{
+    Memory mem = utest_fixture->mem;
+    char path[] = "/tmp/um-checkpoint-XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+
+    uint32_t id = new_segment(mem, 2 * CHECKPOINT_PAGE_WORDS);
+    uint32_t marker = 0xC0FFEE;
+    segment_data(mem, id)[CHECKPOINT_PAGE_WORDS + 5] = marker;
+    CheckpointState state = {{0}, 0, 0, -1, false};
+    Checkpoint checkpoint = new_checkpoint(path);
+    ASSERT_TRUE(Checkpoint_save(checkpoint, mem, &state));
+
+    // A copy in the file that no longer matches memory, as a hash collision
+    // would leave it, is written again although the page's hash is the same
+    FILE *fp = fopen(path, "r+b");
+    ASSERT_TRUE(fp != NULL);
+    uint32_t word;
+    long offset = -1;
+    while (offset < 0 && fread(&word, sizeof(word), 1, fp) == 1)
+        if (word == marker)
+            offset = ftell(fp) - (long)sizeof(word);
+    ASSERT_GE(offset, 0);
+    word = 0;
+    fseek(fp, offset, SEEK_SET);
+    fwrite(&word, sizeof(word), 1, fp);
+    fclose(fp);
+
+    struct stat base, delta, unchanged;
+    stat(path, &base);
+    ASSERT_TRUE(Checkpoint_save(checkpoint, mem, &state));
+    stat(path, &delta);
+    EXPECT_GE(delta.st_size - base.st_size, CHECKPOINT_PAGE_WORDS * 4);
+
+    // Pages that match their copy are still skipped
+    ASSERT_TRUE(Checkpoint_save(checkpoint, mem, &state));
+    stat(path, &unchanged);
+    EXPECT_LT(unchanged.st_size - delta.st_size, CHECKPOINT_PAGE_WORDS * 4);
+    free_checkpoint(&checkpoint);
+
+    CheckpointState loaded;
+    Snapshot snapshot = load_checkpoint(path, &loaded);
+    ASSERT_TRUE(snapshot != NULL);
+    uint32_t size;
+    Memory copy = new_memory_module(Snapshot_program(snapshot, &size), 0);
+    EXPECT_TRUE(Snapshot_restore(snapshot, copy));
+    free_snapshot(&snapshot);
+    EXPECT_EQ(segment_data(copy, id)[CHECKPOINT_PAGE_WORDS + 5], marker);
+    free_memory_module(&copy);
+    remove(path);
+}
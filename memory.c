@@ -1,18 +1,201 @@
 #include "memory.h"
+#include "hugepages.h"
+#include "spill.h"
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * The segment arena: one reservation of ARENA_WORDS words of address space,
+ * carved into blocks whose sizes are powers of two. A block starts with the
+ * Segment describing it and the segment's data follows, so the ID of an arena
+ * segment is the offset of its data from the start of the arena. Freed blocks
+ * go on a free list per size, linked through their first data word; offset 0
+ * is never a block, so it ends each list.
+ */
+#define ARENA_WORDS (1u << 30) /* 4 GiB */
+#define ARENA_HEADER_WORDS (sizeof(Segment) / sizeof(uint32_t))
+#define ARENA_MIN_BLOCK_LOG 3
+#define ARENA_CLASSES 31
+#define TABLE_TAG (1u << 31) /* above every arena ID */
+
+/*
+ * The guard zone: GUARD_SLOTS slots of address space reserved with no access.
+ * A guarded segment's data is mapped so that it ends exactly
+ * GUARD_DATA_BYTES into its slot, and the rest of the slot stays
+ * inaccessible. It is 16 GiB long, so every 32-bit index past the end of the
+ * segment faults before it can reach the next slot.
+ */
+#define GUARD_SLOTS 256
+#define GUARD_MIN_WORDS 1024 /* smaller segments are checked explicitly */
+#define GUARD_MAX_WORDS (1u << 30)
+#define GUARD_DATA_BYTES ((size_t)GUARD_MAX_WORDS * sizeof(uint32_t))
+#define GUARD_SLOT_BYTES (GUARD_DATA_BYTES + ((size_t)1 << 34))
+
+typedef struct Guard {
+    char *base;
+    uint32_t ids[GUARD_SLOTS];
+    uint32_t sizes[GUARD_SLOTS];
+    uint16_t free[GUARD_SLOTS]; /* stack of free slots */
+    int free_count;
+} Guard;
+
+/*
+ * Segments outside the arena live in a table of fixed-size chunks, found
+ * through a directory of chunk pointers. Growing the table adds a chunk and
+ * at most doubles the directory, so the segments themselves are never copied.
+ */
+#define CHUNK_BITS 12
+#define CHUNK_LEN (1u << CHUNK_BITS)
+
+typedef struct Chunks {
+    char **chunks;
+    uint32_t count;
+    uint32_t capacity;
+} Chunks;
+
+/*
+ * The free slots of the table below highest_id: a bitmap, plus a summary
+ * with a bit per word of the bitmap telling whether any slot in it is free.
+ * The lowest free slot is then found by scanning one summary word in 4096
+ * slots, starting from the lowest summary word that can have a bit set.
+ */
+typedef struct FreeSlots {
+    uint64_t *bits;
+    uint64_t *summary;
+    uint32_t words; /* in bits */
+    uint32_t lowest; /* summary words below it are all 0 */
+    uint32_t count;
+} FreeSlots;
+
+typedef struct Arena {
+    uint32_t *base;
+    uint32_t next;
+    uint32_t free[ARENA_CLASSES];
+} Arena;
 
 struct Memory {
-    UArray_T segments;
-    Seq_T unmapped_ids;
-    long highest_id;
+    Chunks segments;
+    FreeSlots free_slots;
+    uint32_t highest_id;
+    bool aligned_program;
+    MemoryStats stats;
+    uint64_t quota;
+    bool quota_exceeded;
+    bool exhausted;
+
+    /*
+     * With an arena, segment IDs 1 to arena_last are arena offsets, and the
+     * segments in the table have their slot number or'ed with table_tag so
+     * that the two never collide. Without one both are 0. The table's last
+     * slot is never used, so no segment ID is UINT32_MAX.
+     */
+    Arena *arena;
+    uint32_t arena_last;
+    uint32_t table_tag;
+
+    /*
+     * With a spill file, large segments go in the table with their data in
+     * the file, and spilled holds their SpillSegment by slot (NULL for the
+     * other slots).
+     */
+    Spill spill;
+    Chunks spilled;
+
+    /* With guard pages, large segments go in the table with guarded data */
+    Guard *guard;
 };
 
-Memory new_memory_module(uint32_t *program, int size)
+static uint32_t *alloc_program_data(Memory mem, uint32_t size);
+static void free_program_data(Memory mem, uint32_t *data, uint32_t size);
+static uint32_t arena_new_segment(Memory mem, uint32_t size);
+static void arena_remove_segment(Memory mem, uint32_t index);
+static void arena_free_gap(Memory mem, uint32_t end);
+static int arena_class(uint32_t size);
+static void count_map(Memory mem, uint32_t size);
+static void alloc_table_segment(Memory mem, uint32_t slot, uint32_t size);
+static void free_table_data(Memory mem, uint32_t slot);
+static Segment *table_segment(Memory mem, uint32_t slot);
+static void chunks_reserve(Chunks *chunks, uint32_t index, size_t size);
+static void chunks_trim(Chunks *chunks, uint32_t count);
+static void chunks_free(Chunks *chunks);
+static void free_slots_add(FreeSlots *slots, uint32_t slot);
+static uint32_t free_slots_take_lowest(FreeSlots *slots);
+static bool free_slots_contains(FreeSlots *slots, uint32_t slot);
+static void free_slots_remove(FreeSlots *slots, uint32_t slot);
+static void free_slots_shrink(FreeSlots *slots, uint32_t end);
+static void trim_table(Memory mem);
+static uint32_t *guard_alloc(Memory mem, uint32_t id, uint32_t size);
+static void guard_free(Memory mem, uint32_t *data);
+
+/*
+ * Returns element index of a chunked table whose elements are size bytes.
+ * Inlined with a constant size, this is two loads and no multiply.
+ */
+static inline void *chunks_at(Chunks *chunks, uint32_t index, size_t size)
+{
+    return chunks->chunks[index >> CHUNK_BITS] +
+           (index & (CHUNK_LEN - 1)) * size;
+}
+
+static inline Segment *slot_at(Memory mem, uint32_t slot)
+{
+    return chunks_at(&mem->segments, slot, sizeof(Segment));
+}
+
+static inline SpillSegment *spilled_at(Memory mem, uint32_t slot)
+{
+    return chunks_at(&mem->spilled, slot, sizeof(SpillSegment));
+}
+
+static inline bool wants_spill(Memory mem, uint32_t size)
+{
+    return mem->spill != NULL && size >= SPILL_THRESHOLD;
+}
+
+static inline bool wants_guard(Memory mem, uint32_t size)
+{
+    return mem->guard != NULL && mem->guard->free_count > 0 &&
+           size >= GUARD_MIN_WORDS && size <= GUARD_MAX_WORDS;
+}
+
+static inline bool in_guard(Memory mem, const void *addr)
+{
+    return mem->guard != NULL &&
+           (uintptr_t)addr - (uintptr_t)mem->guard->base <
+               GUARD_SLOTS * GUARD_SLOT_BYTES;
+}
+
+static inline bool in_arena(Memory mem, uint32_t index)
+{
+    return index - 1 < mem->arena_last;
+}
+
+static inline Segment *arena_segment(Memory mem, uint32_t index)
+{
+    return (Segment *)(mem->arena->base + index) - 1;
+}
+
+Memory new_memory_module(uint32_t *program, uint32_t size)
 {
     Memory mem = malloc(sizeof(struct Memory));
-    mem->segments = UArray_new(16, sizeof(Segment));
-    mem->unmapped_ids = Seq_new(16);
-    *((Segment *)UArray_at(mem->segments, 0)) = (Segment){size, program};
+    mem->segments = (Chunks){NULL, 0, 0};
+    chunks_reserve(&mem->segments, 0, sizeof(Segment));
+    mem->free_slots = (FreeSlots){NULL, NULL, 0, 0, 0};
+    *slot_at(mem, 0) = (Segment){size, program};
     mem->highest_id = 1;
+    mem->aligned_program = false;
+    mem->stats = (MemoryStats){1, size, size, 0, 0, 0};
+    mem->quota = 0;
+    mem->quota_exceeded = false;
+    mem->exhausted = false;
+    mem->arena = NULL;
+    mem->arena_last = 0;
+    mem->table_tag = 0;
+    mem->spill = NULL;
+    mem->spilled = (Chunks){NULL, 0, 0};
+    mem->guard = NULL;
 
     return mem;
 }
@@ -20,16 +203,32 @@ Memory new_memory_module(uint32_t *program, int size)
 void free_memory_module(Memory *mem)
 {
     // Free all segments
-    for (int i = 0; i < UArray_length((*mem)->segments); i++) {
-        Segment *segment = UArray_at((*mem)->segments, i);
-        free(segment->data);
+    Segment *program = slot_at(*mem, 0);
+    free_program_data(*mem, program->data, program->size);
+    program->data = NULL;
+    for (uint32_t i = 1; i < (*mem)->highest_id; i++)
+        free_table_data(*mem, i);
+    chunks_free(&(*mem)->segments);
+
+    if ((*mem)->spill != NULL) {
+        chunks_free(&(*mem)->spilled);
+        free_spill(&(*mem)->spill);
     }
-    UArray_free(&(*mem)->segments);
 
-    // Free the unmapped ids sequence
-    while (Seq_length((*mem)->unmapped_ids) > 0)
-        free(Seq_remhi((*mem)->unmapped_ids));
-    Seq_free(&(*mem)->unmapped_ids);
+    // So do guarded segments with the guard zone
+    if ((*mem)->guard != NULL) {
+        munmap((*mem)->guard->base, GUARD_SLOTS * GUARD_SLOT_BYTES);
+        free((*mem)->guard);
+    }
+
+    // Arena segments go with the arena itself
+    if ((*mem)->arena != NULL) {
+        munmap((*mem)->arena->base, (size_t)ARENA_WORDS * sizeof(uint32_t));
+        free((*mem)->arena);
+    }
+
+    free((*mem)->free_slots.bits);
+    free((*mem)->free_slots.summary);
 
     // Free the memory module
     free(*mem);
@@ -38,54 +237,708 @@ void free_memory_module(Memory *mem)
     *mem = NULL;
 }
 
-Segment *get_segment(Memory mem, int index)
+Segment *get_segment(Memory mem, uint32_t index)
+{
+    if (in_arena(mem, index))
+        return arena_segment(mem, index);
+
+    return table_segment(mem, index & ~mem->table_tag);
+}
+
+uint32_t *segment_data(Memory mem, uint32_t index)
 {
-    return UArray_at(mem->segments, index);
+    if (in_arena(mem, index))
+        return mem->arena->base + index;
+
+    return table_segment(mem, index & ~mem->table_tag)->data;
 }
 
-int new_segment(Memory mem, int size)
+uint32_t new_segment(Memory mem, uint32_t size)
 {
-    int id = -1;
+    MemoryStats *stats = &mem->stats;
+    if (mem->quota != 0 && stats->live_words + size > mem->quota) {
+        mem->quota_exceeded = true;
+        return 0;
+    }
 
-    // If there are no unmapped ids, increment highest id
-    if (Seq_length(mem->unmapped_ids) == 0)
+    // Segments that do not fit in the arena go in the table, as do those
+    // that may be spilled or guarded
+    if (mem->arena != NULL && !wants_spill(mem, size) &&
+        !wants_guard(mem, size)) {
+        uint32_t id = arena_new_segment(mem, size);
+        if (id != 0) {
+            count_map(mem, size);
+            return id;
+        }
+    }
+
+    uint32_t id;
+
+    // Reuse the lowest free slot, so that the top of the table empties out
+    // and can be trimmed, or else add one
+    if (mem->free_slots.count > 0) {
+        id = free_slots_take_lowest(&mem->free_slots);
+    } else {
+        if (mem->highest_id == (UINT32_MAX & ~mem->table_tag)) {
+            mem->exhausted = true;
+            return 0;
+        }
         id = mem->highest_id++;
+    }
 
-    // else get an id from the unmapped ids
-    else {
-        int *idptr = Seq_remhi(mem->unmapped_ids);
-        id = *idptr;
-        free(idptr);
+    alloc_table_segment(mem, id, size);
+    count_map(mem, size);
+    return id | mem->table_tag;
+}
+
+void remove_segment(Memory mem, uint32_t index)
+{
+    mem->stats.unmaps++;
+    mem->stats.live_segments--;
+    mem->stats.live_words -= get_segment(mem, index)->size;
+
+    if (in_arena(mem, index)) {
+        arena_remove_segment(mem, index);
+        return;
     }
+    index &= ~mem->table_tag;
 
-    assert(id >= 0);
+    // Free segment data
+    free_table_data(mem, index);
+    Segment *segment = slot_at(mem, index);
+    segment->data = NULL;
+    segment->size = 0;
 
-    // Resize segment array if needed
-    int curr_len = UArray_length(mem->segments);
-    if (id >= curr_len)
-        UArray_resize(mem->segments, curr_len * 2);
+    if (index == mem->highest_id - 1) {
+        mem->highest_id--;
+        trim_table(mem);
+    } else {
+        free_slots_add(&mem->free_slots, index);
+    }
+}
+
+uint32_t next_segment(Memory mem, uint32_t index)
+{
+    // Arena segments come first, in the order of their blocks; freed blocks
+    // keep their size, so the arena can be walked block by block
+    if (mem->arena != NULL && (index == 0 || in_arena(mem, index))) {
+        Arena *arena = mem->arena;
+        uint32_t block = 1u << ARENA_MIN_BLOCK_LOG;
+        if (index != 0)
+            block = index - ARENA_HEADER_WORDS +
+                    (1u << arena_class(arena_segment(mem, index)->size));
+        while (block < arena->next) {
+            Segment *segment = (Segment *)(arena->base + block);
+            if (segment->data != NULL)
+                return block + ARENA_HEADER_WORDS;
+            block += 1u << arena_class(segment->size);
+        }
+        index = 0;
+    }
+
+    for (uint32_t slot = (index & ~mem->table_tag) + 1; slot < mem->highest_id;
+         slot++)
+        if (slot_at(mem, slot)->data != NULL)
+            return slot | mem->table_tag;
+
+    return 0;
+}
+
+bool map_segment_at(Memory mem, uint32_t index, uint32_t size)
+{
+    if (in_arena(mem, index)) {
+        Arena *arena = mem->arena;
+        uint32_t block = index - ARENA_HEADER_WORDS;
+        int class = arena_class(size);
+        if (index < ARENA_HEADER_WORDS || block < arena->next ||
+            block % (1u << ARENA_MIN_BLOCK_LOG) != 0 ||
+            class >= ARENA_CLASSES ||
+            ARENA_WORDS - block < (uint32_t)1 << class)
+            return false;
+
+        arena_free_gap(mem, block);
+        arena->next = block + ((uint32_t)1 << class);
+        HugePages_advise(arena->base + block,
+                         ((size_t)1 << class) * sizeof(uint32_t));
+        Segment *segment = arena_segment(mem, index);
+        segment->size = size;
+        segment->data = arena->base + index;
+    } else {
+        uint32_t slot = index & ~mem->table_tag;
+        if ((index & mem->table_tag) != mem->table_tag ||
+            slot < mem->highest_id || slot == (UINT32_MAX & ~mem->table_tag))
+            return false;
+
+        // The slots skipped are free, as if their segments had been unmapped
+        while (mem->highest_id < slot)
+            free_slots_add(&mem->free_slots, mem->highest_id++);
+        mem->highest_id++;
+        alloc_table_segment(mem, slot, size);
+    }
+
+    count_map(mem, size);
+    return true;
+}
+
+bool memory_uses_arena(Memory mem) { return mem->arena != NULL; }
+
+void load_program_segment(Memory mem, uint32_t index)
+{
+    // Get segments to operate on
+    Segment *seg = get_segment(mem, index);
+    Segment *prog_seg = slot_at(mem, 0);
+
+    // Duplicate the segment
+    uint32_t *new_data = alloc_program_data(mem, seg->size);
+    memcpy(new_data, seg->data, (size_t)seg->size * sizeof(uint32_t));
+
+    mem->stats.live_words += seg->size;
+    mem->stats.live_words -= prog_seg->size;
+    if (mem->stats.live_words > mem->stats.peak_words)
+        mem->stats.peak_words = mem->stats.live_words;
+
+    // Free old program and set new program
+    free_program_data(mem, prog_seg->data, prog_seg->size);
+    prog_seg->data = new_data;
+    prog_seg->size = seg->size;
+}
+
+void align_program_segment(Memory mem)
+{
+    if (mem->aligned_program)
+        return;
+
+    Segment *prog_seg = slot_at(mem, 0);
+    mem->aligned_program = true;
+    uint32_t *new_data = alloc_program_data(mem, prog_seg->size);
+    if (prog_seg->size > 0)
+        memcpy(new_data, prog_seg->data,
+               (size_t)prog_seg->size * sizeof(uint32_t));
+
+    HugePages_free(prog_seg->data, (size_t)prog_seg->size * sizeof(uint32_t));
+    prog_seg->data = new_data;
+}
+
+void set_memory_quota(Memory mem, uint64_t words) { mem->quota = words; }
+
+bool memory_quota_exceeded(Memory mem) { return mem->quota_exceeded; }
+
+bool memory_exhausted(Memory mem) { return mem->exhausted; }
+
+MemoryStats memory_stats(Memory mem)
+{
+    MemoryStats stats = mem->stats;
+    stats.table_slots = mem->highest_id;
+
+    return stats;
+}
+
+bool use_spill_file(Memory mem, const char *dir, uint64_t budget)
+{
+    assert(mem->highest_id == 1 && mem->spill == NULL);
+
+    mem->spill = new_spill(dir, budget);
+    if (mem->spill == NULL)
+        return false;
+    chunks_reserve(&mem->spilled, 0, sizeof(SpillSegment));
+
+    return true;
+}
+
+uint64_t memory_pageouts(Memory mem)
+{
+    return mem->spill != NULL ? Spill_pageouts(mem->spill) : 0;
+}
+
+bool segment_spilled(Memory mem, uint32_t index)
+{
+    // Arena segments are never spilled
+    if (mem->spill == NULL || in_arena(mem, index))
+        return false;
+
+    return *spilled_at(mem, index & ~mem->table_tag) != NULL;
+}
+
+/*
+ * Returns the segment in a slot of the table. A lookup counts as a use of a
+ * segment in the spill file.
+ */
+static Segment *table_segment(Memory mem, uint32_t slot)
+{
+    if (mem->spill != NULL) {
+        SpillSegment spilled = *spilled_at(mem, slot);
+        if (spilled != NULL)
+            Spill_touch(mem->spill, spilled);
+    }
+
+    return slot_at(mem, slot);
+}
+
+/*
+ * Counts a segment of the given size as mapped.
+ */
+static void count_map(Memory mem, uint32_t size)
+{
+    MemoryStats *stats = &mem->stats;
+
+    stats->maps++;
+    stats->live_segments++;
+    stats->live_words += size;
+    if (stats->live_words > stats->peak_words)
+        stats->peak_words = stats->live_words;
+}
+
+/*
+ * Puts a new segment, zeroed, in a slot of the table: behind a guard or in
+ * the spill file if it is large enough.
+ */
+static void alloc_table_segment(Memory mem, uint32_t slot, uint32_t size)
+{
+    // Add a chunk to the table if needed
+    chunks_reserve(&mem->segments, slot, sizeof(Segment));
+    if (mem->spill != NULL)
+        chunks_reserve(&mem->spilled, slot, sizeof(SpillSegment));
 
-    // Allocate segment
-    uint32_t *data = malloc(size * sizeof(uint32_t));
-    for (int i = 0; i < size; i++)
-        data[i] = 0;
-    Segment *segment = UArray_at(mem->segments, id);
+    uint32_t *data = NULL;
+    if (wants_guard(mem, size))
+        data = guard_alloc(mem, slot | mem->table_tag, size);
+    else if (wants_spill(mem, size))
+        *spilled_at(mem, slot) = Spill_alloc(mem->spill, size, &data);
+    if (data == NULL)
+        data = HugePages_alloc((size_t)size * sizeof(uint32_t));
+    Segment *segment = slot_at(mem, slot);
     segment->data = data;
     segment->size = size;
+}
+
+/*
+ * Frees the data of a slot in the table, if it holds any, wherever it lives.
+ */
+static void free_table_data(Memory mem, uint32_t slot)
+{
+    Segment *segment = slot_at(mem, slot);
+    if (segment->data == NULL)
+        return;
+
+    if (in_guard(mem, segment->data)) {
+        guard_free(mem, segment->data);
+        return;
+    }
+
+    if (mem->spill != NULL) {
+        SpillSegment *spilled = spilled_at(mem, slot);
+        if (*spilled != NULL) {
+            Spill_free(mem->spill, *spilled);
+            *spilled = NULL;
+            return;
+        }
+    }
+
+    HugePages_free(segment->data, (size_t)segment->size * sizeof(uint32_t));
+}
+
+/*
+ * Makes sure a chunked table has a chunk holding the given index, adding
+ * zeroed chunks and doubling the directory as needed.
+ */
+static void chunks_reserve(Chunks *chunks, uint32_t index, size_t size)
+{
+    uint32_t needed = (index >> CHUNK_BITS) + 1;
+    if (needed > chunks->capacity) {
+        uint32_t capacity = chunks->capacity > 0 ? chunks->capacity : 1;
+        while (capacity < needed)
+            capacity *= 2;
+        chunks->chunks = realloc(chunks->chunks, capacity * sizeof(char *));
+        assert(chunks->chunks != NULL);
+        chunks->capacity = capacity;
+    }
+
+    while (chunks->count < needed) {
+        chunks->chunks[chunks->count] = calloc(CHUNK_LEN, size);
+        assert(chunks->chunks[chunks->count] != NULL);
+        chunks->count++;
+    }
+}
+
+/*
+ * Frees the chunks of a chunked table from the given one on, and halves the
+ * directory while it is at least four times larger than needed.
+ */
+static void chunks_trim(Chunks *chunks, uint32_t count)
+{
+    while (chunks->count > count)
+        free(chunks->chunks[--chunks->count]);
+
+    uint32_t capacity = chunks->capacity;
+    while (capacity >= 4 * count && capacity > 1)
+        capacity /= 2;
+    if (capacity < chunks->capacity) {
+        chunks->chunks = realloc(chunks->chunks, capacity * sizeof(char *));
+        assert(chunks->chunks != NULL);
+        chunks->capacity = capacity;
+    }
+}
+
+static void chunks_free(Chunks *chunks)
+{
+    for (uint32_t i = 0; i < chunks->count; i++)
+        free(chunks->chunks[i]);
+    free(chunks->chunks);
+    *chunks = (Chunks){NULL, 0, 0};
+}
+
+/*
+ * Shrinks the table after its highest slot has been freed. Free slots just
+ * below it are dropped from the top too, then the chunks past the end of
+ * the table but one are freed, along with excess directory and bitmap. The
+ * spare chunk keeps a program that maps and unmaps around a chunk boundary
+ * from freeing and allocating it every time.
+ */
+static void trim_table(Memory mem)
+{
+    FreeSlots *free_slots = &mem->free_slots;
+    while (mem->highest_id > 1 &&
+           free_slots_contains(free_slots, mem->highest_id - 1))
+        free_slots_remove(free_slots, --mem->highest_id);
+    free_slots_shrink(free_slots, mem->highest_id);
+
+    uint32_t chunks = ((mem->highest_id - 1) >> CHUNK_BITS) + 2;
+    if (mem->segments.count > chunks) {
+        chunks_trim(&mem->segments, chunks);
+        if (mem->spill != NULL)
+            chunks_trim(&mem->spilled, chunks);
+    }
+}
+
+/*
+ * Marks a slot free, growing the bitmap to hold it if needed.
+ */
+static void free_slots_add(FreeSlots *slots, uint32_t slot)
+{
+    uint32_t word = slot / 64;
+    if (word >= slots->words) {
+        uint32_t words = slots->words > 0 ? slots->words : 64;
+        while (words <= word)
+            words *= 2;
+        slots->bits = realloc(slots->bits, words * sizeof(uint64_t));
+        slots->summary = realloc(slots->summary, words / 64 * sizeof(uint64_t));
+        assert(slots->bits != NULL && slots->summary != NULL);
+        memset(slots->bits + slots->words, 0,
+               (words - slots->words) * sizeof(uint64_t));
+        memset(slots->summary + slots->words / 64, 0,
+               (words - slots->words) / 64 * sizeof(uint64_t));
+        slots->words = words;
+    }
+
+    slots->bits[word] |= (uint64_t)1 << (slot % 64);
+    slots->summary[word / 64] |= (uint64_t)1 << (word % 64);
+    if (word / 64 < slots->lowest)
+        slots->lowest = word / 64;
+    slots->count++;
+}
+
+/*
+ * Marks the lowest free slot used and returns it.
+ */
+static uint32_t free_slots_take_lowest(FreeSlots *slots)
+{
+    assert(slots->count > 0);
+
+    while (slots->summary[slots->lowest] == 0)
+        slots->lowest++;
+    uint32_t word = slots->lowest * 64 +
+                    __builtin_ctzll(slots->summary[slots->lowest]);
+    uint32_t slot = word * 64 + __builtin_ctzll(slots->bits[word]);
+
+    free_slots_remove(slots, slot);
+    return slot;
+}
+
+static bool free_slots_contains(FreeSlots *slots, uint32_t slot)
+{
+    return slot / 64 < slots->words &&
+           (slots->bits[slot / 64] >> (slot % 64) & 1);
+}
+
+/*
+ * Marks a free slot used.
+ */
+static void free_slots_remove(FreeSlots *slots, uint32_t slot)
+{
+    uint32_t word = slot / 64;
+
+    slots->bits[word] &= ~((uint64_t)1 << (slot % 64));
+    if (slots->bits[word] == 0)
+        slots->summary[word / 64] &= ~((uint64_t)1 << (word % 64));
+    slots->count--;
+}
+
+/*
+ * Halves the bitmap while it is at least four times larger than needed for
+ * the slots below end. No slot from end on may be free.
+ */
+static void free_slots_shrink(FreeSlots *slots, uint32_t end)
+{
+    uint32_t words = slots->words;
+    while (words > 64 && words >= 4 * (end / 64 + 1))
+        words /= 2;
+    if (words == slots->words)
+        return;
+
+    slots->bits = realloc(slots->bits, words * sizeof(uint64_t));
+    slots->summary = realloc(slots->summary, words / 64 * sizeof(uint64_t));
+    assert(slots->bits != NULL && slots->summary != NULL);
+    slots->words = words;
+    if (slots->lowest >= words / 64)
+        slots->lowest = 0;
+}
+
+bool use_guard_pages(Memory mem)
+{
+    assert(mem->highest_id == 1 && mem->guard == NULL);
+
+    void *base = mmap(NULL, GUARD_SLOTS * GUARD_SLOT_BYTES, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return false;
+
+    mem->guard = malloc(sizeof(Guard));
+    mem->guard->base = base;
+    for (int i = 0; i < GUARD_SLOTS; i++) {
+        mem->guard->ids[i] = 0;
+        mem->guard->free[i] = GUARD_SLOTS - 1 - i;
+    }
+    mem->guard->free_count = GUARD_SLOTS;
+
+    return true;
+}
+
+uint32_t *checked_segment(Memory mem, uint32_t index, uint32_t *limit)
+{
+    Segment *segment;
+
+    if (in_arena(mem, index)) {
+        // Anything below the arena's high water mark has a header; only the
+        // header of a live segment points back at its data
+        if (index >= mem->arena->next)
+            return NULL;
+        segment = arena_segment(mem, index);
+        if (segment->data != mem->arena->base + index)
+            return NULL;
+    } else {
+        uint32_t slot = index & ~mem->table_tag;
+        if (index != 0 && (index & mem->table_tag) != mem->table_tag)
+            return NULL;
+        if (slot >= mem->highest_id)
+            return NULL;
+        segment = table_segment(mem, slot);
+        if (segment->data == NULL)
+            return NULL;
+    }
+
+    *limit = in_guard(mem, segment->data) ? UINT32_MAX : segment->size;
+    return segment->data;
+}
+
+bool guard_fault(Memory mem, const void *addr, uint32_t *index,
+                 uint32_t *offset)
+{
+    if (!in_guard(mem, addr))
+        return false;
+
+    Guard *guard = mem->guard;
+    size_t slot = ((uintptr_t)addr - (uintptr_t)guard->base) / GUARD_SLOT_BYTES;
+    char *data = guard->base + slot * GUARD_SLOT_BYTES + GUARD_DATA_BYTES -
+                 (size_t)guard->sizes[slot] * sizeof(uint32_t);
+
+    *index = guard->ids[slot];
+    *offset = ((const char *)addr - data) / sizeof(uint32_t);
+    return true;
+}
+
+/*
+ * Maps a guarded segment's data in a free slot of the guard zone, ending
+ * where the slot's guard begins.
+ */
+static uint32_t *guard_alloc(Memory mem, uint32_t id, uint32_t size)
+{
+    Guard *guard = mem->guard;
+    size_t page = sysconf(_SC_PAGESIZE);
+    int slot = guard->free[--guard->free_count];
+
+    char *end = guard->base + slot * GUARD_SLOT_BYTES + GUARD_DATA_BYTES;
+    char *data = end - (size_t)size * sizeof(uint32_t);
+    char *start = (char *)((uintptr_t)data / page * page);
+    void *mapping = mmap(start, end - start, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED |
+                             MAP_NORESERVE,
+                         -1, 0);
+    assert(mapping == start);
+
+    guard->ids[slot] = id;
+    guard->sizes[slot] = size;
+
+    return (uint32_t *)data;
+}
+
+/*
+ * Drops the pages of a guarded segment and makes its slot inaccessible
+ * again.
+ */
+static void guard_free(Memory mem, uint32_t *data)
+{
+    Guard *guard = mem->guard;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t slot = ((uintptr_t)data - (uintptr_t)guard->base) / GUARD_SLOT_BYTES;
+
+    char *end = guard->base + slot * GUARD_SLOT_BYTES + GUARD_DATA_BYTES;
+    char *start = (char *)((uintptr_t)data / page * page);
+    mmap(start, end - start, PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+
+    guard->ids[slot] = 0;
+    guard->free[guard->free_count++] = slot;
+}
+
+bool use_segment_arena(Memory mem)
+{
+    assert(mem->highest_id == 1 && mem->arena == NULL);
+
+    void *base = mmap(NULL, (size_t)ARENA_WORDS * sizeof(uint32_t),
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return false;
+
+    mem->arena = malloc(sizeof(Arena));
+    mem->arena->base = base;
+    mem->arena->next = 1u << ARENA_MIN_BLOCK_LOG;
+    for (int i = 0; i < ARENA_CLASSES; i++)
+        mem->arena->free[i] = 0;
+    mem->arena_last = ARENA_WORDS - 1;
+    mem->table_tag = TABLE_TAG;
+
+    return true;
+}
+
+/*
+ * Returns the size class of an arena block holding a segment of the given
+ * size: the log of the block's size in words.
+ */
+static int arena_class(uint32_t size)
+{
+    uint64_t words = (uint64_t)size + ARENA_HEADER_WORDS;
+    int log = ARENA_MIN_BLOCK_LOG;
+    while (((uint64_t)1 << log) < words)
+        log++;
+
+    return log;
+}
+
+/*
+ * Places a new segment in the arena, reusing a freed block of the right size
+ * if there is one. Returns 0 if the arena is full.
+ */
+static uint32_t arena_new_segment(Memory mem, uint32_t size)
+{
+    Arena *arena = mem->arena;
+    int class = arena_class(size);
+    if (class >= ARENA_CLASSES)
+        return 0;
+
+    uint32_t block = arena->free[class];
+    if (block != 0) {
+        // Reused blocks hold the previous segment's data
+        arena->free[class] = arena->base[block + ARENA_HEADER_WORDS];
+        memset(arena->base + block + ARENA_HEADER_WORDS, 0,
+               (size_t)size * sizeof(uint32_t));
+    } else {
+        // Fresh blocks are still zero from the mapping
+        if (ARENA_WORDS - arena->next < (uint32_t)1 << class)
+            return 0;
+        block = arena->next;
+        arena->next += (uint32_t)1 << class;
+        HugePages_advise(arena->base + block,
+                         ((size_t)1 << class) * sizeof(uint32_t));
+    }
+
+    uint32_t id = block + ARENA_HEADER_WORDS;
+    Segment *segment = arena_segment(mem, id);
+    segment->size = size;
+    segment->data = arena->base + id;
 
     return id;
 }
 
-void remove_segment(Memory mem, int index)
+static void arena_remove_segment(Memory mem, uint32_t index)
 {
-    // Free segment data
-    Segment *segment = UArray_at(mem->segments, index);
-    free(segment->data);
+    Arena *arena = mem->arena;
+    Segment *segment = arena_segment(mem, index);
+    int class = arena_class(segment->size);
+
+    // The size stays, for next_segment to step over the block
     segment->data = NULL;
-    segment->size = -1;
+    arena->base[index] = arena->free[class];
+    arena->free[class] = index - ARENA_HEADER_WORDS;
+}
+
+/*
+ * Splits the arena from its high water mark up to end into free blocks, as
+ * large as will fit.
+ */
+static void arena_free_gap(Memory mem, uint32_t end)
+{
+    Arena *arena = mem->arena;
 
-    // Push id onto unmapped ids stack
-    int *id = malloc(sizeof(int));
-    *id = index;
-    Seq_addhi(mem->unmapped_ids, id);
+    while (arena->next < end) {
+        int log = ARENA_MIN_BLOCK_LOG;
+        while (log + 1 < ARENA_CLASSES &&
+               ((uint32_t)1 << (log + 1)) <= end - arena->next)
+            log++;
+
+        uint32_t block = arena->next;
+        Segment *segment = (Segment *)(arena->base + block);
+        segment->size = ((uint32_t)1 << log) - ARENA_HEADER_WORDS;
+        segment->data = NULL;
+        arena->base[block + ARENA_HEADER_WORDS] = arena->free[log];
+        arena->free[log] = block;
+        arena->next += (uint32_t)1 << log;
+    }
+}
+
+/*
+ * Rounds the size of segment 0 in bytes up to whole pages.
+ */
+static size_t program_mapping_size(uint32_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t bytes = (size_t)(size > 0 ? size : 1) * sizeof(uint32_t);
+
+    return (bytes + page - 1) / page * page;
+}
+
+/*
+ * Allocates the data of segment 0, in its own page-aligned mapping if the
+ * client asked for one. Pages whose protection changes one at a time are not
+ * worth putting on huge pages.
+ */
+static uint32_t *alloc_program_data(Memory mem, uint32_t size)
+{
+    if (!mem->aligned_program)
+        return HugePages_alloc((size_t)size * sizeof(uint32_t));
+
+    void *data = mmap(NULL, program_mapping_size(size),
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+                      0);
+    assert(data != MAP_FAILED);
+
+    return data;
+}
+
+static void free_program_data(Memory mem, uint32_t *data, uint32_t size)
+{
+    if (!mem->aligned_program)
+        HugePages_free(data, (size_t)size * sizeof(uint32_t));
+    else if (data != NULL)
+        munmap(data, program_mapping_size(size));
 }
@@ -1,16 +1,28 @@
 #ifndef MEMORY_INCLUDED
 #define MEMORY_INCLUDED
 
-#include "seq.h"
-#include "uarray.h"
 #include <assert.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 typedef struct Memory *Memory;
 
+/*
+ * Running totals kept by a memory module. Segment 0 counts as a live segment,
+ * and its words as live words.
+ */
+typedef struct MemoryStats {
+    uint64_t live_segments;
+    uint64_t live_words;
+    uint64_t peak_words;
+    uint64_t maps;
+    uint64_t unmaps;
+    uint64_t table_slots; /* slots in the segment table, free ones included */
+} MemoryStats;
+
 typedef struct Segment {
-    int size;
+    uint32_t size;
     uint32_t *data;
 } Segment;
 
@@ -20,13 +32,29 @@ typedef struct Segment {
  * Gets the address of the segment of memory stored at the given index.
  *
  * @param  memory *mem      A pointer to the memory module to access from
- * @param  int index        The index of the segment to get
+ * @param  uint32_t index   The index of the segment to get
  * @return uint32_t*        A pointer to the segment that was requested
  * @expect The index has been previously mapped to a segment and has not been
  *         unmapped since its mapping
  * @expect The memory pointer is not NULL and points to a valid memory module
  */
-Segment *get_segment(Memory mem, int index);
+Segment *get_segment(Memory mem, uint32_t index);
+
+/*
+ * segment_data
+ *
+ * Gets the data of the segment stored at the given index. Cheaper than
+ * get_segment with a segment arena, since the data is found from the index
+ * alone.
+ *
+ * @param  memory *mem      A pointer to the memory module to access from
+ * @param  uint32_t index   The index of the segment to get
+ * @return uint32_t*        A pointer to the segment's data
+ * @expect The index has been previously mapped to a segment and has not been
+ *         unmapped since its mapping
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ */
+uint32_t *segment_data(Memory mem, uint32_t index);
 
 /*
  * new_segment
@@ -34,12 +62,16 @@ Segment *get_segment(Memory mem, int index);
  * Requests a new segment of memory from the memory module.
  *
  * @param  memory *mem      A pointer to the memory module to request from
- * @param  int size         The size of the segment to request in words
- * @return int              The index of the newly created segment
+ * @param  uint32_t size    The size of the segment to request in words,
+ *                          up to 2^32 - 1; large segments are only backed
+ *                          by memory as their pages are touched
+ * @return uint32_t         The index of the newly created segment, or 0 if
+ *                          it would take the live words over the quota or
+ *                          every index is in use
  * @expect The memory pointer is not NULL and points to a valid memory module
  * @expect The size is greater than 0
  */
-int new_segment(Memory mem, int size);
+uint32_t new_segment(Memory mem, uint32_t size);
 
 /*
  * remove_segment
@@ -47,26 +79,262 @@ int new_segment(Memory mem, int size);
  * Removes a segment of memory from the memory module.
  *
  * @param  memory *mem      A pointer to the memory module to remove from
- * @param  int index        The index of the segment to remove
+ * @param  uint32_t index   The index of the segment to remove
+ * @return void
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ * @expect The index has been previously mapped to a segment and has not been
+ *         unmapped since its mapping
+ */
+void remove_segment(Memory mem, uint32_t index);
+
+/*
+ * load_program_segment
+ *
+ * Replaces segment 0 with a duplicate of another segment. The old contents
+ * of segment 0 are freed.
+ *
+ * @param  memory *mem      A pointer to the memory module to operate on
+ * @param  uint32_t index   The index of the segment to duplicate
  * @return void
  * @expect The memory pointer is not NULL and points to a valid memory module
  * @expect The index has been previously mapped to a segment and has not been
  *         unmapped since its mapping
  */
-void remove_segment(Memory mem, int index);
+void load_program_segment(Memory mem, uint32_t index);
+
+/*
+ * align_program_segment
+ *
+ * Makes the memory module keep segment 0 in a mapping of its own that starts
+ * on a page boundary and spans whole pages, so that the client can change
+ * the protection of its pages. The current segment 0 is moved into such a
+ * mapping straight away, and every later load_program_segment uses one too.
+ *
+ * @param  memory *mem      A pointer to the memory module to operate on
+ * @return void
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ */
+void align_program_segment(Memory mem);
+
+/*
+ * use_segment_arena
+ *
+ * Makes the memory module place new segments in a 4 GiB arena of address
+ * space reserved up front, each segment's index being the offset of its data
+ * in the arena. Looking a segment up then needs no table. Segments that no
+ * longer fit in the arena are kept in the table as before, under indices
+ * beyond the arena. Freeing the memory module releases every arena segment
+ * at once, however many there are, rather than one by one.
+ *
+ * @param  memory *mem      A pointer to the memory module to operate on
+ * @return bool             Whether the arena could be reserved; if not, the
+ *                          memory module goes on using only the table
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ * @expect No segment other than segment 0 has been mapped yet
+ */
+bool use_segment_arena(Memory mem);
+
+/*
+ * set_memory_quota
+ *
+ * Limits the number of live words, segment 0 included. A new_segment that
+ * would go over the limit maps nothing and returns 0. Segment 0 can still
+ * grow past it through load_program_segment.
+ *
+ * @param  memory *mem      A pointer to the memory module to operate on
+ * @param  uint64_t words   The most words that may be live, or 0 for no limit
+ * @return void
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ */
+void set_memory_quota(Memory mem, uint64_t words);
+
+/*
+ * memory_quota_exceeded
+ *
+ * @param  memory *mem      A pointer to the memory module to query
+ * @return bool             Whether new_segment has refused a segment because
+ *                          of the quota
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ */
+bool memory_quota_exceeded(Memory mem);
+
+/*
+ * memory_exhausted
+ *
+ * @param  memory *mem      A pointer to the memory module to query
+ * @return bool             Whether new_segment has refused a segment because
+ *                          every index was in use
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ */
+bool memory_exhausted(Memory mem);
+
+/*
+ * memory_stats
+ *
+ * @param  memory *mem      A pointer to the memory module to query
+ * @return MemoryStats      The module's counters so far
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ */
+MemoryStats memory_stats(Memory mem);
+
+/*
+ * use_spill_file
+ *
+ * Makes the memory module put segments of at least SPILL_THRESHOLD words in
+ * a scratch file in the given directory, keeping only the most recently used
+ * of them resident, up to a budget. Segments looked up less recently are
+ * paged out to the file; their data stays where it is and is paged back in
+ * when it is next used, so clients see only the latency.
+ *
+ * @param  memory *mem      A pointer to the memory module to operate on
+ * @param  char *dir        The directory to create the scratch file in
+ * @param  uint64_t budget  The number of words of such segments to keep
+ *                          resident
+ * @return bool             Whether the scratch file could be created; if
+ *                          not, the memory module keeps every segment in
+ *                          memory
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ * @expect No segment other than segment 0 has been mapped yet
+ */
+bool use_spill_file(Memory mem, const char *dir, uint64_t budget);
+
+/*
+ * memory_pageouts
+ *
+ * @param  memory *mem      A pointer to the memory module to query
+ * @return uint64_t         The number of times a segment has been paged out
+ *                          to the spill file
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ */
+uint64_t memory_pageouts(Memory mem);
+
+/*
+ * segment_spilled
+ *
+ * Tells whether a segment lives in the spill file. Only lookups through the
+ * memory module count as uses of such a segment, so a client that caches
+ * segment data must look these up every time, or they will look cold and be
+ * paged out however often they are used.
+ *
+ * @param  memory *mem      A pointer to the memory module to query
+ * @param  uint32_t index   The index of the segment
+ * @return bool             Whether the segment is in the spill file
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ * @expect The index has been previously mapped to a segment and has not been
+ *         unmapped since its mapping
+ */
+bool segment_spilled(Memory mem, uint32_t index);
+
+/*
+ * use_guard_pages
+ *
+ * Makes the memory module place segments from 1024 words up to 2^30 words
+ * so that any index past their end lands on an inaccessible guard page
+ * rather than on other data. A few hundred segments can be guarded at a
+ * time; the rest are placed as usual.
+ *
+ * @param  memory *mem      A pointer to the memory module to operate on
+ * @return bool             Whether the guard zone could be reserved
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ * @expect No segment other than segment 0 has been mapped yet
+ */
+bool use_guard_pages(Memory mem);
+
+/*
+ * checked_segment
+ *
+ * Looks up a segment that the client cannot be sure is mapped.
+ *
+ * @param  memory *mem      A pointer to the memory module to access from
+ * @param  uint32_t index   The index of the segment to get
+ * @param  uint32_t *limit  Set to the lowest word index that must be
+ *                          rejected before the data is accessed: the size of
+ *                          the segment, or UINT32_MAX if accesses past its
+ *                          end fault on a guard page
+ * @return uint32_t*        The segment's data, or NULL if the index is not
+ *                          mapped
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ */
+uint32_t *checked_segment(Memory mem, uint32_t index, uint32_t *limit);
+
+/*
+ * guard_fault
+ *
+ * Tells whether a faulting address is on the guard of a guarded segment.
+ * Safe to call from a signal handler.
+ *
+ * @param  memory *mem      A pointer to the memory module to query
+ * @param  void *addr       The faulting address
+ * @param  uint32_t *index  Set to the index of the segment the access was
+ *                          meant for
+ * @param  uint32_t *offset Set to the word index of the access
+ * @return bool             Whether the address is on a guard
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ */
+bool guard_fault(Memory mem, const void *addr, uint32_t *index,
+                 uint32_t *offset);
+
+/*
+ * next_segment
+ *
+ * Walks the mapped segments in increasing order of their indices: starting
+ * from segment 0, each call gives the index of the one after.
+ *
+ * @param  memory *mem      A pointer to the memory module to walk
+ * @param  uint32_t index   The index of a mapped segment
+ * @return uint32_t         The lowest index of a mapped segment above it, or
+ *                          0 if there is none
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ */
+uint32_t next_segment(Memory mem, uint32_t index);
+
+/*
+ * map_segment_at
+ *
+ * Maps a zeroed segment under a given index, to rebuild the segments of a
+ * saved memory module. Indices left out below it become free, and are
+ * handed out again by new_segment; in an arena, the space they leave may be
+ * split into blocks of other sizes than before. The quota is not checked.
+ *
+ * @param  memory *mem      A pointer to the memory module to map in
+ * @param  uint32_t index   The index to map, from next_segment on a module
+ *                          set up the same way, arena or not
+ * @param  uint32_t size    The size of the segment in words
+ * @return bool             Whether the index could be used; it cannot if it
+ *                          does not belong to this kind of module
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ * @expect The index is above every one mapped so far but segment 0, and no
+ *         segment has been unmapped
+ */
+bool map_segment_at(Memory mem, uint32_t index, uint32_t size);
+
+/*
+ * memory_uses_arena
+ *
+ * @param  memory *mem      A pointer to the memory module to query
+ * @return bool             Whether use_segment_arena has reserved an arena
+ * @expect The memory pointer is not NULL and points to a valid memory module
+ */
+bool memory_uses_arena(Memory mem);
 
 /*
  * new_memory_module
  *
  * Allocates and returns a new memory module. The memory module is initialized
- * with the given program as its first segment.
+ * with the given program as its first segment, and takes ownership of it:
+ * segment 0 is released with HugePages_free when a load program instruction
+ * replaces it or the module is freed.
  *
  * @param  uint32_t *program    A pointer to the program to initialize the
- *                              memory module with
- * @param  int size             The size of the program in words
+ *                              memory module with, allocated with
+ *                              HugePages_alloc for size words, or NULL if
+ *                              size is 0
+ * @param  uint32_t size        The size of the program in words
  * @return memory *             A pointer to the new memory module
+ * @expect The program was allocated with HugePages_alloc and is not freed by
+ *         the caller
  */
-Memory new_memory_module(uint32_t *program, int size);
+Memory new_memory_module(uint32_t *program, uint32_t size);
 
 /*
  * free_memory_module
@@ -0,0 +1,233 @@
+/*
+ * memreplay: replays memory traces written by um --trace-mem against each
+ * configuration of the memory module, and reports the time taken, the peak
+ * resident set size and how it compares with the peak of live data.
+ *
+ * Every configuration runs in a child process of its own, so that the peak
+ * resident set sizes do not mix.
+ */
+#include "hugepages.h"
+#include "memory.h"
+#include "memtrace.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PAGE_WORDS 1024
+#define IDS_MIN_CAPACITY 1024
+#define NO_ID UINT32_MAX /* never a segment ID */
+
+typedef struct Variant {
+    const char *name;
+    bool arena;
+    bool huge_pages;
+} Variant;
+
+static const Variant variants[] = {
+    {"table", false, false},
+    {"arena", true, false},
+    {"table+huge-pages", false, true},
+    {"arena+huge-pages", true, true},
+};
+
+/*
+ * The replayed ID of each traced segment ID, in an open-addressed hash table
+ * that is never more than half full.
+ */
+typedef struct IdMap {
+    uint32_t *keys;
+    uint32_t *values;
+    uint32_t capacity; /* a power of two */
+    uint32_t shift;    /* 32 - log2(capacity) */
+    uint32_t count;
+} IdMap;
+
+static bool replay(const char *path, const Variant *variant);
+static uint32_t id_home(IdMap *ids, uint32_t key);
+static uint32_t *id_slot(IdMap *ids, uint32_t key);
+static void id_put(IdMap *ids, uint32_t key, uint32_t value);
+static uint32_t id_get(IdMap *ids, uint32_t key);
+static void id_remove(IdMap *ids, uint32_t key);
+static long max_rss(void);
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <trace>...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    for (int i = 1; i < argc; i++) {
+        printf("%s\n", argv[i]);
+        fflush(stdout);
+
+        for (size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++) {
+            pid_t pid = fork();
+            if (pid == 0)
+                exit(replay(argv[i], &variants[v]) ? EXIT_SUCCESS
+                                                   : EXIT_FAILURE);
+
+            int child;
+            if (pid < 0 || waitpid(pid, &child, 0) != pid ||
+                !WIFEXITED(child) || WEXITSTATUS(child) != EXIT_SUCCESS)
+                status = EXIT_FAILURE;
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Replays a trace against one configuration and prints a line of results.
+ * Every page of a new segment is written to, as a program would, so that it
+ * counts towards the resident set.
+ */
+static bool replay(const char *path, const Variant *variant)
+{
+    uint32_t program;
+    MemTraceReader reader = open_mem_trace(path, &program);
+    if (reader == NULL) {
+        fprintf(stderr, "Could not read trace %s\n", path);
+        return false;
+    }
+
+    if (variant->huge_pages)
+        HugePages_enable();
+    Memory mem = new_memory_module(
+        HugePages_alloc((size_t)program * sizeof(uint32_t)), program);
+    if (variant->arena && !use_segment_arena(mem)) {
+        fprintf(stderr, "Could not reserve a segment arena\n");
+        return false;
+    }
+
+    IdMap ids = {NULL, NULL, 0, 32, 0};
+    long base_rss = max_rss();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    MemRecord record;
+    uint64_t records = 0;
+    while (MemTraceReader_next(reader, &record)) {
+        records++;
+        switch (record.event) {
+        case MEM_MAP: {
+            uint32_t id = new_segment(mem, record.size);
+            uint32_t *data = segment_data(mem, id);
+            for (uint64_t i = 0; i < record.size; i += PAGE_WORDS)
+                data[i] = 1;
+            id_put(&ids, record.id, id);
+            break;
+        }
+        case MEM_UNMAP:
+            remove_segment(mem, id_get(&ids, record.id));
+            id_remove(&ids, record.id);
+            break;
+        case MEM_LOAD:
+            load_program_segment(mem, id_get(&ids, record.id));
+            break;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) +
+                     (end.tv_nsec - start.tv_nsec) / 1e9;
+    long rss = max_rss() - base_rss;
+    uint64_t peak_kb = memory_stats(mem).peak_words * sizeof(uint32_t) / 1024;
+
+    printf("  %-18s %9" PRIu64 " records %8.3fs  peak RSS %8ld kB  "
+           "peak live %8" PRIu64 " kB  RSS/live %.2f\n",
+           variant->name, records, seconds, rss, peak_kb,
+           peak_kb > 0 ? (double)rss / peak_kb : 0.0);
+
+    close_mem_trace(&reader);
+    return true;
+}
+
+/*
+ * Returns the first slot to probe for a key, by Fibonacci hashing: arena
+ * IDs all have the same low bits, so the high bits of the product are used.
+ */
+static uint32_t id_home(IdMap *ids, uint32_t key)
+{
+    return (uint32_t)(key * 2654435769u) >> ids->shift;
+}
+
+static uint32_t *id_slot(IdMap *ids, uint32_t key)
+{
+    uint32_t mask = ids->capacity - 1;
+    uint32_t i = id_home(ids, key);
+
+    while (ids->keys[i] != NO_ID && ids->keys[i] != key)
+        i = (i + 1) & mask;
+
+    return &ids->keys[i];
+}
+
+static void id_put(IdMap *ids, uint32_t key, uint32_t value)
+{
+    if ((ids->count + 1) * 2 > ids->capacity) {
+        IdMap old = *ids;
+        ids->capacity = old.capacity > 0 ? old.capacity * 2 : IDS_MIN_CAPACITY;
+        ids->shift = 32 - __builtin_ctz(ids->capacity);
+        ids->keys = malloc(ids->capacity * sizeof(uint32_t));
+        ids->values = malloc(ids->capacity * sizeof(uint32_t));
+        memset(ids->keys, 0xFF, ids->capacity * sizeof(uint32_t));
+        ids->count = 0;
+        for (uint32_t i = 0; i < old.capacity; i++)
+            if (old.keys[i] != NO_ID)
+                id_put(ids, old.keys[i], old.values[i]);
+        free(old.keys);
+        free(old.values);
+    }
+
+    uint32_t *slot = id_slot(ids, key);
+    if (*slot == NO_ID)
+        ids->count++;
+    *slot = key;
+    ids->values[slot - ids->keys] = value;
+}
+
+static uint32_t id_get(IdMap *ids, uint32_t key)
+{
+    return ids->values[id_slot(ids, key) - ids->keys];
+}
+
+/*
+ * Removes a key, shifting later keys of its probe sequence back so that no
+ * tombstone is needed.
+ */
+static void id_remove(IdMap *ids, uint32_t key)
+{
+    uint32_t mask = ids->capacity - 1;
+    uint32_t hole = id_slot(ids, key) - ids->keys;
+    ids->keys[hole] = NO_ID;
+    ids->count--;
+
+    for (uint32_t i = (hole + 1) & mask; ids->keys[i] != NO_ID;
+         i = (i + 1) & mask) {
+        uint32_t home = id_home(ids, ids->keys[i]);
+        // Move the key into the hole if the hole is on its probe sequence
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            ids->keys[hole] = ids->keys[i];
+            ids->values[hole] = ids->values[i];
+            ids->keys[i] = NO_ID;
+            hole = i;
+        }
+    }
+}
+
+/*
+ * Returns the peak resident set size of the process so far, in kB.
+ */
+static long max_rss(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
@@ -0,0 +1,152 @@
+#include "memtrace.h"
+#include <assert.h>
+#include <mem.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC 0x544d4d55u /* "UMMT" */
+#define TRACE_VERSION 1u
+
+struct MemTrace {
+    FILE *fp;
+    uint64_t steps; /* of the last record */
+};
+
+struct MemTraceReader {
+    FILE *fp;
+    uint64_t steps;
+};
+
+typedef struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t program;
+} Header;
+
+static void put_varint(FILE *fp, uint64_t value);
+static bool get_varint(FILE *fp, uint64_t *value);
+
+MemTrace new_mem_trace(const char *path, uint32_t program)
+{
+    assert(path != NULL);
+
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+        return NULL;
+
+    Header header = {TRACE_MAGIC, TRACE_VERSION, program};
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+        fclose(fp);
+        return NULL;
+    }
+
+    MemTrace trace;
+    NEW(trace);
+    trace->fp = fp;
+    trace->steps = 0;
+
+    return trace;
+}
+
+bool free_mem_trace(MemTrace *trace)
+{
+    assert(trace != NULL && *trace != NULL);
+
+    bool ok = !ferror((*trace)->fp);
+    ok = fclose((*trace)->fp) == 0 && ok;
+    FREE(*trace);
+
+    return ok;
+}
+
+void MemTrace_record(MemTrace trace, MemEvent event, uint64_t steps,
+                     uint32_t id, uint32_t size)
+{
+    assert(trace != NULL && steps >= trace->steps);
+
+    putc(event, trace->fp);
+    put_varint(trace->fp, steps - trace->steps);
+    put_varint(trace->fp, id);
+    if (event == MEM_MAP)
+        put_varint(trace->fp, size);
+    trace->steps = steps;
+}
+
+MemTraceReader open_mem_trace(const char *path, uint32_t *program)
+{
+    assert(path != NULL && program != NULL);
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
+
+    Header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+        fclose(fp);
+        return NULL;
+    }
+    *program = header.program;
+
+    MemTraceReader reader;
+    NEW(reader);
+    reader->fp = fp;
+    reader->steps = 0;
+
+    return reader;
+}
+
+void close_mem_trace(MemTraceReader *reader)
+{
+    assert(reader != NULL && *reader != NULL);
+
+    fclose((*reader)->fp);
+    FREE(*reader);
+}
+
+bool MemTraceReader_next(MemTraceReader reader, MemRecord *record)
+{
+    assert(reader != NULL && record != NULL);
+
+    int event = getc(reader->fp);
+    uint64_t delta, id, size = 0;
+    if (event < MEM_MAP || event > MEM_LOAD ||
+        !get_varint(reader->fp, &delta) || !get_varint(reader->fp, &id) ||
+        (event == MEM_MAP && !get_varint(reader->fp, &size)))
+        return false;
+
+    reader->steps += delta;
+    record->event = (MemEvent)event;
+    record->steps = reader->steps;
+    record->id = id;
+    record->size = size;
+
+    return true;
+}
+
+/*
+ * Writes an unsigned LEB128 varint: seven bits a byte, low bits first, with
+ * the top bit set on every byte but the last.
+ */
+static void put_varint(FILE *fp, uint64_t value)
+{
+    while (value >= 0x80) {
+        putc((int)(value & 0x7F) | 0x80, fp);
+        value >>= 7;
+    }
+    putc((int)value, fp);
+}
+
+static bool get_varint(FILE *fp, uint64_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = getc(fp);
+        if (byte == EOF)
+            return false;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+            return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,93 @@
+#ifndef MEMTRACE_INCLUDED
+#define MEMTRACE_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * A log of the segment mappings, unmappings and program loads of a run, kept
+ * so that they can be replayed against other memory module configurations.
+ * The file starts with a header holding the size of the initial program.
+ * Each record follows as a tag byte, then LEB128 varints: the number of
+ * instructions since the previous record, the segment ID and, for a map,
+ * the size.
+ */
+typedef struct MemTrace *MemTrace;
+typedef struct MemTraceReader *MemTraceReader;
+
+typedef enum MemEvent { MEM_MAP, MEM_UNMAP, MEM_LOAD } MemEvent;
+
+typedef struct MemRecord {
+    MemEvent event;
+    uint64_t steps; /* instruction count when it happened */
+    uint32_t id;
+    uint32_t size; /* 0 unless a map */
+} MemRecord;
+
+/*
+ * new_mem_trace
+ *
+ * Creates a trace file, replacing any file at the path.
+ *
+ * @param  char *path           The file to write to
+ * @param  uint32_t program     The size of the initial program in words
+ * @return MemTrace             The trace, or NULL if the file could not be
+ *                              created
+ */
+MemTrace new_mem_trace(const char *path, uint32_t program);
+
+/*
+ * free_mem_trace
+ *
+ * Flushes and closes a trace file.
+ *
+ * @param  MemTrace *trace      A pointer to the trace to free
+ * @return bool                 Whether every record was written
+ * @expect The trace is not NULL
+ */
+bool free_mem_trace(MemTrace *trace);
+
+/*
+ * MemTrace_record
+ *
+ * Appends a record to a trace. Records must come in instruction count
+ * order.
+ *
+ * @param  MemTrace trace       The trace to append to
+ * @param  MemEvent event       What happened
+ * @param  uint64_t steps       The instruction count of the instruction
+ * @param  uint32_t id          The segment mapped, unmapped or loaded
+ * @param  uint32_t size        The size of the segment mapped, or 0
+ */
+void MemTrace_record(MemTrace trace, MemEvent event, uint64_t steps,
+                     uint32_t id, uint32_t size);
+
+/*
+ * open_mem_trace
+ *
+ * @param  char *path           The trace file to read
+ * @param  uint32_t *program    Set to the size of the initial program
+ * @return MemTraceReader       A reader positioned at the first record, or
+ *                              NULL if the file could not be opened or is not
+ *                              a trace
+ */
+MemTraceReader open_mem_trace(const char *path, uint32_t *program);
+
+/*
+ * close_mem_trace
+ *
+ * @param  MemTraceReader *reader   A pointer to the reader to close
+ * @expect The reader is not NULL
+ */
+void close_mem_trace(MemTraceReader *reader);
+
+/*
+ * MemTraceReader_next
+ *
+ * @param  MemTraceReader reader    The reader to read from
+ * @param  MemRecord *record        Set to the next record
+ * @return bool                     Whether there was a whole record left
+ */
+bool MemTraceReader_next(MemTraceReader reader, MemRecord *record);
+
+#endif
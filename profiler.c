@@ -0,0 +1,284 @@
+#include "profiler.h"
+#include <assert.h>
+#include <mem.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define STACKS_MIN_CAPACITY 256
+#define LINE_LEN 128
+
+/*
+ * A sampled stack. Jumps past depth are 0.
+ */
+typedef struct Key {
+    uint64_t generation;
+    uint32_t depth;
+    uint32_t jumps[PROFILE_DEPTH]; /* oldest first */
+    uint32_t pc;
+    uint32_t opcode;
+} Key;
+
+typedef struct Entry {
+    Key key;
+    uint64_t count; /* 0 for an empty entry */
+} Entry;
+
+/*
+ * The distinct stacks sampled so far, in an open-addressed hash table that
+ * is never more than half full.
+ */
+struct Stacks {
+    Entry *entries;
+    uint32_t capacity; /* a power of two */
+    uint32_t count;
+};
+
+/* A line of output, for sorting */
+typedef struct Line {
+    char text[LINE_LEN];
+    uint64_t count;
+} Line;
+
+static const char *opcode_names[16] = {
+    "cmov", "sload", "sstore", "add",  "mul", "div",   "nand",  "halt",
+    "map",  "unmap", "out",    "in",   "loadp", "loadv", "op14", "op15"};
+
+/* The profiler whose due count the SIGPROF handler resets */
+static Profiler timer_profiler = NULL;
+
+static Entry *stacks_find(struct Stacks *stacks, const Key *key);
+static void stacks_grow(struct Stacks *stacks);
+static uint64_t hash_key(const Key *key);
+static bool key_equal(const Key *a, const Key *b);
+static int compare_lines(const void *a, const void *b);
+static void handle_prof(int sig);
+
+Profiler new_profiler(uint64_t interval)
+{
+    Profiler profiler;
+    NEW(profiler);
+
+    profiler->due = interval > 0 ? interval : UINT64_MAX;
+    profiler->interval = interval;
+    profiler->generation = 0;
+    profiler->jump_count = 0;
+    profiler->samples = 0;
+
+    NEW(profiler->stacks);
+    profiler->stacks->capacity = STACKS_MIN_CAPACITY;
+    profiler->stacks->count = 0;
+    profiler->stacks->entries = CALLOC(STACKS_MIN_CAPACITY, sizeof(Entry));
+
+    return profiler;
+}
+
+void free_profiler(Profiler *profiler)
+{
+    assert(profiler != NULL && *profiler != NULL);
+
+    if (timer_profiler == *profiler)
+        Profiler_stop_timer(*profiler);
+    FREE((*profiler)->stacks->entries);
+    FREE((*profiler)->stacks);
+    FREE(*profiler);
+}
+
+bool Profiler_start_timer(Profiler profiler, unsigned hz)
+{
+    assert(profiler != NULL && hz > 0);
+    assert(timer_profiler == NULL || timer_profiler == profiler);
+
+    timer_profiler = profiler;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_prof;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) {
+        timer_profiler = NULL;
+        return false;
+    }
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz > 0 ? 1000000 / hz : 1;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        signal(SIGPROF, SIG_IGN);
+        timer_profiler = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+void Profiler_stop_timer(Profiler profiler)
+{
+    assert(profiler != NULL);
+
+    if (timer_profiler != profiler)
+        return;
+
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+    timer_profiler = NULL;
+}
+
+void Profiler_sample(Profiler profiler, uint32_t pc, uint32_t opcode,
+                     uint64_t steps)
+{
+    assert(profiler != NULL);
+
+    // Schedule the next sample first, so that a tick that arrives meanwhile
+    // is not lost
+    profiler->due = profiler->interval > 0 ? steps + profiler->interval
+                                           : UINT64_MAX;
+
+    Key key;
+    memset(&key, 0, sizeof(key));
+    key.generation = profiler->generation;
+    key.depth = profiler->jump_count < PROFILE_DEPTH ? profiler->jump_count
+                                                     : PROFILE_DEPTH;
+    for (uint32_t i = 0; i < key.depth; i++)
+        key.jumps[i] = profiler->jumps[(profiler->jump_count - key.depth + i) %
+                                       PROFILE_DEPTH];
+    key.pc = pc;
+    key.opcode = opcode;
+
+    struct Stacks *stacks = profiler->stacks;
+    Entry *entry = stacks_find(stacks, &key);
+    if (entry->count == 0) {
+        entry->key = key;
+        stacks->count++;
+    }
+    entry->count++;
+    profiler->samples++;
+
+    if (stacks->count * 2 > stacks->capacity)
+        stacks_grow(stacks);
+}
+
+void Profiler_load(Profiler profiler)
+{
+    assert(profiler != NULL);
+
+    profiler->generation++;
+    profiler->jump_count = 0;
+}
+
+uint64_t Profiler_samples(Profiler profiler)
+{
+    assert(profiler != NULL);
+    return profiler->samples;
+}
+
+void Profiler_write(Profiler profiler, FILE *fp)
+{
+    assert(profiler != NULL && fp != NULL);
+
+    struct Stacks *stacks = profiler->stacks;
+    Line *lines = CALLOC(stacks->count > 0 ? stacks->count : 1, sizeof(Line));
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < stacks->capacity; i++) {
+        Entry *entry = &stacks->entries[i];
+        if (entry->count == 0)
+            continue;
+
+        Key *key = &entry->key;
+        int len = snprintf(lines[n].text, LINE_LEN, "gen%llu",
+                           (unsigned long long)key->generation);
+        for (uint32_t j = 0; j < key->depth; j++)
+            len += snprintf(lines[n].text + len, LINE_LEN - len, ";0x%x",
+                            key->jumps[j]);
+        snprintf(lines[n].text + len, LINE_LEN - len, ";0x%x:%s", key->pc,
+                 opcode_names[key->opcode & 15]);
+        lines[n].count = entry->count;
+        n++;
+    }
+
+    qsort(lines, n, sizeof(Line), compare_lines);
+    for (uint32_t i = 0; i < n; i++)
+        fprintf(fp, "%s %llu\n", lines[i].text,
+                (unsigned long long)lines[i].count);
+
+    FREE(lines);
+}
+
+/*
+ * Returns the entry holding a key, or the empty entry where it belongs.
+ */
+static Entry *stacks_find(struct Stacks *stacks, const Key *key)
+{
+    uint32_t mask = stacks->capacity - 1;
+    uint32_t i = hash_key(key) & mask;
+
+    while (stacks->entries[i].count != 0 &&
+           !key_equal(&stacks->entries[i].key, key))
+        i = (i + 1) & mask;
+
+    return &stacks->entries[i];
+}
+
+static void stacks_grow(struct Stacks *stacks)
+{
+    Entry *old = stacks->entries;
+    uint32_t old_capacity = stacks->capacity;
+
+    stacks->capacity *= 2;
+    stacks->entries = CALLOC(stacks->capacity, sizeof(Entry));
+    for (uint32_t i = 0; i < old_capacity; i++)
+        if (old[i].count != 0)
+            *stacks_find(stacks, &old[i].key) = old[i];
+
+    FREE(old);
+}
+
+/*
+ * FNV-1a over the fields of a key.
+ */
+static uint64_t hash_key(const Key *key)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    uint64_t fields[PROFILE_DEPTH + 4] = {key->generation, key->depth, key->pc,
+                                          key->opcode};
+    for (int i = 0; i < PROFILE_DEPTH; i++)
+        fields[4 + i] = key->jumps[i];
+
+    for (int i = 0; i < PROFILE_DEPTH + 4; i++) {
+        hash ^= fields[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+static bool key_equal(const Key *a, const Key *b)
+{
+    if (a->generation != b->generation || a->depth != b->depth ||
+        a->pc != b->pc || a->opcode != b->opcode)
+        return false;
+    for (int i = 0; i < PROFILE_DEPTH; i++)
+        if (a->jumps[i] != b->jumps[i])
+            return false;
+
+    return true;
+}
+
+static int compare_lines(const void *a, const void *b)
+{
+    return strcmp(((const Line *)a)->text, ((const Line *)b)->text);
+}
+
+static void handle_prof(int sig)
+{
+    (void)sig;
+
+    if (timer_profiler != NULL)
+        timer_profiler->due = 0;
+}
@@ -0,0 +1,139 @@
+#ifndef PROFILER_INCLUDED
+#define PROFILER_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * The number of recent jump targets kept as the pseudo call stack of a
+ * sample. A power of two, so that the ring of targets wraps cleanly.
+ */
+#define PROFILE_DEPTH 4
+
+/*
+ * A sampling profiler for UM programs. The executor takes a sample whenever
+ * its instruction count reaches due: every interval instructions, or, with a
+ * timer, at the next instruction after each SIGPROF. A sample is keyed by the
+ * pc and opcode of the instruction, the number of program loads so far (the
+ * generation) and the targets of the last few load program instructions,
+ * immediate repeats left out, which stand in for a call stack.
+ *
+ * The fields are public so that the executor's loops can check due and
+ * record jumps inline; only the executor should touch them.
+ */
+typedef struct Profiler {
+    volatile uint64_t due;
+    uint64_t interval; /* 0 when sampling on SIGPROF */
+    uint64_t generation;
+    uint32_t jumps[PROFILE_DEPTH]; /* ring, indexed by jump_count */
+    uint32_t jump_count;
+    uint64_t samples;
+    struct Stacks *stacks;
+} *Profiler;
+
+/*
+ * new_profiler
+ *
+ * @param  uint64_t interval    The number of instructions between samples,
+ *                              or 0 to sample only on the timer started by
+ *                              Profiler_start_timer
+ * @return Profiler             A profiler with no samples
+ */
+Profiler new_profiler(uint64_t interval);
+
+/*
+ * free_profiler
+ *
+ * Stops the profiler's timer, if it is running, and frees the profiler.
+ *
+ * @param  Profiler *profiler   A pointer to the profiler to free
+ * @expect The profiler is not NULL
+ */
+void free_profiler(Profiler *profiler);
+
+/*
+ * Profiler_start_timer
+ *
+ * Makes the profiler due for a sample hz times a second of CPU time, using
+ * ITIMER_PROF. Only one profiler may have a timer at a time, since it owns
+ * the SIGPROF handler.
+ *
+ * @param  Profiler profiler    The profiler to drive
+ * @param  unsigned hz          The sampling rate
+ * @return bool                 Whether the timer could be started
+ */
+bool Profiler_start_timer(Profiler profiler, unsigned hz);
+
+/*
+ * Profiler_stop_timer
+ *
+ * @param  Profiler profiler    The profiler whose timer to stop
+ */
+void Profiler_stop_timer(Profiler profiler);
+
+/*
+ * Profiler_sample
+ *
+ * Records a sample of the instruction about to be executed and schedules
+ * the next one.
+ *
+ * @param  Profiler profiler    The profiler to record into
+ * @param  uint32_t pc          The index of the instruction in segment 0
+ * @param  uint32_t opcode      Its opcode
+ * @param  uint64_t steps       The executor's instruction count
+ */
+void Profiler_sample(Profiler profiler, uint32_t pc, uint32_t opcode,
+                     uint64_t steps);
+
+/*
+ * Profiler_load
+ *
+ * Starts a new generation when a load program instruction installs new
+ * code. The jumps of the old program are forgotten.
+ *
+ * @param  Profiler profiler    The profiler to update
+ */
+void Profiler_load(Profiler profiler);
+
+/*
+ * Profiler_jump
+ *
+ * Records the target of a load program instruction. A jump to the same
+ * target as the last one, as at the head of a loop, is not recorded again.
+ *
+ * @param  Profiler profiler    The profiler to update
+ * @param  uint32_t target      The new program counter
+ */
+static inline void Profiler_jump(Profiler profiler, uint32_t target)
+{
+    uint32_t last = (profiler->jump_count - 1) % PROFILE_DEPTH;
+    if (profiler->jump_count > 0 && profiler->jumps[last] == target)
+        return;
+    profiler->jumps[profiler->jump_count++ % PROFILE_DEPTH] = target;
+}
+
+/*
+ * Profiler_samples
+ *
+ * @param  Profiler profiler    The profiler to query
+ * @return uint64_t             The number of samples taken so far
+ */
+uint64_t Profiler_samples(Profiler profiler);
+
+/*
+ * Profiler_write
+ *
+ * Writes the samples in the folded-stack format read by flame graph tools,
+ * one line per distinct stack, sorted: the generation, the jump targets
+ * oldest first, and the pc and opcode name, separated by semicolons and
+ * followed by a space and the number of samples. For example
+ *
+ *     gen1;0x2c;0x1f0:sload 12
+ *
+ * @param  Profiler profiler    The profiler to write out
+ * @param  FILE *fp             The stream to write to
+ */
+void Profiler_write(Profiler profiler, FILE *fp);
+
+#endif
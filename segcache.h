@@ -0,0 +1,152 @@
+#ifndef SEGCACHE_INCLUDED
+#define SEGCACHE_INCLUDED
+
+#include "memory.h"
+#include <stdint.h>
+
+/*
+ * A direct-mapped cache of recent segment lookups, from segment ID to the
+ * segment's data. Loops that hit the same few segments over and over then
+ * skip get_segment entirely. The data of a mapped segment never moves, so an
+ * entry only has to be forgotten when its segment is unmapped or, for
+ * segment 0, replaced by a load program instruction. Segments in a spill file
+ * are never cached, since the memory module has to see every use of them to
+ * keep the hot ones resident.
+ *
+ * Entries filled by SegCache_checked also remember the limit that
+ * checked_segment gave for the segment. A cache must be filled by only one of
+ * SegCache_lookup and SegCache_checked.
+ *
+ * The functions are inline because they sit on the hot path of every
+ * segmented load and store.
+ */
+#define SEG_CACHE_BITS 6
+#define SEG_CACHE_SIZE (1u << SEG_CACHE_BITS)
+#define SEG_CACHE_EMPTY UINT32_MAX /* never a segment ID */
+
+typedef struct SegCache {
+    struct {
+        uint32_t id;
+        uint32_t limit;
+        uint32_t *data;
+    } entries[SEG_CACHE_SIZE];
+    uint64_t hits;
+    uint64_t misses;
+} SegCache;
+
+/*
+ * Returns the slot for a segment ID. Arena IDs all have the same low bits,
+ * so every bit of the ID is mixed in by Fibonacci hashing.
+ */
+static inline uint32_t SegCache_slot(uint32_t id)
+{
+    return (id * 2654435769u) >> (32 - SEG_CACHE_BITS);
+}
+
+/*
+ * SegCache_clear
+ *
+ * Empties a cache and resets its counters.
+ *
+ * @param  SegCache *cache      The cache to clear
+ */
+static inline void SegCache_clear(SegCache *cache)
+{
+    for (uint32_t i = 0; i < SEG_CACHE_SIZE; i++) {
+        cache->entries[i].id = SEG_CACHE_EMPTY;
+        cache->entries[i].limit = 0;
+        cache->entries[i].data = NULL;
+    }
+    cache->hits = 0;
+    cache->misses = 0;
+}
+
+/*
+ * SegCache_lookup
+ *
+ * Returns the data of a segment, from the cache if possible.
+ *
+ * @param  SegCache *cache      The cache to look in
+ * @param  Memory mem           The memory module to fall back on
+ * @param  uint32_t id          The segment to look up
+ * @return uint32_t *           The data of the segment
+ * @expect The segment is mapped
+ */
+static inline uint32_t *SegCache_lookup(SegCache *cache, Memory mem,
+                                        uint32_t id)
+{
+    uint32_t slot = SegCache_slot(id);
+
+    if (cache->entries[slot].id == id) {
+        cache->hits++;
+        return cache->entries[slot].data;
+    }
+
+    cache->misses++;
+    uint32_t *data = segment_data(mem, id);
+    if (segment_spilled(mem, id))
+        return data;
+    cache->entries[slot].id = id;
+    cache->entries[slot].data = data;
+
+    return data;
+}
+
+/*
+ * SegCache_checked
+ *
+ * Returns the data of a segment, from the cache if possible, if the segment
+ * is mapped and the word index passes its limit. An index the limit lets
+ * through may still be out of bounds, but then accessing it faults on a guard
+ * page.
+ *
+ * @param  SegCache *cache      The cache to look in
+ * @param  Memory mem           The memory module to fall back on
+ * @param  uint32_t id          The segment to look up
+ * @param  uint32_t index       The word about to be accessed
+ * @return uint32_t *           The data of the segment, or NULL if the
+ *                              segment is not mapped or the index is out of
+ *                              bounds
+ */
+static inline uint32_t *SegCache_checked(SegCache *cache, Memory mem,
+                                         uint32_t id, uint32_t index)
+{
+    uint32_t slot = SegCache_slot(id);
+
+    if (cache->entries[slot].id == id) {
+        cache->hits++;
+        return index < cache->entries[slot].limit ? cache->entries[slot].data
+                                                  : NULL;
+    }
+
+    cache->misses++;
+    uint32_t limit;
+    uint32_t *data = checked_segment(mem, id, &limit);
+    if (data == NULL)
+        return NULL;
+    if (segment_spilled(mem, id))
+        return index < limit ? data : NULL;
+    cache->entries[slot].id = id;
+    cache->entries[slot].limit = limit;
+    cache->entries[slot].data = data;
+
+    return index < limit ? data : NULL;
+}
+
+/*
+ * SegCache_forget
+ *
+ * Drops the entry for a segment that is being unmapped or replaced.
+ *
+ * @param  SegCache *cache      The cache to update
+ * @param  uint32_t id          The segment to forget
+ */
+static inline void SegCache_forget(SegCache *cache, uint32_t id)
+{
+    uint32_t slot = SegCache_slot(id);
+
+    if (cache->entries[slot].id == id)
+        cache->entries[slot].id = SEG_CACHE_EMPTY;
+}
+
+#endif
@@ -0,0 +1,305 @@
+#include "specialized.h"
+#include "hugepages.h"
+#include <assert.h>
+#include <mem.h>
+#include <stdio.h>
+
+typedef SpecStatus (*Handler)(Specialized spec);
+
+struct Specialized {
+    uint32_t reg[8];
+    uint32_t pc;
+    uint32_t load_id;
+    Memory mem;
+    SegCache *segs;
+    Translation trans;
+    uint32_t length;
+    uint32_t *words;
+    bool check_stores;
+    const volatile sig_atomic_t *stop;
+    Handler *code;
+};
+
+static Handler handler_for(Instr instr, bool check_stores);
+static void patch(Specialized spec, uint32_t index, uint32_t word);
+
+/*
+ * Operand expansion. EACH_ABC(F) expands F(a, b, c) for all 512 register
+ * combinations, in the order of the index a * 64 + b * 8 + c. Opcodes with
+ * fewer operands use the smaller expansions and leave the rest at 0.
+ */
+#define EACH_C(F, a, b)                                                        \
+    F(a, b, 0) F(a, b, 1) F(a, b, 2) F(a, b, 3)                                \
+    F(a, b, 4) F(a, b, 5) F(a, b, 6) F(a, b, 7)
+#define EACH_BC(F, a)                                                          \
+    EACH_C(F, a, 0) EACH_C(F, a, 1) EACH_C(F, a, 2) EACH_C(F, a, 3)            \
+    EACH_C(F, a, 4) EACH_C(F, a, 5) EACH_C(F, a, 6) EACH_C(F, a, 7)
+#define EACH_ABC(F)                                                            \
+    EACH_BC(F, 0) EACH_BC(F, 1) EACH_BC(F, 2) EACH_BC(F, 3)                    \
+    EACH_BC(F, 4) EACH_BC(F, 5) EACH_BC(F, 6) EACH_BC(F, 7)
+#define EACH_A(F)                                                              \
+    F(0, 0, 0) F(1, 0, 0) F(2, 0, 0) F(3, 0, 0)                                \
+    F(4, 0, 0) F(5, 0, 0) F(6, 0, 0) F(7, 0, 0)
+
+/*
+ * DEFINE(name, body, a, b, c) defines the handler name_abc for one
+ * combination of operands, and ENTRY names it in a handler table. Bodies
+ * refer to register i as R(i), which becomes a fixed offset.
+ */
+#define R(i) spec->reg[i]
+
+#define DEFINE(name, body, a, b, c)                                            \
+    static SpecStatus name##_##a##b##c(Specialized spec)                       \
+    {                                                                          \
+        body;                                                                  \
+        return SPEC_CONT;                                                      \
+    }
+#define ENTRY(name, a, b, c) name##_##a##b##c,
+
+#define CMOV_BODY(a, b, c) if (R(c) != 0) R(a) = R(b)
+#define SLOD_BODY(a, b, c)                                                     \
+    R(a) = SegCache_lookup(spec->segs, spec->mem, R(b))[R(c)]
+#define SSTR_BODY(a, b, c)                                                     \
+    SegCache_lookup(spec->segs, spec->mem, R(a))[R(b)] = R(c);                 \
+    if (R(a) == 0)                                                             \
+        patch(spec, R(b), R(c))
+#define SSTU_BODY(a, b, c)                                                     \
+    SegCache_lookup(spec->segs, spec->mem, R(a))[R(b)] = R(c)
+#define ADTN_BODY(a, b, c) R(a) = R(b) + R(c)
+#define MULT_BODY(a, b, c) R(a) = R(b) * R(c)
+#define DVSN_BODY(a, b, c) R(a) = R(b) / R(c)
+#define NAND_BODY(a, b, c) R(a) = ~(R(b) & R(c))
+#define MSEG_BODY(a, b, c)                                                     \
+    R(b) = new_segment(spec->mem, R(c));                                       \
+    if (R(b) == 0)                                                             \
+        return SPEC_HALT
+#define USEG_BODY(a, b, c)                                                     \
+    remove_segment(spec->mem, R(c));                                           \
+    SegCache_forget(spec->segs, R(c))
+#define OUTP_BODY(a, b, c)                                                     \
+    assert(R(c) < 256);                                                        \
+    putc((char)R(c), stdout)
+#define INPT_BODY(a, b, c)                                                     \
+    int ch = getchar();                                                        \
+    assert(ch >= -1 && ch < 256);                                              \
+    R(c) = (ch == -1 ? ~(0u) : (uint32_t)ch)
+#define LODP_BODY(a, b, c)                                                     \
+    spec->pc = R(c);                                                           \
+    if (R(b) != 0) {                                                           \
+        spec->load_id = R(b);                                                  \
+        return SPEC_LOAD;                                                      \
+    }                                                                          \
+    if (*spec->stop)                                                           \
+        return SPEC_STOP
+#define LODV_BODY(a, b, c) R(a) = spec->words[spec->pc - 1] & 0x1FFFFFF
+
+#define DEFINE_CMOV(a, b, c) DEFINE(cmov, CMOV_BODY(a, b, c), a, b, c)
+#define DEFINE_SLOD(a, b, c) DEFINE(slod, SLOD_BODY(a, b, c), a, b, c)
+#define DEFINE_SSTR(a, b, c) DEFINE(sstr, SSTR_BODY(a, b, c), a, b, c)
+#define DEFINE_SSTU(a, b, c) DEFINE(sstu, SSTU_BODY(a, b, c), a, b, c)
+#define DEFINE_ADTN(a, b, c) DEFINE(adtn, ADTN_BODY(a, b, c), a, b, c)
+#define DEFINE_MULT(a, b, c) DEFINE(mult, MULT_BODY(a, b, c), a, b, c)
+#define DEFINE_DVSN(a, b, c) DEFINE(dvsn, DVSN_BODY(a, b, c), a, b, c)
+#define DEFINE_NAND(a, b, c) DEFINE(nand, NAND_BODY(a, b, c), a, b, c)
+#define DEFINE_MSEG(a, b, c) DEFINE(mseg, MSEG_BODY(a, b, c), a, b, c)
+#define DEFINE_USEG(a, b, c) DEFINE(useg, USEG_BODY(a, b, c), a, b, c)
+#define DEFINE_OUTP(a, b, c) DEFINE(outp, OUTP_BODY(a, b, c), a, b, c)
+#define DEFINE_INPT(a, b, c) DEFINE(inpt, INPT_BODY(a, b, c), a, b, c)
+#define DEFINE_LODP(a, b, c) DEFINE(lodp, LODP_BODY(a, b, c), a, b, c)
+#define DEFINE_LODV(a, b, c) DEFINE(lodv, LODV_BODY(a, b, c), a, b, c)
+
+#define ENTRY_CMOV(a, b, c) ENTRY(cmov, a, b, c)
+#define ENTRY_SLOD(a, b, c) ENTRY(slod, a, b, c)
+#define ENTRY_SSTR(a, b, c) ENTRY(sstr, a, b, c)
+#define ENTRY_SSTU(a, b, c) ENTRY(sstu, a, b, c)
+#define ENTRY_ADTN(a, b, c) ENTRY(adtn, a, b, c)
+#define ENTRY_MULT(a, b, c) ENTRY(mult, a, b, c)
+#define ENTRY_DVSN(a, b, c) ENTRY(dvsn, a, b, c)
+#define ENTRY_NAND(a, b, c) ENTRY(nand, a, b, c)
+#define ENTRY_MSEG(a, b, c) ENTRY(mseg, a, b, c)
+#define ENTRY_USEG(a, b, c) ENTRY(useg, a, b, c)
+#define ENTRY_OUTP(a, b, c) ENTRY(outp, a, b, c)
+#define ENTRY_INPT(a, b, c) ENTRY(inpt, a, b, c)
+#define ENTRY_LODP(a, b, c) ENTRY(lodp, a, b, c)
+#define ENTRY_LODV(a, b, c) ENTRY(lodv, a, b, c)
+
+EACH_ABC(DEFINE_CMOV)
+EACH_ABC(DEFINE_SLOD)
+EACH_ABC(DEFINE_SSTR)
+EACH_ABC(DEFINE_SSTU)
+EACH_ABC(DEFINE_ADTN)
+EACH_ABC(DEFINE_MULT)
+EACH_ABC(DEFINE_DVSN)
+EACH_ABC(DEFINE_NAND)
+EACH_BC(DEFINE_MSEG, 0)
+EACH_C(DEFINE_USEG, 0, 0)
+EACH_C(DEFINE_OUTP, 0, 0)
+EACH_C(DEFINE_INPT, 0, 0)
+EACH_BC(DEFINE_LODP, 0)
+EACH_A(DEFINE_LODV)
+
+static SpecStatus halt(Specialized spec)
+{
+    (void)spec;
+    return SPEC_HALT;
+}
+
+static SpecStatus stale(Specialized spec)
+{
+    spec->pc--;
+    return SPEC_STALE;
+}
+
+static SpecStatus invalid(Specialized spec)
+{
+    (void)spec;
+    assert(0);
+    return SPEC_HALT;
+}
+
+/* Handlers of the three-register opcodes 0 to 6, indexed by opcode */
+static const Handler three_register[7][512] = {
+    {EACH_ABC(ENTRY_CMOV)}, {EACH_ABC(ENTRY_SLOD)}, {EACH_ABC(ENTRY_SSTR)},
+    {EACH_ABC(ENTRY_ADTN)}, {EACH_ABC(ENTRY_MULT)}, {EACH_ABC(ENTRY_DVSN)},
+    {EACH_ABC(ENTRY_NAND)}};
+
+/* Segmented stores that leave segment 0 writes to the client */
+static const Handler unchecked_sstr[512] = {EACH_ABC(ENTRY_SSTU)};
+
+static const Handler mseg_handlers[64] = {EACH_BC(ENTRY_MSEG, 0)};
+static const Handler useg_handlers[8] = {EACH_C(ENTRY_USEG, 0, 0)};
+static const Handler outp_handlers[8] = {EACH_C(ENTRY_OUTP, 0, 0)};
+static const Handler inpt_handlers[8] = {EACH_C(ENTRY_INPT, 0, 0)};
+static const Handler lodp_handlers[64] = {EACH_BC(ENTRY_LODP, 0)};
+static const Handler lodv_handlers[8] = {EACH_A(ENTRY_LODV)};
+
+/*
+ * The size in bytes of the handler array for a program of the given length.
+ */
+static size_t code_size(uint32_t length)
+{
+    return (size_t)(length > 0 ? length : 1) * sizeof(Handler);
+}
+
+Specialized new_specialized(Translation trans, Memory mem, SegCache *segs,
+                            bool check_stores,
+                            const volatile sig_atomic_t *stop)
+{
+    assert(trans != NULL && mem != NULL);
+
+    Specialized spec;
+    NEW(spec);
+
+    spec->pc = 0;
+    spec->load_id = 0;
+    spec->mem = mem;
+    spec->segs = segs;
+    spec->trans = trans;
+    spec->length = trans->length;
+    spec->words = get_segment(mem, 0)->data;
+    spec->check_stores = check_stores;
+    spec->stop = stop;
+    spec->code = HugePages_alloc(code_size(trans->length));
+
+    for (uint32_t i = 0; i < trans->length; i++)
+        spec->code[i] = handler_for(trans->code[i], check_stores);
+
+    return spec;
+}
+
+void free_specialized(Specialized *spec)
+{
+    assert(spec != NULL && *spec != NULL);
+
+    HugePages_free((*spec)->code, code_size((*spec)->length));
+    FREE(*spec);
+}
+
+SpecStatus Specialized_run(Specialized spec, uint32_t *registers, uint32_t *pc,
+                           uint32_t *load_id, uint64_t *steps)
+{
+    assert(spec != NULL);
+
+    for (int i = 0; i < 8; i++)
+        spec->reg[i] = registers[i];
+    spec->pc = *pc;
+
+    Handler *code = spec->code;
+    uint64_t count = 0;
+    SpecStatus status;
+    do {
+        status = code[spec->pc++](spec);
+        count++;
+    } while (status == SPEC_CONT);
+
+    // A stale handler does not count as an instruction
+    if (status == SPEC_STALE)
+        count--;
+
+    for (int i = 0; i < 8; i++)
+        registers[i] = spec->reg[i];
+    *pc = spec->pc;
+    *load_id = spec->load_id;
+    *steps += count;
+
+    return status;
+}
+
+void Specialized_invalidate(Specialized spec, uint32_t first, uint32_t count)
+{
+    for (uint32_t i = first; i < first + count; i++)
+        spec->code[i] = stale;
+}
+
+void Specialized_refresh(Specialized spec, uint32_t first, uint32_t count)
+{
+    assert(spec != NULL);
+
+    for (uint32_t i = first; i < first + count; i++)
+        spec->code[i] = handler_for(spec->trans->code[i], spec->check_stores);
+}
+
+/*
+ * Picks the handler generated for a decoded instruction.
+ */
+static Handler handler_for(Instr instr, bool check_stores)
+{
+    unsigned a = instr.ra, b = instr.rb, c = instr.rc;
+
+    switch (instr.opcode) {
+    case 2:
+        if (!check_stores)
+            return unchecked_sstr[a * 64 + b * 8 + c];
+        return three_register[2][a * 64 + b * 8 + c];
+    case 7:
+        return halt;
+    case 8:
+        return mseg_handlers[b * 8 + c];
+    case 9:
+        return useg_handlers[c];
+    case 10:
+        return outp_handlers[c];
+    case 11:
+        return inpt_handlers[c];
+    case 12:
+        return lodp_handlers[b * 8 + c];
+    case 13:
+        return lodv_handlers[a];
+    case INSTR_STALE:
+        return stale;
+    default:
+        if (instr.opcode < 7)
+            return three_register[instr.opcode][a * 64 + b * 8 + c];
+        return invalid;
+    }
+}
+
+/*
+ * Keeps the translation and the handler stream in step with a store into
+ * segment 0.
+ */
+static void patch(Specialized spec, uint32_t index, uint32_t word)
+{
+    Translation_patch(spec->trans, index, word);
+    spec->code[index] = handler_for(spec->trans->code[index], true);
+}
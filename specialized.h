@@ -0,0 +1,110 @@
+#ifndef SPECIALIZED_INCLUDED
+#define SPECIALIZED_INCLUDED
+
+#include "memory.h"
+#include "segcache.h"
+#include "translation.h"
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * The specialized engine. Every instruction of segment 0 is replaced by the
+ * address of a handler generated for its exact opcode and register operands
+ * (8x8x8 handlers per three-register opcode), so executing it involves no
+ * decoding and no register indexing at run time. Load value handlers read
+ * their value straight from segment 0.
+ */
+typedef struct Specialized *Specialized;
+
+typedef enum SpecStatus {
+    SPEC_CONT,
+    SPEC_HALT,
+    SPEC_LOAD,
+    SPEC_STALE,
+    SPEC_STOP
+} SpecStatus;
+
+/*
+ * new_specialized
+ *
+ * Builds the handler stream for a translated program segment.
+ *
+ * @param  Translation trans    The translation of segment 0. Stores into
+ *                              segment 0 keep it up to date as well.
+ * @param  Memory mem           The memory module holding segment 0
+ * @param  SegCache *segs       The segment lookup cache to use; the client
+ *                              forgets segment 0 when it replaces it
+ * @param  bool check_stores    Whether segmented stores check for writes to
+ *                              segment 0 and patch the stream. Without the
+ *                              check, the client must detect such writes
+ *                              itself and invalidate the affected handlers.
+ * @param  sig_atomic_t *stop   A flag checked at every jump within segment
+ *                              0, which stops the stream when it is nonzero
+ * @return Specialized          The new handler stream
+ * @expect Segment 0 of mem is the segment trans was built from
+ */
+Specialized new_specialized(Translation trans, Memory mem, SegCache *segs,
+                            bool check_stores,
+                            const volatile sig_atomic_t *stop);
+
+/*
+ * free_specialized
+ *
+ * Frees a handler stream. The translation it was built from is not freed.
+ *
+ * @param  Specialized *spec    A pointer to the stream to free
+ * @expect The stream is not NULL
+ */
+void free_specialized(Specialized *spec);
+
+/*
+ * Specialized_run
+ *
+ * Runs the handler stream from the given program counter until the program
+ * halts or a load program instruction replaces segment 0.
+ *
+ * @param  Specialized spec     The stream to run
+ * @param  uint32_t *registers  The 8 registers; they are copied into the
+ *                              stream on entry and back out on return
+ * @param  uint32_t *pc         The program counter, updated on return
+ * @param  uint32_t *load_id    Set to the segment to load when SPEC_LOAD is
+ *                              returned
+ * @param  uint64_t *steps      Incremented once per instruction executed
+ * @return SpecStatus           SPEC_HALT if the program halted, SPEC_LOAD if
+ *                              it asked for *load_id to be loaded (*pc is
+ *                              then already the new program counter), or
+ *                              SPEC_STALE if the instruction at *pc has been
+ *                              invalidated and must be refreshed first, or
+ *                              SPEC_STOP if the stop flag was found set at a
+ *                              jump (*pc is then the jump's target)
+ */
+SpecStatus Specialized_run(Specialized spec, uint32_t *registers, uint32_t *pc,
+                           uint32_t *load_id, uint64_t *steps);
+
+/*
+ * Specialized_invalidate
+ *
+ * Replaces a run of handlers with one that stops the stream with SPEC_STALE.
+ * Only plain stores are involved, so this may be called from a signal
+ * handler.
+ *
+ * @param  Specialized spec     The stream to update
+ * @param  uint32_t first       The index of the first stale handler
+ * @param  uint32_t count       The number of stale handlers
+ */
+void Specialized_invalidate(Specialized spec, uint32_t first, uint32_t count);
+
+/*
+ * Specialized_refresh
+ *
+ * Rebuilds a run of handlers from the translation the stream was built from.
+ *
+ * @param  Specialized spec     The stream to update
+ * @param  uint32_t first       The index of the first handler to rebuild
+ * @param  uint32_t count       The number of handlers to rebuild
+ * @expect The translation of these instructions is up to date
+ */
+void Specialized_refresh(Specialized spec, uint32_t first, uint32_t count);
+
+#endif
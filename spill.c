@@ -0,0 +1,174 @@
+#define _GNU_SOURCE /* fallocate */
+#include "spill.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <mem.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define PATH_LEN 4096
+
+/*
+ * Older kernels cannot be asked to page out; dropping the mapping's pages
+ * still lets the kernel write them back and reclaim them.
+ */
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT MADV_DONTNEED
+#endif
+
+struct SpillSegment {
+    uint32_t *data;
+    size_t bytes; /* whole pages */
+    off_t offset;
+    bool resident;
+    SpillSegment prev, next;
+};
+
+struct Spill {
+    int fd;
+    off_t end;
+    size_t budget;
+    size_t resident;
+    SpillSegment hottest, coldest; /* resident segments only */
+    uint64_t pageouts;
+};
+
+static void unlink_segment(Spill spill, SpillSegment seg);
+static void push_hottest(Spill spill, SpillSegment seg);
+
+Spill new_spill(const char *dir, uint64_t budget)
+{
+    assert(dir != NULL);
+
+    char path[PATH_LEN];
+    snprintf(path, sizeof(path), "%s/um-spill-XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return NULL;
+    unlink(path);
+
+    Spill spill;
+    NEW(spill);
+
+    spill->fd = fd;
+    spill->end = 0;
+    spill->budget = budget * sizeof(uint32_t);
+    spill->resident = 0;
+    spill->hottest = NULL;
+    spill->coldest = NULL;
+    spill->pageouts = 0;
+
+    return spill;
+}
+
+void free_spill(Spill *spill)
+{
+    assert(spill != NULL && *spill != NULL);
+
+    close((*spill)->fd);
+    FREE(*spill);
+}
+
+SpillSegment Spill_alloc(Spill spill, uint32_t size, uint32_t **data)
+{
+    assert(spill != NULL);
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t bytes = ((size_t)(size > 0 ? size : 1) * sizeof(uint32_t) + page - 1)
+                   / page * page;
+
+    // Growing the file leaves the new extent reading as zero
+    off_t offset = spill->end;
+    if (ftruncate(spill->fd, offset + bytes) != 0)
+        return NULL;
+    void *mapping = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         spill->fd, offset);
+    if (mapping == MAP_FAILED)
+        return NULL;
+    spill->end += bytes;
+
+    SpillSegment seg;
+    NEW(seg);
+    seg->data = mapping;
+    seg->bytes = bytes;
+    seg->offset = offset;
+    seg->resident = false;
+    Spill_touch(spill, seg);
+
+    *data = seg->data;
+    return seg;
+}
+
+void Spill_free(Spill spill, SpillSegment seg)
+{
+    assert(spill != NULL && seg != NULL);
+
+    if (seg->resident)
+        unlink_segment(spill, seg);
+    munmap(seg->data, seg->bytes);
+
+    // The file only grows, but freed extents take no space on disk
+    fallocate(spill->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+              seg->offset, seg->bytes);
+    FREE(seg);
+}
+
+void Spill_touch(Spill spill, SpillSegment seg)
+{
+    assert(spill != NULL && seg != NULL);
+
+    if (spill->hottest == seg)
+        return;
+    if (seg->resident)
+        unlink_segment(spill, seg);
+    push_hottest(spill, seg);
+
+    // The segment just touched stays resident whatever its size
+    while (spill->resident > spill->budget && spill->coldest != seg) {
+        SpillSegment cold = spill->coldest;
+        madvise(cold->data, cold->bytes, MADV_PAGEOUT);
+        unlink_segment(spill, cold);
+        spill->pageouts++;
+    }
+}
+
+uint64_t Spill_pageouts(Spill spill)
+{
+    assert(spill != NULL);
+    return spill->pageouts;
+}
+
+/*
+ * Takes a resident segment off the list.
+ */
+static void unlink_segment(Spill spill, SpillSegment seg)
+{
+    if (seg->prev != NULL)
+        seg->prev->next = seg->next;
+    else
+        spill->hottest = seg->next;
+    if (seg->next != NULL)
+        seg->next->prev = seg->prev;
+    else
+        spill->coldest = seg->prev;
+
+    seg->resident = false;
+    spill->resident -= seg->bytes;
+}
+
+static void push_hottest(Spill spill, SpillSegment seg)
+{
+    seg->prev = NULL;
+    seg->next = spill->hottest;
+    if (spill->hottest != NULL)
+        spill->hottest->prev = seg;
+    else
+        spill->coldest = seg;
+    spill->hottest = seg;
+
+    seg->resident = true;
+    spill->resident += seg->bytes;
+}
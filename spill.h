@@ -0,0 +1,97 @@
+#ifndef SPILL_INCLUDED
+#define SPILL_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A scratch file that large segments can live in instead of anonymous
+ * memory. Each segment is a shared mapping of its own extent of the file, so
+ * its data never moves, and under memory pressure the kernel can write its
+ * pages back to the file rather than run out of memory.
+ *
+ * On top of that the spill keeps its own budget of resident words. Segments
+ * are kept in least recently used order, a segment counting as used whenever
+ * the memory module looks it up, and when the segments in use add up to more
+ * than the budget the coldest are paged out to the file. Touching a paged-out
+ * segment again just faults its pages back in.
+ *
+ * The file is unlinked as soon as it is created, so nothing is left behind.
+ */
+typedef struct Spill *Spill;
+typedef struct SpillSegment *SpillSegment;
+
+/*
+ * Segments smaller than this many words are not worth a mapping of their
+ * own.
+ */
+#define SPILL_THRESHOLD 16384
+
+/*
+ * new_spill
+ *
+ * Creates a scratch file in the given directory.
+ *
+ * @param  char *dir            The directory to create the file in
+ * @param  uint64_t budget      The number of words of spill segments to keep
+ *                              resident
+ * @return Spill                The new spill, or NULL if no file could be
+ *                              created
+ */
+Spill new_spill(const char *dir, uint64_t budget);
+
+/*
+ * free_spill
+ *
+ * Closes the scratch file and sets the client's pointer to NULL.
+ *
+ * @param  Spill *spill         A pointer to the spill to free
+ * @expect The spill is not NULL
+ * @expect Every segment has been released with Spill_free
+ */
+void free_spill(Spill *spill);
+
+/*
+ * Spill_alloc
+ *
+ * Maps a new zeroed segment from the end of the scratch file.
+ *
+ * @param  Spill spill          The spill to allocate from
+ * @param  uint32_t size        The size of the segment in words
+ * @param  uint32_t **data      Set to the segment's data
+ * @return SpillSegment         The segment, or NULL if the file could not
+ *                              grow or be mapped
+ */
+SpillSegment Spill_alloc(Spill spill, uint32_t size, uint32_t **data);
+
+/*
+ * Spill_free
+ *
+ * Unmaps a segment and gives its extent of the file back to the file system.
+ *
+ * @param  Spill spill          The spill the segment came from
+ * @param  SpillSegment seg     The segment to free
+ */
+void Spill_free(Spill spill, SpillSegment seg);
+
+/*
+ * Spill_touch
+ *
+ * Marks a segment as the most recently used, paging out the coldest segments
+ * if that takes the resident words over budget.
+ *
+ * @param  Spill spill          The spill the segment came from
+ * @param  SpillSegment seg     The segment being used
+ */
+void Spill_touch(Spill spill, SpillSegment seg);
+
+/*
+ * Spill_pageouts
+ *
+ * @param  Spill spill          The spill to query
+ * @return uint64_t             The number of times a segment has been paged
+ *                              out to the file
+ */
+uint64_t Spill_pageouts(Spill spill);
+
+#endif
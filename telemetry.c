@@ -0,0 +1,180 @@
+#include "telemetry.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <mem.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TELEMETRY_MAGIC 0x4d4c4554u /* "TELM" */
+#define TELEMETRY_VERSION 1u
+#define NAME_LENGTH 64
+#define WINDOW_MS 1000
+
+struct Telemetry {
+    TelemetryPage *page;
+    char name[NAME_LENGTH];
+    uint64_t window_ms; /* when the current rate window started */
+    uint64_t window_steps;
+};
+
+#define STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static void page_name(pid_t pid, char *name);
+static uint64_t now_ms(clockid_t clock);
+
+Telemetry new_telemetry(const char *program)
+{
+    assert(program != NULL);
+
+    char name[NAME_LENGTH];
+    page_name(getpid(), name);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, sizeof(TelemetryPage)) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    TelemetryPage *page = mmap(NULL, sizeof(TelemetryPage),
+                               PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    // The page starts zeroed; the magic number goes in last
+    page->version = TELEMETRY_VERSION;
+    page->pid = getpid();
+    strncpy(page->program, program, TELEMETRY_PROGRAM - 1);
+    __atomic_store_n(&page->magic, TELEMETRY_MAGIC, __ATOMIC_RELEASE);
+
+    Telemetry telemetry;
+    NEW(telemetry);
+    telemetry->page = page;
+    strcpy(telemetry->name, name);
+    telemetry->window_ms = now_ms(CLOCK_MONOTONIC);
+    telemetry->window_steps = 0;
+
+    return telemetry;
+}
+
+void free_telemetry(Telemetry *telemetry)
+{
+    assert(telemetry != NULL && *telemetry != NULL);
+
+    munmap((*telemetry)->page, sizeof(TelemetryPage));
+    shm_unlink((*telemetry)->name);
+    FREE(*telemetry);
+}
+
+void Telemetry_publish(Telemetry telemetry, const TelemetrySample *sample)
+{
+    assert(telemetry != NULL && sample != NULL);
+    TelemetryPage *page = telemetry->page;
+
+    // The rate is only worked out once a window is a second old, so that
+    // it does not jump about with every publication
+    uint64_t now = now_ms(CLOCK_MONOTONIC);
+    uint64_t elapsed = now - telemetry->window_ms;
+    bool new_rate = elapsed >= WINDOW_MS;
+    uint64_t ips = 0;
+    if (new_rate) {
+        ips = (sample->steps - telemetry->window_steps) * 1000 / elapsed;
+        telemetry->window_ms = now;
+        telemetry->window_steps = sample->steps;
+    }
+
+    uint64_t sequence = page->sequence;
+    STORE(page->sequence, sequence + 1);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    STORE(page->state, (uint64_t)sample->state);
+    STORE(page->steps, sample->steps);
+    if (new_rate)
+        STORE(page->ips, ips);
+    else if (sample->state != VM_RUNNING)
+        STORE(page->ips, (uint64_t)0);
+    STORE(page->live_segments, sample->live_segments);
+    STORE(page->live_words, sample->live_words);
+    STORE(page->jumps, sample->jumps);
+    STORE(page->input_bytes, sample->input_bytes);
+    STORE(page->output_bytes, sample->output_bytes);
+    STORE(page->updated_ms, now_ms(CLOCK_REALTIME));
+
+    __atomic_store_n(&page->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+const TelemetryPage *open_telemetry(pid_t pid)
+{
+    char name[NAME_LENGTH];
+    page_name(pid, name);
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    TelemetryPage *page =
+        mmap(NULL, sizeof(TelemetryPage), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return page == MAP_FAILED ? NULL : page;
+}
+
+void close_telemetry(const TelemetryPage **page)
+{
+    assert(page != NULL && *page != NULL);
+
+    munmap((void *)*page, sizeof(TelemetryPage));
+    *page = NULL;
+}
+
+bool Telemetry_snapshot(const TelemetryPage *page, TelemetryPage *copy)
+{
+    assert(page != NULL && copy != NULL);
+
+    if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != TELEMETRY_MAGIC ||
+        page->version != TELEMETRY_VERSION)
+        return false;
+
+    uint64_t before, after;
+    do {
+        before = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+        copy->state = LOAD(page->state);
+        copy->steps = LOAD(page->steps);
+        copy->ips = LOAD(page->ips);
+        copy->live_segments = LOAD(page->live_segments);
+        copy->live_words = LOAD(page->live_words);
+        copy->jumps = LOAD(page->jumps);
+        copy->input_bytes = LOAD(page->input_bytes);
+        copy->output_bytes = LOAD(page->output_bytes);
+        copy->updated_ms = LOAD(page->updated_ms);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = LOAD(page->sequence);
+    } while (before != after || (before & 1) != 0);
+
+    copy->magic = page->magic;
+    copy->version = page->version;
+    copy->sequence = before;
+    copy->pid = page->pid;
+    memcpy(copy->program, page->program, TELEMETRY_PROGRAM);
+
+    return before > 0;
+}
+
+static void page_name(pid_t pid, char *name)
+{
+    snprintf(name, NAME_LENGTH, "/" TELEMETRY_PREFIX "%ld", (long)pid);
+}
+
+static uint64_t now_ms(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,126 @@
+#ifndef TELEMETRY_INCLUDED
+#define TELEMETRY_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Live counters of a running VM, published in a page of POSIX shared memory
+ * named after its process ID so that umtop can watch it without stopping
+ * it. The executor publishes every TELEMETRY_INTERVAL_MS, at its next load
+ * program instruction. Every field of the page is written with relaxed
+ * atomic stores, between two increments of a sequence number that is odd
+ * while an update is in progress, so that readers can take a consistent
+ * snapshot.
+ */
+#define TELEMETRY_INTERVAL_MS 250
+#define TELEMETRY_PREFIX "um-telemetry."
+#define TELEMETRY_PROGRAM 64
+
+typedef struct Telemetry *Telemetry;
+
+typedef enum VMState {
+    VM_RUNNING,
+    VM_HALTED,
+    VM_STOPPED, /* by a limit or Executor_cancel */
+    VM_FAILED   /* by a machine failure in safe mode */
+} VMState;
+
+/*
+ * What the executor publishes.
+ */
+typedef struct TelemetrySample {
+    VMState state;
+    uint64_t steps;
+    uint64_t live_segments;
+    uint64_t live_words;
+    uint64_t jumps; /* load program instructions */
+    uint64_t input_bytes;
+    uint64_t output_bytes;
+} TelemetrySample;
+
+/*
+ * The shared page.
+ */
+typedef struct TelemetryPage {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sequence;
+    int64_t pid;
+    uint64_t state;
+    uint64_t steps;
+    uint64_t ips; /* instructions a second over the last whole second */
+    uint64_t live_segments;
+    uint64_t live_words;
+    uint64_t jumps;
+    uint64_t input_bytes;
+    uint64_t output_bytes;
+    uint64_t updated_ms; /* CLOCK_REALTIME of the last update */
+    char program[TELEMETRY_PROGRAM];
+} TelemetryPage;
+
+/*
+ * new_telemetry
+ *
+ * Creates the shared page of the calling process.
+ *
+ * @param  char *program        The name of the program being run, shown by
+ *                              umtop; truncated to fit
+ * @return Telemetry            The publisher, or NULL if the shared memory
+ *                              could not be created
+ */
+Telemetry new_telemetry(const char *program);
+
+/*
+ * free_telemetry
+ *
+ * Unmaps the page and removes it, so that it no longer shows in umtop.
+ *
+ * @param  Telemetry *telemetry A pointer to the publisher to free
+ * @expect The publisher is not NULL
+ */
+void free_telemetry(Telemetry *telemetry);
+
+/*
+ * Telemetry_publish
+ *
+ * Updates the page, working out the instruction rate from the samples of
+ * the last second.
+ *
+ * @param  Telemetry telemetry      The publisher
+ * @param  TelemetrySample *sample  The current counters
+ */
+void Telemetry_publish(Telemetry telemetry, const TelemetrySample *sample);
+
+/*
+ * open_telemetry
+ *
+ * Maps the page of another process for reading.
+ *
+ * @param  pid_t pid                The process to watch
+ * @return TelemetryPage *          Its page, or NULL if it has none
+ */
+const TelemetryPage *open_telemetry(pid_t pid);
+
+/*
+ * close_telemetry
+ *
+ * @param  TelemetryPage **page     A pointer to the page to unmap
+ * @expect The page is not NULL
+ */
+void close_telemetry(const TelemetryPage **page);
+
+/*
+ * Telemetry_snapshot
+ *
+ * Copies a page, retrying while it is being updated.
+ *
+ * @param  TelemetryPage *page      The page to read
+ * @param  TelemetryPage *copy      Set to a consistent copy of it
+ * @return bool                     Whether the page holds published
+ *                                  counters
+ */
+bool Telemetry_snapshot(const TelemetryPage *page, TelemetryPage *copy);
+
+#endif
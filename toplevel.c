@@ -1,10 +1,26 @@
+#include "branch.h"
+#include "checkpoint.h"
+#include "compiler.h"
 #include "executor.h"
+#include "hugepages.h"
+#include "instrtrace.h"
 #include "memory.h"
+#include "memtrace.h"
+#include "profiler.h"
+#include "telemetry.h"
+#include "transcache.h"
+#include "translation.h"
+#include <getopt.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 void print_prog(uint32_t *prog, uint32_t len)
 {
@@ -20,29 +36,23 @@ void print_state_of_affairs(uint32_t instruction, uint32_t *registers)
     }
 }
 
-int main(int argc, char *argv[])
+/*
+ * Reads a program file into memory allocated with HugePages_alloc, setting
+ * size to its length in words. Returns NULL if the file cannot be opened.
+ */
+static uint32_t *load_program(const char *path, size_t *size)
 {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <program>\n", argv[0]);
-        return EXIT_FAILURE;
-    }
-
-    char *program = argv[1];
-    FILE *fp = fopen(program, "rb");
-
-    if (fp == NULL) {
-        fprintf(stderr, "Could not open file %s\n", program);
-        return EXIT_FAILURE;
-    }
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return NULL;
 
     // Get the size of the file
     struct stat st;
-    stat(program, &st);
-    size_t size = st.st_size / 4;
+    stat(path, &st);
+    *size = st.st_size / 4;
 
-    uint32_t *prog = malloc(size * sizeof(uint32_t));
-
-    for (size_t i = 0; i < size; i++) {
+    uint32_t *prog = HugePages_alloc(*size * sizeof(uint32_t));
+    for (size_t i = 0; i < *size; i++) {
         uint8_t in = fgetc(fp);
         uint32_t out = in << 24;
         in = fgetc(fp);
@@ -55,31 +65,876 @@ int main(int argc, char *argv[])
     }
     fclose(fp);
 
+    return prog;
+}
+
+/*
+ * Command line options, filled in by parse_options.
+ */
+typedef struct Options {
+    Engine engine;
+    char *cache_dir;
+    bool single_threaded;
+    bool write_protect;
+    bool arena;
+    bool huge_pages;
+    uint64_t quota;
+    char *spill_dir;
+    uint64_t spill_budget;
+    bool safe;
+    bool fast_exit;
+    char *profile_file;
+    uint64_t profile_every;
+    char *trace_mem_file;
+    char *trace_file;
+    uint64_t max_steps;
+    uint64_t timeout; /* in ms */
+    bool telemetry;
+    bool stats;
+    char **branches; /* input files to branch on at the end of input */
+    int branch_count;
+    int jobs;
+    char *checkpoint_file;
+    uint64_t checkpoint_every; /* in ms */
+    char *restore_file;
+    char *boot_dir;
+} Options;
+
+/* 256 MiB of spilled segments stay resident unless told otherwise */
+#define DEFAULT_SPILL_BUDGET (64u << 20)
+
+/* Samples a second of CPU time, when not sampling by instruction count */
+#define PROFILE_HZ 1000
+
+/* A checkpoint a minute unless told otherwise */
+#define DEFAULT_CHECKPOINT_EVERY 60000
+
+static void usage(char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [--engine=handlers|predecoded|specialized]\n"
+            "          [--cache-dir=DIR] [--single-threaded] [--write-protect]\n"
+            "          [--memory=table|arena] [--huge-pages]\n"
+            "          [--memory-quota=WORDS] [--spill-dir=DIR]\n"
+            "          [--spill-budget=WORDS] [--safe] [--fast-exit]\n"
+            "          [--profile=FILE] [--profile-every=INSTRUCTIONS]\n"
+            "          [--trace-mem=FILE] [--trace=FILE]\n"
+            "          [--max-steps=INSTRUCTIONS] [--timeout=SECONDS]\n"
+            "          [--telemetry] [--stats]\n"
+            "          [--branch=FILE...] [--jobs=N]\n"
+            "          [--checkpoint=FILE] [--checkpoint-every=SECONDS]\n"
+            "          [--boot-cache=DIR]\n"
+            "          <program> | --restore=FILE\n",
+            name);
+}
+
+/*
+ * Parses a number of words. Returns false if arg is not a decimal number.
+ */
+static bool parse_words(const char *arg, uint64_t *words)
+{
+    char *end;
+    *words = strtoull(arg, &end, 10);
+
+    return *arg != '\0' && *end == '\0';
+}
+
+/*
+ * Parses a positive number of seconds, which may have a fraction, into
+ * milliseconds. Returns false if arg is not one.
+ */
+static bool parse_seconds(const char *arg, uint64_t *ms)
+{
+    char *end;
+    double seconds = strtod(arg, &end);
+    if (*arg == '\0' || *end != '\0' || !(seconds > 0) || seconds > 1e9)
+        return false;
+
+    *ms = (uint64_t)(seconds * 1000 + 0.5);
+    if (*ms == 0)
+        *ms = 1;
+    return true;
+}
+
+/*
+ * Parses the command line into opts. Returns false, after printing a
+ * diagnostic, if the command line is not valid.
+ */
+static bool parse_options(int argc, char *argv[], Options *opts)
+{
+    static struct option options[] = {
+        {"engine", required_argument, 0, 'e'},
+        {"cache-dir", required_argument, 0, 'c'},
+        {"single-threaded", no_argument, 0, 's'},
+        {"write-protect", no_argument, 0, 'w'},
+        {"memory", required_argument, 0, 'm'},
+        {"huge-pages", no_argument, 0, 'H'},
+        {"memory-quota", required_argument, 0, 'q'},
+        {"spill-dir", required_argument, 0, 'd'},
+        {"spill-budget", required_argument, 0, 'b'},
+        {"safe", no_argument, 0, 'F'},
+        {"fast-exit", no_argument, 0, 'x'},
+        {"profile", required_argument, 0, 'p'},
+        {"profile-every", required_argument, 0, 'P'},
+        {"trace-mem", required_argument, 0, 't'},
+        {"trace", required_argument, 0, 'T'},
+        {"max-steps", required_argument, 0, 'n'},
+        {"timeout", required_argument, 0, 'o'},
+        {"telemetry", no_argument, 0, 'l'},
+        {"stats", no_argument, 0, 'S'},
+        {"branch", required_argument, 0, 'B'},
+        {"jobs", required_argument, 0, 'j'},
+        {"checkpoint", required_argument, 0, 'k'},
+        {"checkpoint-every", required_argument, 0, 'K'},
+        {"restore", required_argument, 0, 'r'},
+        {"boot-cache", required_argument, 0, 'R'},
+        {0, 0, 0, 0}};
+
+    opts->engine = ENGINE_PREDECODED;
+    opts->cache_dir = NULL;
+    opts->single_threaded = false;
+    opts->write_protect = false;
+    opts->arena = false;
+    opts->huge_pages = false;
+    opts->quota = 0;
+    opts->spill_dir = NULL;
+    opts->spill_budget = DEFAULT_SPILL_BUDGET;
+    opts->safe = false;
+    opts->fast_exit = false;
+    opts->profile_file = NULL;
+    opts->profile_every = 0;
+    opts->trace_mem_file = NULL;
+    opts->trace_file = NULL;
+    opts->max_steps = UINT64_MAX;
+    opts->timeout = 0;
+    opts->telemetry = false;
+    opts->stats = false;
+    opts->branches = malloc(argc * sizeof(char *));
+    opts->branch_count = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    opts->jobs = cpus > 0 ? (int)cpus : 1;
+    opts->checkpoint_file = NULL;
+    opts->checkpoint_every = DEFAULT_CHECKPOINT_EVERY;
+    opts->restore_file = NULL;
+    opts->boot_dir = NULL;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case 'e':
+            if (!Engine_from_name(optarg, &opts->engine)) {
+                fprintf(stderr, "Unknown engine %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'c':
+            opts->cache_dir = optarg;
+            break;
+        case 's':
+            opts->single_threaded = true;
+            break;
+        case 'w':
+            opts->write_protect = true;
+            break;
+        case 'm':
+            if (strcmp(optarg, "arena") == 0)
+                opts->arena = true;
+            else if (strcmp(optarg, "table") != 0) {
+                fprintf(stderr, "Unknown memory backend %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'H':
+            opts->huge_pages = true;
+            break;
+        case 'q':
+            if (!parse_words(optarg, &opts->quota)) {
+                fprintf(stderr, "Invalid memory quota %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'd':
+            opts->spill_dir = optarg;
+            break;
+        case 'b':
+            if (!parse_words(optarg, &opts->spill_budget)) {
+                fprintf(stderr, "Invalid spill budget %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'F':
+            opts->safe = true;
+            break;
+        case 'x':
+            opts->fast_exit = true;
+            break;
+        case 'p':
+            opts->profile_file = optarg;
+            break;
+        case 'P':
+            if (!parse_words(optarg, &opts->profile_every) ||
+                opts->profile_every == 0) {
+                fprintf(stderr, "Invalid profile interval %s\n", optarg);
+                return false;
+            }
+            break;
+        case 't':
+            opts->trace_mem_file = optarg;
+            break;
+        case 'T':
+            opts->trace_file = optarg;
+            break;
+        case 'n':
+            if (!parse_words(optarg, &opts->max_steps)) {
+                fprintf(stderr, "Invalid step limit %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'o':
+            if (!parse_seconds(optarg, &opts->timeout)) {
+                fprintf(stderr, "Invalid timeout %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'l':
+            opts->telemetry = true;
+            break;
+        case 'S':
+            opts->stats = true;
+            break;
+        case 'B':
+            opts->branches[opts->branch_count++] = optarg;
+            break;
+        case 'j': {
+            uint64_t jobs;
+            if (!parse_words(optarg, &jobs) || jobs == 0 || jobs > 4096) {
+                fprintf(stderr, "Invalid number of jobs %s\n", optarg);
+                return false;
+            }
+            opts->jobs = (int)jobs;
+            break;
+        }
+        case 'k':
+            opts->checkpoint_file = optarg;
+            break;
+        case 'K':
+            if (!parse_seconds(optarg, &opts->checkpoint_every)) {
+                fprintf(stderr, "Invalid checkpoint interval %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'r':
+            opts->restore_file = optarg;
+            break;
+        case 'R':
+            opts->boot_dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return false;
+        }
+    }
+
+    // A restored run takes its program from the checkpoint
+    if (argc - optind != (opts->restore_file == NULL ? 1 : 0)) {
+        usage(argv[0]);
+        return false;
+    }
+
+    // Buffered files, timers and shared mappings would be shared by the
+    // branches or lost in them, and only the forking thread survives a fork
+    if (opts->branch_count > 0 &&
+        (opts->profile_file != NULL || opts->trace_mem_file != NULL ||
+         opts->trace_file != NULL || opts->timeout > 0 || opts->telemetry ||
+         opts->spill_dir != NULL || opts->checkpoint_file != NULL)) {
+        fprintf(stderr, "--branch cannot be combined with --profile, "
+                        "--trace-mem, --trace, --timeout, --telemetry, "
+                        "--spill-dir or --checkpoint\n");
+        return false;
+    }
+    if (opts->branch_count > 0)
+        opts->single_threaded = true;
+
+    // Traces of a run that skips its boot would not replay
+    if (opts->boot_dir != NULL &&
+        (opts->restore_file != NULL || opts->trace_mem_file != NULL ||
+         opts->trace_file != NULL)) {
+        fprintf(stderr, "--boot-cache cannot be combined with --restore, "
+                        "--trace-mem or --trace\n");
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Prints the memory module's counters to stderr.
+ */
+static void print_memory_stats(Memory memory)
+{
+    MemoryStats stats = memory_stats(memory);
+    fprintf(stderr,
+            "memory: %" PRIu64 " live segments, %" PRIu64 " live words, "
+            "%" PRIu64 " peak words, %" PRIu64 " maps, %" PRIu64 " unmaps, "
+            "%" PRIu64 " table slots\n",
+            stats.live_segments, stats.live_words, stats.peak_words, stats.maps,
+            stats.unmaps, stats.table_slots);
+    if (memory_pageouts(memory) > 0)
+        fprintf(stderr, "spill: %" PRIu64 " pageouts\n",
+                memory_pageouts(memory));
+}
+
+/*
+ * Prints the state of a run to stderr: the instruction count, the segment
+ * cache hit rate, memory use and the registers. Runs of the same program on
+ * different engines must print the same statistics.
+ */
+static void print_stats(Executor executor, Memory memory, uint32_t *registers)
+{
+    fprintf(stderr, "instructions: %" PRIu64 "\n", Executor_steps(executor));
+
+    uint64_t hits, misses;
+    Executor_segment_cache_stats(executor, &hits, &misses);
+    uint64_t lookups = hits + misses;
+    fprintf(stderr, "segment cache: %" PRIu64 " hits, %" PRIu64
+            " misses (%.2f%%)\n", hits, misses,
+            lookups == 0 ? 0.0 : 100.0 * hits / lookups);
+    print_memory_stats(memory);
+
+    // Depends on the engine, so only reported when asked for
+    if (HugePages_enabled())
+        fprintf(stderr, "huge pages: %zu kB requested, %ld kB backed\n",
+                HugePages_requested() / 1024, HugePages_backed());
+    fprintf(stderr, "registers:");
+    for (int i = 0; i < 8; i++)
+        fprintf(stderr, " %08" PRIx32, registers[i]);
+    fprintf(stderr, "\n");
+}
+
+/*
+ * What report_progress needs besides the executor.
+ */
+typedef struct Run {
+    Memory memory;
+    uint32_t *registers;
+    uint32_t *pc;
+} Run;
+
+/* The executor SIGUSR1 asks for a progress report */
+static Executor reported_executor = NULL;
+
+/*
+ * Only sets a flag: the executor calls report_progress from its own loop.
+ */
+static void request_report(int sig)
+{
+    (void)sig;
+    if (reported_executor != NULL)
+        Executor_request_report(reported_executor);
+}
+
+/*
+ * Prints a progress report to stderr: where the run is, its statistics and
+ * the load program targets it jumps to most.
+ */
+static void report_progress(Executor executor, const JumpCount *hottest,
+                            int count, void *cl)
+{
+    Run *run = cl;
+
+    fprintf(stderr, "report: pc %" PRIu32 "\n", *run->pc);
+    print_stats(executor, run->memory, run->registers);
+    fprintf(stderr, "hottest jumps:");
+    for (int i = 0; i < count; i++)
+        fprintf(stderr, " %" PRIu32 " (%" PRIu64 ")", hottest[i].target,
+                hottest[i].count);
+    fprintf(stderr, "\n");
+}
+
+/*
+ * Takes a checkpoint of a run. Standard output is flushed first, so that what
+ * the program wrote up to the checkpoint survives a crash after it.
+ */
+static void save_checkpoint(Checkpoint checkpoint, Executor executor,
+                            Run *run, const Options *opts)
+{
+    CheckpointState state;
+    memcpy(state.registers, run->registers, sizeof(state.registers));
+    state.pc = *run->pc;
+    state.steps = Executor_steps(executor);
+    state.input = ftell(stdin);
+    state.arena = memory_uses_arena(run->memory);
+
+    fflush(stdout);
+    if (!Checkpoint_save(checkpoint, run->memory, &state))
+        fprintf(stderr, "Could not write checkpoint %s\n",
+                opts->checkpoint_file);
+}
+
+/*
+ * Returns the milliseconds since start.
+ */
+static uint64_t ms_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000 +
+           (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Runs the program in slices of the checkpoint interval, each cut short by
+ * the time limit, and takes a checkpoint after each one. A run that stops
+ * short of halting for any other reason is checkpointed too, so that it can
+ * be resumed. The --timeout still applies to the run as a whole.
+ */
+static void run_with_checkpoints(Executor executor, Checkpoint checkpoint,
+                                 Run *run, const Options *opts)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (;;) {
+        uint64_t slice = opts->checkpoint_every;
+        uint64_t elapsed = ms_since(&start);
+        if (opts->timeout > 0 && opts->timeout < elapsed + slice)
+            slice = opts->timeout > elapsed ? opts->timeout - elapsed : 1;
+        if (!Executor_use_time_limit(executor, slice)) {
+            fprintf(stderr, "Could not start the checkpoint timer\n");
+            Executor_run(executor);
+            return;
+        }
+
+        Executor_run(executor);
+        Stop stopped = Executor_stopped(executor);
+        if (stopped == STOP_NONE)
+            return;
+        save_checkpoint(checkpoint, executor, run, opts);
+        if (stopped != STOP_TIMEOUT ||
+            (opts->timeout > 0 && ms_since(&start) >= opts->timeout))
+            return;
+    }
+}
+
+/*
+ * Returns the boot snapshot file for a program image in a directory, keyed
+ * by the image's hash and size and the kind of memory module, or NULL if the
+ * directory does not exist. A changed image gets a file of its own.
+ */
+static char *boot_path(const char *dir, const uint32_t *prog, size_t size,
+                       bool arena)
+{
+    struct stat st;
+    if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    size_t len = strlen(dir) + 64;
+    char *path = malloc(len);
+    snprintf(path, len, "%s/%016llx-%zu-%s.umboot", dir,
+             (unsigned long long)Translation_hash(prog, size), size,
+             arena ? "arena" : "table");
+
+    return path;
+}
+
+/*
+ * Follows a run up to its boot: the first load program instruction that
+ * installs new code, or the first input or output, which ends the boot
+ * early.
+ */
+typedef struct Boot {
+    Executor executor;
+    bool over;
+    bool io;
+} Boot;
+
+/*
+ * Both hooks stop the run at the end of the boot through its step limit,
+ * which the load program instruction checks right after its hook.
+ */
+static void boot_lodp(void *cl, uint64_t steps, uint32_t segment, uint32_t pc)
+{
+    Boot *boot = cl;
+    (void)pc;
+
+    if (segment != 0 && !boot->over) {
+        boot->over = true;
+        Executor_use_step_limit(boot->executor, steps);
+    }
+}
+
+static void boot_io(void *cl, uint64_t steps, bool output, int byte)
+{
+    Boot *boot = cl;
+    (void)output;
+    (void)byte;
+
+    boot->io = true;
+    if (!boot->over) {
+        boot->over = true;
+        Executor_use_step_limit(boot->executor, steps);
+    }
+}
+
+/*
+ * Runs a program up to its boot, with hooks that only cost anything until
+ * then, and saves a snapshot of the VM there if the program has done no
+ * input or output, since those would not happen again from the snapshot.
+ * Returns whether the run stopped at the boot and can carry on.
+ */
+static bool run_to_boot(Executor executor, Run *run, const char *path,
+                        uint64_t max_steps)
+{
+    Boot boot = {executor, false, false};
+    ExecutorHooks hooks = {NULL, boot_lodp, NULL, NULL, boot_io, &boot};
+    Executor_use_hooks(executor, &hooks);
+    Executor_run(executor);
+    Executor_use_hooks(executor, NULL);
+    Executor_use_step_limit(executor, max_steps);
+
+    if (!boot.over || Executor_stopped(executor) != STOP_STEPS)
+        return false;
+    if (!boot.io) {
+        CheckpointState state;
+        memcpy(state.registers, run->registers, sizeof(state.registers));
+        state.pc = *run->pc;
+        state.steps = Executor_steps(executor);
+        state.input = 0;
+        state.arena = memory_uses_arena(run->memory);
+
+        Checkpoint snapshot = new_checkpoint(path);
+        if (!Checkpoint_save(snapshot, run->memory, &state))
+            fprintf(stderr, "Could not write boot snapshot %s\n", path);
+        free_checkpoint(&snapshot);
+    }
+
+    return true;
+}
+
+/*
+ * Reports how each branch ended to stderr. Returns EXIT_SUCCESS if every
+ * one exited successfully.
+ */
+static int report_branches(Branch *branches, int count)
+{
+    int status = EXIT_SUCCESS;
+    for (int i = 0; i < count; i++) {
+        int ended = branches[i].status;
+        if (ended == -1)
+            fprintf(stderr, "branch %s: could not be started\n",
+                    branches[i].input);
+        else if (WIFEXITED(ended))
+            fprintf(stderr, "branch %s: exit %d, output in %s\n",
+                    branches[i].input, WEXITSTATUS(ended), branches[i].output);
+        else
+            fprintf(stderr, "branch %s: killed by signal %d\n",
+                    branches[i].input, WTERMSIG(ended));
+
+        if (ended == -1 || !WIFEXITED(ended) ||
+            WEXITSTATUS(ended) != EXIT_SUCCESS)
+            status = EXIT_FAILURE;
+    }
+
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    if (!parse_options(argc, argv, &opts))
+        return EXIT_FAILURE;
+
+    // Segment 0 is freed with HugePages_free
+    if (opts.huge_pages)
+        HugePages_enable();
+
+    // A restored run starts from the last checkpoint in the file, with the
+    // memory module set up for its segments
+    char *program;
+    uint32_t *prog;
+    size_t size;
+    CheckpointState restored;
+    Snapshot snapshot = NULL;
+    if (opts.restore_file != NULL) {
+        program = opts.restore_file;
+        snapshot = load_checkpoint(program, &restored);
+        if (snapshot == NULL) {
+            fprintf(stderr, "Could not read checkpoint %s\n", program);
+            return EXIT_FAILURE;
+        }
+        uint32_t words;
+        prog = Snapshot_program(snapshot, &words);
+        size = words;
+        opts.arena = opts.arena || restored.arena;
+    } else {
+        program = argv[optind];
+        prog = load_program(program, &size);
+        if (prog == NULL) {
+            fprintf(stderr, "Could not open file %s\n", program);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // A program that builds its real code before doing anything else, as the
+    // .umz images do, starts where it loads that code, from a snapshot saved
+    // by an earlier run of the same image; one taken with another kind of
+    // memory module would not fit, and one taken after the step limit would
+    // skip where the run should stop
+    char *boot_file = NULL;
+    bool booted = false;
+    if (opts.boot_dir != NULL) {
+        boot_file = boot_path(opts.boot_dir, prog, size, opts.arena);
+        if (boot_file == NULL)
+            fprintf(stderr, "Could not use boot cache directory %s\n",
+                    opts.boot_dir);
+        else
+            snapshot = load_checkpoint(boot_file, &restored);
+        if (snapshot != NULL && (restored.arena != opts.arena ||
+                                 restored.steps > opts.max_steps))
+            free_snapshot(&snapshot);
+        if (snapshot != NULL) {
+            HugePages_free(prog, size * sizeof(uint32_t));
+            uint32_t words;
+            prog = Snapshot_program(snapshot, &words);
+            size = words;
+            booted = true;
+        }
+    }
+
     // print_prog(prog, size);
 
     // Initialize the memory
     Memory memory = new_memory_module(prog, size);
+    if (opts.arena && !use_segment_arena(memory))
+        fprintf(stderr, "Could not reserve a segment arena\n");
+    set_memory_quota(memory, opts.quota);
+    if (opts.spill_dir != NULL &&
+        !use_spill_file(memory, opts.spill_dir, opts.spill_budget))
+        fprintf(stderr, "Could not create a spill file in %s\n",
+                opts.spill_dir);
     uint32_t *registers = malloc(8 * sizeof(uint32_t));
     for (int i = 0; i < 8; i++)
         registers[i] = 0;
     uint32_t pc = 0;
 
     Executor executor = new_executor(memory, registers, &pc);
+    Executor_use_engine(executor, opts.engine);
+    if (opts.write_protect && !Executor_use_write_protection(executor))
+        fprintf(stderr, "Could not enable write protection\n");
+    if (opts.safe && !Executor_use_safe_mode(executor))
+        fprintf(stderr, "Could not enable safe mode\n");
+    Executor_use_step_limit(executor, opts.max_steps);
+    if (opts.timeout > 0 && !Executor_use_time_limit(executor, opts.timeout))
+        fprintf(stderr, "Could not start the timeout timer\n");
 
-    // Run the program
-    Segment *program_segment;
-    uint32_t instruction;
-    Status status;
-    do {
-        program_segment = get_segment(memory, 0);
-        instruction = program_segment->data[pc++];
-        // print_state_of_affairs(instruction, registers);
-        status = Executor_process(executor, instruction);
-    } while (status != HALT);
+    // The rest of a restored run's segments go in once the memory module is
+    // set up, guard pages included, and input picks up where it was. The
+    // instruction count carries on too, so that the step limit and the
+    // statistics are those of a run that never stopped
+    if (snapshot != NULL) {
+        bool restored_all = Snapshot_restore(snapshot, memory);
+        free_snapshot(&snapshot);
+        if (!restored_all) {
+            fprintf(stderr, "Could not restore the segments of %s\n",
+                    booted ? boot_file : opts.restore_file);
+            return EXIT_FAILURE;
+        }
+        memcpy(registers, restored.registers, sizeof(restored.registers));
+        pc = restored.pc;
+        Executor_set_steps(executor, restored.steps);
+        if (restored.input > 0 && fseek(stdin, restored.input, SEEK_SET) != 0)
+            fprintf(stderr, "Could not seek standard input to offset %" PRId64
+                            "; resuming with it as it is\n",
+                    restored.input);
+        if (!booted)
+            fprintf(stderr, "Resuming at pc %" PRIu32 " after %" PRIu64
+                            " instructions\n", pc, restored.steps);
+    }
 
+    // An unusable cache directory just means running without a cache
+    TransCache cache = NULL;
+    if (opts.cache_dir != NULL) {
+        cache = new_trans_cache(opts.cache_dir);
+        if (cache == NULL)
+            fprintf(stderr, "Could not use cache directory %s\n",
+                    opts.cache_dir);
+    }
+    Executor_use_cache(executor, cache);
+
+    // Translate new code in the background unless asked not to
+    Compiler compiler = NULL;
+    if (!opts.single_threaded)
+        compiler = new_compiler(cache);
+    Executor_use_compiler(executor, compiler);
+
+    // Sample by instruction count if asked to, or else on a CPU time timer
+    Profiler profiler = NULL;
+    if (opts.profile_file != NULL) {
+        profiler = new_profiler(opts.profile_every);
+        if (opts.profile_every == 0 &&
+            !Profiler_start_timer(profiler, PROFILE_HZ))
+            fprintf(stderr, "Could not start the profiling timer\n");
+        Executor_use_profiler(executor, profiler);
+    }
+
+    MemTrace memtrace = NULL;
+    if (opts.trace_mem_file != NULL) {
+        memtrace = new_mem_trace(opts.trace_mem_file, size);
+        if (memtrace == NULL)
+            fprintf(stderr, "Could not create memory trace %s\n",
+                    opts.trace_mem_file);
+        Executor_use_mem_trace(executor, memtrace);
+    }
+
+    InstrTrace instrtrace = NULL;
+    if (opts.trace_file != NULL) {
+        instrtrace = new_instr_trace(opts.trace_file);
+        if (instrtrace == NULL)
+            fprintf(stderr, "Could not create trace %s\n", opts.trace_file);
+        Executor_use_instr_trace(executor, instrtrace);
+    }
+
+    // Publish live counters for umtop, under this process's ID
+    Telemetry telemetry = NULL;
+    if (opts.telemetry) {
+        telemetry = new_telemetry(program);
+        if (telemetry == NULL || !Executor_use_telemetry(executor, telemetry))
+            fprintf(stderr, "Could not publish telemetry\n");
+    }
+
+    // SIGUSR1 asks for a progress report instead of killing the run
+    Run run = {memory, registers, &pc};
+    Executor_use_reporter(executor, report_progress, &run);
+    reported_executor = executor;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_report;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGUSR1, &action, NULL) != 0)
+        fprintf(stderr, "Could not install the SIGUSR1 handler\n");
+
+    // Run the program, up to the end of its input if it is to branch there
+    if (opts.branch_count > 0)
+        Executor_stop_at_eof(executor, true);
+    Checkpoint checkpoint = NULL;
+    if (opts.checkpoint_file != NULL)
+        checkpoint = new_checkpoint(opts.checkpoint_file);
+    // A run that halted or stopped before its boot is over already
+    bool running = boot_file == NULL || booted ||
+                   run_to_boot(executor, &run, boot_file, opts.max_steps);
+    if (running && checkpoint != NULL)
+        run_with_checkpoints(executor, checkpoint, &run, &opts);
+    else if (running)
+        Executor_run(executor);
+
+    // Every branch carries on from there in a child of its own, reading its
+    // file, and the parent only reports how they ended; its statistics are
+    // those of the point of branching
+    int status = EXIT_SUCCESS;
+    bool branched = false;
+    if (opts.branch_count > 0 && Executor_stopped(executor) == STOP_INPUT) {
+        Branch *branches = malloc(opts.branch_count * sizeof(Branch));
+        for (int i = 0; i < opts.branch_count; i++) {
+            char *output = malloc(strlen(opts.branches[i]) + 5);
+            sprintf(output, "%s.out", opts.branches[i]);
+            branches[i].input = opts.branches[i];
+            branches[i].output = output;
+        }
+
+        int branch = Branch_fork(branches, opts.branch_count, opts.jobs);
+        if (branch >= 0) {
+            Executor_stop_at_eof(executor, false);
+            Executor_run(executor);
+        } else {
+            status = report_branches(branches, opts.branch_count);
+            branched = true;
+        }
+        for (int i = 0; i < opts.branch_count; i++)
+            free((char *)branches[i].output);
+        free(branches);
+    } else if (opts.branch_count > 0) {
+        fflush(stdout);
+        fprintf(stderr, "The program halted before its input ran out; no "
+                        "branches were run\n");
+        status = EXIT_FAILURE;
+    }
+    fflush(stdout);
+    if (memtrace != NULL && !free_mem_trace(&memtrace))
+        fprintf(stderr, "Could not write memory trace %s\n",
+                opts.trace_mem_file);
+    if (instrtrace != NULL && !free_instr_trace(&instrtrace))
+        fprintf(stderr, "Could not write trace %s\n", opts.trace_file);
+    if (profiler != NULL) {
+        Profiler_stop_timer(profiler);
+        FILE *profile = fopen(opts.profile_file, "w");
+        if (profile != NULL) {
+            Profiler_write(profiler, profile);
+            fclose(profile);
+        } else {
+            fprintf(stderr, "Could not write profile %s\n", opts.profile_file);
+        }
+        free_profiler(&profiler);
+    }
+    if (opts.stats)
+        print_stats(executor, memory, registers);
+
+    // A program stopped by its quota did not halt by itself
+    if (memory_quota_exceeded(memory)) {
+        fprintf(stderr,
+                "Memory quota of %" PRIu64 " words exceeded at pc %" PRIu32
+                "\n", opts.quota, pc - 1);
+        print_memory_stats(memory);
+        status = EXIT_FAILURE;
+    }
+    if (memory_exhausted(memory)) {
+        fprintf(stderr, "Out of segment identifiers at pc %" PRIu32 "\n",
+                pc - 1);
+        print_memory_stats(memory);
+        status = EXIT_FAILURE;
+    }
+    Stop stopped = Executor_stopped(executor);
+    if (stopped != STOP_NONE && !branched) {
+        const char *why = stopped == STOP_STEPS     ? "step limit reached"
+                          : stopped == STOP_TIMEOUT ? "timed out"
+                          : stopped == STOP_INPUT   ? "input ran out"
+                                                    : "cancelled";
+        fprintf(stderr,
+                "Stopped at pc %" PRIu32 " after %" PRIu64
+                " instructions: %s\n", pc, Executor_steps(executor), why);
+        status = EXIT_FAILURE;
+    }
+    MachineFault fault;
+    if (Executor_fault(executor, &fault)) {
+        fprintf(stderr,
+                "Machine failure at pc %" PRIu32 ": opcode %" PRIu32
+                " accessed word %" PRIu32 " of segment %" PRIu32 "\n",
+                fault.pc, fault.opcode, fault.index, fault.segment);
+        status = EXIT_FAILURE;
+    }
+
+    if (telemetry != NULL)
+        free_telemetry(&telemetry);
+    reported_executor = NULL;
+
+    // The compiler thread is stopped even on a fast exit, so that it does not
+    // leave a half-written cache entry behind. Everything else, the program's
+    // segments above all, is left for the process exit to reclaim in one go
     free_executor(&executor);
+    if (compiler != NULL)
+        free_compiler(&compiler);
+    if (opts.fast_exit)
+        return status;
+
+    if (checkpoint != NULL)
+        free_checkpoint(&checkpoint);
+    if (cache != NULL)
+        free_trans_cache(&cache);
     free_memory_module(&memory);
     free(registers);
+    free(opts.branches);
+    free(boot_file);
 
-    return EXIT_SUCCESS;
+    return status;
 }
\ No newline at end of file
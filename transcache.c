@@ -0,0 +1,234 @@
+#include "transcache.h"
+#include "hugepages.h"
+#include <assert.h>
+#include <errno.h>
+#include <mem.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC 0x43544d55u /* "UMTC" */
+#define CACHE_VERSION 2u
+#define PATH_LEN 4096
+
+struct TransTable {
+    unsigned capacity;
+    unsigned count;
+    Translation *entries; /* oldest first */
+    uint64_t hits;
+};
+
+struct TransCache {
+    char *dir;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/*
+ * Every cache file starts with this header, followed by length Instrs. The
+ * size of an Instr is recorded so that an entry written by a build with a
+ * different layout is rejected rather than misread.
+ */
+typedef struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t instr_size;
+    uint32_t length;
+    uint64_t hash;
+    uint64_t checksum;
+} Header;
+
+static void entry_path(TransCache cache, char *path, uint64_t hash,
+                       uint32_t length);
+
+TransTable new_trans_table(unsigned capacity)
+{
+    assert(capacity > 0);
+
+    TransTable table;
+    NEW(table);
+
+    table->capacity = capacity;
+    table->count = 0;
+    table->hits = 0;
+    table->entries = ALLOC(capacity * sizeof(Translation));
+
+    return table;
+}
+
+void free_trans_table(TransTable *table)
+{
+    assert(table != NULL && *table != NULL);
+
+    for (unsigned i = 0; i < (*table)->count; i++)
+        free_translation(&(*table)->entries[i]);
+    FREE((*table)->entries);
+    FREE(*table);
+}
+
+void TransTable_insert(TransTable table, Translation trans)
+{
+    assert(table != NULL && trans != NULL);
+
+    if (trans->patched) {
+        free_translation(&trans);
+        return;
+    }
+
+    // Evict the oldest entry to make room
+    if (table->count == table->capacity) {
+        free_translation(&table->entries[0]);
+        memmove(table->entries, table->entries + 1,
+                (table->count - 1) * sizeof(Translation));
+        table->count--;
+    }
+
+    table->entries[table->count++] = trans;
+}
+
+Translation TransTable_take(TransTable table, uint64_t hash, uint32_t length)
+{
+    assert(table != NULL);
+
+    for (unsigned i = 0; i < table->count; i++) {
+        Translation trans = table->entries[i];
+        if (trans->hash == hash && trans->length == length) {
+            memmove(table->entries + i, table->entries + i + 1,
+                    (table->count - i - 1) * sizeof(Translation));
+            table->count--;
+            table->hits++;
+            return trans;
+        }
+    }
+
+    return NULL;
+}
+
+uint64_t TransTable_hits(TransTable table)
+{
+    assert(table != NULL);
+    return table->hits;
+}
+
+TransCache new_trans_cache(const char *dir)
+{
+    assert(dir != NULL);
+
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+        return NULL;
+
+    TransCache cache;
+    NEW(cache);
+
+    cache->dir = ALLOC(strlen(dir) + 1);
+    strcpy(cache->dir, dir);
+    cache->hits = 0;
+    cache->misses = 0;
+
+    return cache;
+}
+
+void free_trans_cache(TransCache *cache)
+{
+    assert(cache != NULL && *cache != NULL);
+
+    FREE((*cache)->dir);
+    FREE(*cache);
+}
+
+Translation TransCache_lookup(TransCache cache, uint64_t hash,
+                              uint32_t length)
+{
+    assert(cache != NULL);
+
+    char path[PATH_LEN];
+    entry_path(cache, path, hash, length);
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        cache->misses++;
+        return NULL;
+    }
+
+    Header header;
+    Translation trans = NULL;
+    bool valid = fread(&header, sizeof(header), 1, fp) == 1 &&
+                 header.magic == CACHE_MAGIC &&
+                 header.version == CACHE_VERSION &&
+                 header.instr_size == sizeof(Instr) &&
+                 header.length == length && header.hash == hash;
+
+    if (valid) {
+        NEW(trans);
+        trans->hash = hash;
+        trans->length = length;
+        trans->patched = false;
+        trans->code = HugePages_alloc(Translation_code_size(length));
+
+        size_t nbytes = (size_t)length * sizeof(Instr);
+        valid = fread(trans->code, sizeof(Instr), length, fp) == length &&
+                fgetc(fp) == EOF &&
+                hash_bytes(trans->code, nbytes) == header.checksum;
+    }
+    fclose(fp);
+
+    if (!valid) {
+        // Corrupt or stale entry: drop it so it is rewritten on store
+        if (trans != NULL)
+            free_translation(&trans);
+        remove(path);
+        cache->misses++;
+        return NULL;
+    }
+
+    cache->hits++;
+    return trans;
+}
+
+void TransCache_store(TransCache cache, Translation trans)
+{
+    assert(cache != NULL && trans != NULL);
+
+    char path[PATH_LEN];
+    char tmp_path[PATH_LEN + 32];
+    entry_path(cache, path, trans->hash, trans->length);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path, (long)getpid());
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL)
+        return;
+
+    size_t nbytes = (size_t)trans->length * sizeof(Instr);
+    Header header = {CACHE_MAGIC,   CACHE_VERSION, sizeof(Instr),
+                     trans->length, trans->hash,   hash_bytes(trans->code,
+                                                              nbytes)};
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(trans->code, sizeof(Instr), trans->length, fp) ==
+                  trans->length;
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmp_path, path) != 0)
+        remove(tmp_path);
+}
+
+uint64_t TransCache_hits(TransCache cache)
+{
+    assert(cache != NULL);
+    return cache->hits;
+}
+
+uint64_t TransCache_misses(TransCache cache)
+{
+    assert(cache != NULL);
+    return cache->misses;
+}
+
+static void entry_path(TransCache cache, char *path, uint64_t hash,
+                       uint32_t length)
+{
+    snprintf(path, PATH_LEN, "%s/%016llx-%u.umtc", cache->dir,
+             (unsigned long long)hash, length);
+}
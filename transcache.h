@@ -0,0 +1,149 @@
+#ifndef TRANSCACHE_INCLUDED
+#define TRANSCACHE_INCLUDED
+
+#include "translation.h"
+#include <stdint.h>
+
+/*
+ * A small in-memory table of translations of programs that have been
+ * replaced by a load program instruction. When the same code is loaded
+ * again its translation is taken back out of the table instead of being
+ * rebuilt. The table owns the translations in it and evicts the least
+ * recently inserted one when full.
+ */
+typedef struct TransTable *TransTable;
+
+/*
+ * new_trans_table
+ *
+ * Creates an empty translation table.
+ *
+ * @param  unsigned capacity    The maximum number of translations to keep
+ * @return TransTable           The new table
+ * @expect capacity is greater than 0
+ */
+TransTable new_trans_table(unsigned capacity);
+
+/*
+ * free_trans_table
+ *
+ * Frees a translation table and every translation still in it.
+ *
+ * @param  TransTable *table    A pointer to the table to free
+ * @expect The table is not NULL
+ */
+void free_trans_table(TransTable *table);
+
+/*
+ * TransTable_insert
+ *
+ * Hands a translation over to the table, evicting the oldest entry if the
+ * table is full. Patched translations are freed instead of being kept.
+ *
+ * @param  TransTable table     The table to insert into
+ * @param  Translation trans    The translation to insert
+ * @expect trans is not already in the table
+ */
+void TransTable_insert(TransTable table, Translation trans);
+
+/*
+ * TransTable_take
+ *
+ * Removes and returns the translation of the program segment with the given
+ * hash and length.
+ *
+ * @param  TransTable table     The table to search
+ * @param  uint64_t hash        Translation_hash of the program segment
+ * @param  uint32_t length      The length of the program segment in words
+ * @return Translation          The translation, now owned by the caller, or
+ *                              NULL if the table has none
+ */
+Translation TransTable_take(TransTable table, uint64_t hash, uint32_t length);
+
+/*
+ * TransTable_hits
+ *
+ * @param  TransTable table     The table to query
+ * @return uint64_t             The number of translations taken back out of
+ *                              the table
+ */
+uint64_t TransTable_hits(TransTable table);
+
+/*
+ * An on-disk cache of translated programs. Each entry lives in its own file
+ * in the cache directory, named after the hash and length of the program
+ * segment it was built from, so repeated runs of the same image (and every
+ * lodp that installs the same code) can skip translation entirely.
+ */
+typedef struct TransCache *TransCache;
+
+/*
+ * new_trans_cache
+ *
+ * Opens a translation cache rooted at the given directory, creating the
+ * directory if it does not exist yet.
+ *
+ * @param  char *dir            The path of the cache directory
+ * @return TransCache           The new cache, or NULL if the directory could
+ *                              not be created
+ * @expect dir is not NULL
+ */
+TransCache new_trans_cache(const char *dir);
+
+/*
+ * free_trans_cache
+ *
+ * Frees a translation cache. Entries already written stay on disk.
+ *
+ * @param  TransCache *cache    A pointer to the cache to free
+ * @expect The cache is not NULL
+ */
+void free_trans_cache(TransCache *cache);
+
+/*
+ * TransCache_lookup
+ *
+ * Looks up the translation of a program segment. Entries whose header,
+ * length, hash or checksum do not match are treated as misses and removed, so
+ * a corrupt or stale cache only costs a retranslation.
+ *
+ * @param  TransCache cache     The cache to search
+ * @param  uint64_t hash        Translation_hash of the program segment
+ * @param  uint32_t length      The length of the program segment in words
+ * @return Translation          A new translation owned by the caller, or NULL
+ *                              on a miss
+ */
+Translation TransCache_lookup(TransCache cache, uint64_t hash,
+                              uint32_t length);
+
+/*
+ * TransCache_store
+ *
+ * Writes a translation to the cache. The entry is written to a temporary
+ * file and renamed into place, so concurrent runs never see a partial entry.
+ * Failures are silently ignored.
+ *
+ * @param  TransCache cache     The cache to write to
+ * @param  Translation trans    The translation to store
+ * @expect trans is an unpatched translation
+ */
+void TransCache_store(TransCache cache, Translation trans);
+
+/*
+ * TransCache_hits
+ *
+ * @param  TransCache cache     The cache to query
+ * @return uint64_t             The number of lookups that found a valid entry
+ */
+uint64_t TransCache_hits(TransCache cache);
+
+/*
+ * TransCache_misses
+ *
+ * @param  TransCache cache     The cache to query
+ * @return uint64_t             The number of lookups that found no entry or
+ *                              rejected a corrupt or stale one
+ */
+uint64_t TransCache_misses(TransCache cache);
+
+#endif
@@ -0,0 +1,110 @@
+#include "translation.h"
+#include "bitpack.h"
+#include "hugepages.h"
+#include <assert.h>
+#include <mem.h>
+#include <string.h>
+
+#define OPCODE_WIDTH 4
+#define OPCODE_LSB 28
+#define LODV_OPCODE 13
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+Translation new_translation(const uint32_t *words, uint32_t length,
+                            uint64_t hash)
+{
+    assert(words != NULL || length == 0);
+
+    Translation trans;
+    NEW(trans);
+
+    trans->hash = hash;
+    trans->length = length;
+    trans->patched = false;
+    trans->code = HugePages_alloc(Translation_code_size(length));
+
+    for (uint32_t i = 0; i < length; i++)
+        trans->code[i] = Translation_decode(words[i]);
+
+    return trans;
+}
+
+void free_translation(Translation *trans)
+{
+    assert(trans != NULL && *trans != NULL);
+
+    HugePages_free((*trans)->code, Translation_code_size((*trans)->length));
+    FREE(*trans);
+}
+
+size_t Translation_code_size(uint32_t length)
+{
+    return (size_t)(length > 0 ? length : 1) * sizeof(Instr);
+}
+
+void Translation_patch(Translation trans, uint32_t index, uint32_t word)
+{
+    assert(trans != NULL);
+    assert(index < trans->length);
+
+    trans->code[index] = Translation_decode(word);
+    trans->patched = true;
+}
+
+void Translation_invalidate(Translation trans, uint32_t first, uint32_t count)
+{
+    for (uint32_t i = first; i < first + count; i++)
+        trans->code[i].opcode = INSTR_STALE;
+    trans->patched = true;
+}
+
+Instr Translation_decode(uint32_t word)
+{
+    Instr instr;
+    instr.opcode = Bitpack_getu(word, OPCODE_WIDTH, OPCODE_LSB);
+
+    if (instr.opcode == LODV_OPCODE) {
+        instr.ra = Bitpack_getu(word, 3, 25);
+        instr.rb = 0;
+        instr.rc = 0;
+        instr.value = Bitpack_getu(word, 25, 0);
+    } else {
+        instr.ra = Bitpack_getu(word, 3, 6);
+        instr.rb = Bitpack_getu(word, 3, 3);
+        instr.rc = Bitpack_getu(word, 3, 0);
+        instr.value = 0;
+    }
+
+    return instr;
+}
+
+uint64_t Translation_hash(const uint32_t *words, uint32_t length)
+{
+    return hash_bytes(words, (size_t)length * sizeof(uint32_t));
+}
+
+uint64_t hash_bytes(const void *data, size_t nbytes)
+{
+    const unsigned char *bytes = data;
+    uint64_t hash = FNV_OFFSET;
+    size_t i = 0;
+
+    // FNV-1a over whole 64-bit words, folding the high half of each product
+    // back down so that every input bit reaches the low bits of the hash
+    for (; i + sizeof(uint64_t) <= nbytes; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash ^= word;
+        hash *= FNV_PRIME;
+        hash ^= hash >> 32;
+    }
+
+    for (; i < nbytes; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
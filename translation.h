@@ -0,0 +1,134 @@
+#ifndef TRANSLATION_INCLUDED
+#define TRANSLATION_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A pre-decoded UM instruction. Every field of the original word is unpacked
+ * once, so executing it needs no Bitpack calls. For load value instructions
+ * the destination register is stored in ra.
+ */
+typedef struct Instr {
+    uint8_t opcode;
+    uint8_t ra;
+    uint8_t rb;
+    uint8_t rc;
+    uint32_t value;
+} Instr;
+
+/*
+ * The opcode of an instruction whose translation has been invalidated by
+ * Translation_invalidate. It must be re-decoded before it is executed.
+ */
+#define INSTR_STALE 0xFF
+
+/*
+ * The translated form of a program segment: one decoded instruction per word,
+ * together with the hash of the words it was built from. A translation that
+ * has been patched no longer matches its hash and is never cached.
+ */
+typedef struct Translation {
+    uint64_t hash;
+    uint32_t length;
+    bool patched;
+    Instr *code;
+} *Translation;
+
+/*
+ * new_translation
+ *
+ * Decodes every word of a program segment.
+ *
+ * @param  uint32_t *words      The words of the program segment
+ * @param  uint32_t length      The number of words in the segment
+ * @param  uint64_t hash        Translation_hash of the words
+ * @return Translation          The new translation
+ * @expect words is not NULL unless length is 0
+ */
+Translation new_translation(const uint32_t *words, uint32_t length,
+                            uint64_t hash);
+
+/*
+ * free_translation
+ *
+ * Frees a translation and sets the client's pointer to NULL.
+ *
+ * @param  Translation *trans   A pointer to the translation to free
+ * @expect The translation is not NULL
+ */
+void free_translation(Translation *trans);
+
+/*
+ * Translation_code_size
+ *
+ * @param  uint32_t length      The number of words in a program segment
+ * @return size_t               The size in bytes of the code array of its
+ *                              translation, which is allocated with
+ *                              HugePages_alloc
+ */
+size_t Translation_code_size(uint32_t length);
+
+/*
+ * Translation_patch
+ *
+ * Re-decodes a single word after the program segment has been written to,
+ * and marks the translation as patched.
+ *
+ * @param  Translation trans    The translation to update
+ * @param  uint32_t index       The index of the word that changed
+ * @param  uint32_t word        The new value of the word
+ * @expect index is less than the length of the translation
+ */
+void Translation_patch(Translation trans, uint32_t index, uint32_t word);
+
+/*
+ * Translation_invalidate
+ *
+ * Marks a run of instructions as stale without looking at segment 0, and
+ * marks the translation as patched. Only plain stores are involved, so this
+ * may be called from a signal handler.
+ *
+ * @param  Translation trans    The translation to update
+ * @param  uint32_t first       The index of the first stale instruction
+ * @param  uint32_t count       The number of stale instructions
+ * @expect first + count is at most the length of the translation
+ */
+void Translation_invalidate(Translation trans, uint32_t first, uint32_t count);
+
+/*
+ * Translation_decode
+ *
+ * Decodes a single instruction word.
+ *
+ * @param  uint32_t word        The instruction word
+ * @return Instr                The decoded instruction
+ */
+Instr Translation_decode(uint32_t word);
+
+/*
+ * Translation_hash
+ *
+ * Hashes the contents of a program segment. Translations are keyed by this
+ * hash together with the segment length.
+ *
+ * @param  uint32_t *words      The words to hash
+ * @param  uint32_t length      The number of words
+ * @return uint64_t             The hash of the words
+ */
+uint64_t Translation_hash(const uint32_t *words, uint32_t length);
+
+/*
+ * hash_bytes
+ *
+ * 64-bit hash of an arbitrary block of memory: FNV-1a taken eight bytes at a
+ * time, so hashing a segment costs one multiply per two words.
+ *
+ * @param  void *data           The bytes to hash
+ * @param  size_t nbytes        The number of bytes
+ * @return uint64_t             The hash of the bytes
+ */
+uint64_t hash_bytes(const void *data, size_t nbytes);
+
+#endif
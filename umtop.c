@@ -0,0 +1,99 @@
+/*
+ * umtop: shows the telemetry of running VMs, started with um --telemetry,
+ * refreshed every second. With process IDs, only those VMs are shown;
+ * otherwise every VM with a page in /dev/shm is. The VMs are not stopped or
+ * slowed down by being watched.
+ */
+#include "telemetry.h"
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_VMS 256
+#define SHM_DIR "/dev/shm"
+
+static const char *state_names[] = {"run", "halt", "stop", "fail"};
+
+/*
+ * Finds the VMs to show: the given process IDs, or every one with a page.
+ * Returns how many were found.
+ */
+static int find_vms(int argc, char *argv[], pid_t *pids)
+{
+    int count = 0;
+    for (int i = 0; i < argc && count < MAX_VMS; i++)
+        pids[count++] = (pid_t)strtol(argv[i], NULL, 10);
+    if (argc > 0)
+        return count;
+
+    DIR *dir = opendir(SHM_DIR);
+    if (dir == NULL)
+        return 0;
+    size_t prefix = strlen(TELEMETRY_PREFIX);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL && count < MAX_VMS)
+        if (strncmp(entry->d_name, TELEMETRY_PREFIX, prefix) == 0)
+            pids[count++] = (pid_t)strtol(entry->d_name + prefix, NULL, 10);
+    closedir(dir);
+
+    return count;
+}
+
+/*
+ * Prints one line per VM. Pages left behind by processes that died without
+ * removing them are skipped.
+ */
+static void show(pid_t *pids, int count)
+{
+    printf("%8s %-4s %14s %9s %9s %11s %12s %10s %10s  %s\n", "PID",
+           "STAT", "INSTRUCTIONS", "MIPS", "SEGMENTS", "WORDS", "JUMPS", "IN",
+           "OUT", "PROGRAM");
+
+    for (int i = 0; i < count; i++) {
+        if (kill(pids[i], 0) != 0 && errno == ESRCH)
+            continue;
+        const TelemetryPage *page = open_telemetry(pids[i]);
+        if (page == NULL)
+            continue;
+
+        TelemetryPage vm;
+        if (Telemetry_snapshot(page, &vm))
+            printf("%8" PRId64 " %-4s %14" PRIu64 " %9.2f %9" PRIu64
+                   " %11" PRIu64 " %12" PRIu64 " %10" PRIu64 " %10" PRIu64
+                   "  %.*s\n",
+                   vm.pid, vm.state < 4 ? state_names[vm.state] : "?",
+                   vm.steps, vm.ips / 1e6, vm.live_segments, vm.live_words,
+                   vm.jumps, vm.input_bytes, vm.output_bytes,
+                   TELEMETRY_PROGRAM, vm.program);
+        close_telemetry(&page);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bool once = argc > 1 && strcmp(argv[1], "--once") == 0;
+    int first = once ? 2 : 1;
+    for (int i = first; i < argc; i++) {
+        if (argv[i][0] < '0' || argv[i][0] > '9') {
+            fprintf(stderr, "Usage: %s [--once] [<pid>...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    pid_t pids[MAX_VMS];
+    for (;;) {
+        int count = find_vms(argc - first, argv + first, pids);
+        if (!once)
+            printf("\033[H\033[2J"); // home the cursor and clear the screen
+        show(pids, count);
+        fflush(stdout);
+        if (once)
+            return EXIT_SUCCESS;
+        sleep(1);
+    }
+}
@@ -0,0 +1,70 @@
+/*
+ * umtrace: prints the instructions of a trace written by um --trace, one
+ * line each: the instruction count, the pc, the word and its opcode, and the
+ * registers before the instruction executed. Printing can start at any
+ * instruction count, which is found through the sync records of the trace
+ * without decoding what comes before them.
+ */
+#include "instrtrace.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static const char *opcode_names[16] = {
+    "cmov", "sload", "sstore", "add",  "mul", "div",   "nand",  "halt",
+    "map",  "unmap", "out",    "in",   "lodp", "lodv", "bad14", "bad15"};
+
+/*
+ * Parses an instruction count. Returns false if arg is not a decimal number.
+ */
+static bool parse_count(const char *arg, uint64_t *count)
+{
+    char *end;
+    *count = strtoull(arg, &end, 10);
+
+    return *arg != '\0' && *end == '\0';
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t from = 0, count = UINT64_MAX;
+    if (argc < 2 || argc > 4 || (argc > 2 && !parse_count(argv[2], &from)) ||
+        (argc > 3 && !parse_count(argv[3], &count))) {
+        fprintf(stderr, "Usage: %s <trace> [<from> [<count>]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    InstrTraceReader reader = open_instr_trace(argv[1]);
+    if (reader == NULL) {
+        fprintf(stderr, "Could not read trace %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    if (!InstrTraceReader_seek(reader, from)) {
+        fprintf(stderr, "Could not seek to instruction %" PRIu64 " of %" PRIu64
+                "\n", from, InstrTraceReader_length(reader));
+        close_instr_trace(&reader);
+        return EXIT_FAILURE;
+    }
+
+    InstrStep step;
+    uint64_t printed = 0;
+    while (printed < count && InstrTraceReader_next(reader, &step)) {
+        printf("%" PRIu64 " %#" PRIx32 " %08" PRIx32 " %-6s", step.steps,
+               step.pc, step.word, opcode_names[step.word >> 28]);
+        for (int r = 0; r < 8; r++)
+            printf(" %" PRIx32, step.registers[r]);
+        putchar('\n');
+        printed++;
+    }
+
+    // Stopping short of the end means the trace is damaged
+    bool complete = printed == count ||
+                    from + printed == InstrTraceReader_length(reader);
+    close_instr_trace(&reader);
+    if (!complete) {
+        fprintf(stderr, "Trace %s ends early\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}